@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct BitrateLimits {
+    uint32_t minKbps = 150;
+    uint32_t startKbps = 1000;
+    uint32_t maxKbps = 2500;
+};
+
+struct ViewerBandwidthStats {
+    std::string viewerId;
+    uint32_t estimateKbps;
+    double lossPercent;   // from the latest receiver report
+    double jitterMs;
+    uint32_t rembKbps;    // 0 when the viewer sends no REMB
+    int64_t rttMs;        // -1 when unknown
+    uint64_t reports;
+    uint64_t bytesSent;   // by the peer connection, all media and RTCP
+    uint32_t sendKbps;    // media sent between the last two reports
+};
+
+// Loss-based send rate estimate for one viewer, in the style of the GCC
+// loss controller: back off in proportion to loss above 10%, probe up 5%
+// per report below 2%, and never exceed the viewer's REMB. Low loss only
+// vouches for the rate actually sent, so increases stop at 1.5 times the
+// send rate measured between reports; an idle or app-limited viewer holds
+// its estimate instead of drifting to the ceiling. Fed from the RTCP
+// thread, read by the bitrate controller.
+class ViewerBandwidthEstimator {
+public:
+    explicit ViewerBandwidthEstimator(BitrateLimits limits = {})
+        : limits(limits), estimateKbps(limits.startKbps) {}
+
+    // `fractionLost` and `jitter` straight from an RR report block (1/256
+    // units and 90 kHz RTP ticks); `bytesSent` is the viewer's media total
+    // so far.
+    void onReceiverReport(uint8_t fractionLost, uint32_t jitter, uint64_t bytesSent,
+                          std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double loss = fractionLost / 256.0;
+        lossPercent = 100.0 * loss;
+        jitterMs = jitter / 90.0;
+        // Reports closer together than this say too little about the rate
+        bool measured = reports > 0 && now - lastReportAt >= std::chrono::milliseconds(200);
+        if (measured) {
+            double seconds = std::chrono::duration<double>(now - lastReportAt).count();
+            sendKbps = static_cast<uint32_t>((bytesSent - lastBytesSent) * 8 / seconds / 1000);
+        }
+        if (reports == 0 || measured) {
+            lastReportAt = now;
+            lastBytesSent = bytesSent;
+        }
+        ++reports;
+        if (loss > 0.10) {
+            estimateKbps = static_cast<uint32_t>(estimateKbps * (1.0 - 0.5 * loss));
+        } else if (loss < 0.02 && measured) {
+            uint32_t cap = static_cast<uint32_t>(sendKbps * 1.5);
+            if (estimateKbps < cap) {
+                estimateKbps = std::min(cap, static_cast<uint32_t>(estimateKbps * 1.05) + 1);
+            }
+        }
+        clampLocked();
+    }
+
+    void onRemb(uint64_t bitsPerSecond) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rembKbps = static_cast<uint32_t>(std::min<uint64_t>(bitsPerSecond / 1000, UINT32_MAX));
+        clampLocked();
+    }
+
+    ViewerBandwidthStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {std::string(), estimateKbps, lossPercent, jitterMs, rembKbps, -1, reports, 0, sendKbps};
+    }
+
+private:
+    void clampLocked() {
+        uint32_t ceiling = limits.maxKbps;
+        if (rembKbps > 0) {
+            ceiling = std::min(ceiling, rembKbps);
+        }
+        estimateKbps = std::max(limits.minKbps, std::min(estimateKbps, ceiling));
+    }
+
+    mutable std::mutex mutex;
+    BitrateLimits limits;
+    uint32_t estimateKbps;
+    uint32_t rembKbps = 0;
+    double lossPercent = 0;
+    double jitterMs = 0;
+    uint64_t reports = 0;
+    uint32_t sendKbps = 0;
+    uint64_t lastBytesSent = 0;
+    std::chrono::steady_clock::time_point lastReportAt;
+};
+
+// Picks one encoder bitrate from all viewers' estimates: the estimate at
+// `percentile` (0 = weakest viewer). Decreases apply at once; increases
+// need a 10% margin and are capped at +15% per update so one good report
+// does not overshoot.
+class BitrateController {
+public:
+    struct Metrics {
+        uint32_t targetKbps;
+        uint32_t chosenEstimateKbps;  // estimate at the percentile, last update
+        size_t viewers;
+        uint64_t increases;
+        uint64_t decreases;
+    };
+
+    BitrateController(BitrateLimits limits, double percentile)
+        : limits(limits), percentile(percentile), targetKbps(limits.startKbps) {}
+
+    // Returns true when the encoder should be reconfigured to target().
+    bool update(std::vector<uint32_t> estimates) {
+        lastViewers = estimates.size();
+        if (estimates.empty()) {
+            return false;
+        }
+        size_t index = std::min(estimates.size() - 1, static_cast<size_t>(percentile / 100.0 * estimates.size()));
+        std::nth_element(estimates.begin(), estimates.begin() + index, estimates.end());
+        chosen = estimates[index];
+
+        uint32_t next = targetKbps;
+        if (chosen < targetKbps * 0.95) {
+            next = chosen;
+        } else if (chosen > targetKbps * 1.10) {
+            next = std::min(chosen, static_cast<uint32_t>(targetKbps * 1.15));
+        }
+        next = std::max(limits.minKbps, std::min(next, limits.maxKbps));
+        if (next == targetKbps) {
+            return false;
+        }
+        (next > targetKbps ? increases : decreases)++;
+        targetKbps = next;
+        return true;
+    }
+
+    uint32_t target() const { return targetKbps; }
+
+    Metrics metrics() const {
+        return {targetKbps, chosen, lastViewers, increases, decreases};
+    }
+
+private:
+    BitrateLimits limits;
+    double percentile;
+    uint32_t targetKbps;
+    uint32_t chosen = 0;
+    size_t lastViewers = 0;
+    uint64_t increases = 0;
+    uint64_t decreases = 0;
+};
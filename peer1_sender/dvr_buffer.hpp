@@ -0,0 +1,508 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "fanout_engine.hpp"
+#include "logger.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory dvrLog("dvr");
+
+struct DvrConfig {
+    std::chrono::seconds window{0};  // how far back viewers may start; 0 disables
+    size_t bytes = size_t(256) << 20;  // ring size; at high bitrates it bounds the window first
+    // Back the ring with an unlinked file in this directory, so the kernel
+    // can write it back instead of keeping it in RAM. Empty: anonymous memory.
+    std::string spillDir;
+    double catchUpSpeed = 1.0;  // for viewers that do not ask; 1 stays behind live
+};
+
+// What a joining viewer asked for.
+struct TimeShift {
+    std::chrono::milliseconds delay{0};  // behind live; 0 joins live
+    double catchUpSpeed = 0;  // playback speed until live is reached; 0 takes DvrConfig's
+};
+
+// Ring of the most recent frames as they were sent, with a keyframe index.
+// Frames are stored back to back in one fixed block of bytes, each packet
+// behind a 2-byte length; the oldest frames are dropped when the block, the
+// frame table or the window is full. Not thread safe.
+class DvrBuffer {
+public:
+    static constexpr int64_t kClockRate = 90000;
+
+    struct Frame {
+        int64_t ticks;    // RTP timestamp, unwrapped
+        uint64_t offset;  // of the first length prefix, counted since the first frame
+        uint32_t length;  // bytes, length prefixes included
+        uint32_t packets;
+        bool keyframe;
+    };
+
+    DvrBuffer(size_t capacityBytes, size_t maxFrames, std::chrono::seconds window, const std::string& spillDir)
+        : capacityBytes(capacityBytes), windowTicks(window.count() * kClockRate),
+          frames(std::max<size_t>(maxFrames, 2)), keyframes(frames.size()) {
+        int fd = -1;
+        if (!spillDir.empty()) {
+            std::string path = spillDir + "/dvr-XXXXXX";
+            fd = mkstemp(path.data());
+            if (fd < 0) {
+                throw std::runtime_error("Cannot create DVR spill file in " + spillDir);
+            }
+            unlink(path.c_str());
+            if (ftruncate(fd, static_cast<off_t>(capacityBytes)) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Cannot size DVR spill file in " + spillDir);
+            }
+        }
+        void *mapped = fd < 0 ? mmap(nullptr, capacityBytes, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)
+                              : mmap(nullptr, capacityBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Cannot map " + std::to_string(capacityBytes >> 20) + " MB for the DVR");
+        }
+        base = static_cast<std::byte*>(mapped);
+    }
+
+    ~DvrBuffer() { munmap(base, capacityBytes); }
+
+    DvrBuffer(const DvrBuffer&) = delete;
+    DvrBuffer& operator=(const DvrBuffer&) = delete;
+
+    // Stores one access unit and returns its number. A frame too large for
+    // the ring empties it instead, and shares its number with the next.
+    uint64_t append(const std::vector<RtpPacketRef>& packets) {
+        const uint64_t number = next;
+        if (packets.empty()) {
+            return number;
+        }
+        uint32_t timestamp = rtp::timestamp(packets.front()->data());
+        ticks = next == 0 && first == 0 ? timestamp : ticks + static_cast<int32_t>(timestamp - lastTimestamp);
+        lastTimestamp = timestamp;
+
+        size_t length = 0;
+        uint32_t count = 0;
+        bool keyframe = false;
+        for (const RtpPacketRef& packet : packets) {
+            if (packet->size() <= kMaxPacketSize) {
+                length += 2 + packet->size();
+                ++count;
+                keyframe = keyframe || rtp::isH264KeyframeStart(packet->data(), packet->size());
+            }
+        }
+        if (length > capacityBytes / 2) {
+            first = next;
+            keyframeFirst = keyframeNext;
+            return number;
+        }
+
+        // A frame never wraps; the tail it does not fit in is skipped.
+        uint64_t offset = writeOffset;
+        if (offset % capacityBytes + length > capacityBytes) {
+            offset += capacityBytes - offset % capacityBytes;
+        }
+        while (first < next && (offset + length - frame(first).offset > capacityBytes ||
+                                next - first == frames.size() || ticks - frame(first).ticks > windowTicks)) {
+            ++first;
+            if (keyframeFirst < keyframeNext && keyframeAt(keyframeFirst) < first) {
+                ++keyframeFirst;
+            }
+        }
+
+        std::byte *out = base + offset % capacityBytes;
+        for (const RtpPacketRef& packet : packets) {
+            if (packet->size() > kMaxPacketSize) {
+                continue;
+            }
+            uint16_t size = static_cast<uint16_t>(packet->size());
+            std::memcpy(out, &size, sizeof(size));
+            std::memcpy(out + 2, packet->data(), size);
+            out += 2 + size;
+        }
+        frames[next % frames.size()] = {ticks, offset, static_cast<uint32_t>(length), count, keyframe};
+        if (keyframe) {
+            keyframes[keyframeNext % keyframes.size()] = next;
+            ++keyframeNext;
+        }
+        writeOffset = offset + length;
+        ++next;
+        return number;
+    }
+
+    // Frames begin() to end() - 1 are held.
+    uint64_t begin() const { return first; }
+    uint64_t end() const { return next; }
+    const Frame& frame(uint64_t number) const { return frames[number % frames.size()]; }
+
+    // `visit(const std::byte *data, size_t size)` for each packet of `frame`.
+    template <typename Visit>
+    void forEachPacket(const Frame& frame, Visit&& visit) const {
+        const std::byte *in = base + frame.offset % capacityBytes;
+        for (uint32_t i = 0; i < frame.packets; ++i) {
+            uint16_t size;
+            std::memcpy(&size, in, sizeof(size));
+            visit(in + 2, size);
+            in += 2 + size;
+        }
+    }
+
+    // The newest keyframe at or before `at`, else the oldest one; end() when
+    // none is held.
+    uint64_t keyframeAtOrBefore(int64_t at) const {
+        if (keyframeFirst == keyframeNext) {
+            return end();
+        }
+        uint64_t low = keyframeFirst;
+        uint64_t high = keyframeNext;
+        while (high - low > 1) {
+            uint64_t middle = low + (high - low) / 2;
+            if (frame(keyframeAt(middle)).ticks <= at) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        return keyframeAt(low);
+    }
+
+    // The oldest keyframe numbered `number` or later; end() when none is held.
+    uint64_t keyframeAtOrAfter(uint64_t number) const {
+        for (uint64_t i = keyframeFirst; i < keyframeNext; ++i) {
+            if (keyframeAt(i) >= number) {
+                return keyframeAt(i);
+            }
+        }
+        return end();
+    }
+
+    // Ticks between frame `number` and the one before it, or the one after
+    // when it is the oldest held; 0 when it is the only one.
+    int64_t interval(uint64_t number) const {
+        if (number > first) {
+            return frame(number).ticks - frame(number - 1).ticks;
+        }
+        return number + 1 < next ? frame(number + 1).ticks - frame(number).ticks : 0;
+    }
+
+    int64_t newestTicks() const { return first == next ? 0 : frame(next - 1).ticks; }
+
+    double bufferedSeconds() const {
+        return first == next ? 0.0 : double(newestTicks() - frame(first).ticks) / kClockRate;
+    }
+
+    size_t bytesUsed() const { return first == next ? 0 : static_cast<size_t>(writeOffset - frame(first).offset); }
+    size_t capacity() const { return capacityBytes; }
+
+private:
+    static constexpr size_t kMaxPacketSize = 0xFFFF;
+
+    uint64_t keyframeAt(uint64_t index) const { return keyframes[index % keyframes.size()]; }
+
+    const size_t capacityBytes;
+    const int64_t windowTicks;
+    std::byte *base = nullptr;
+    std::vector<Frame> frames;        // frame n at n % size
+    std::vector<uint64_t> keyframes;  // numbers of keyframes, same layout
+    uint64_t first = 0;
+    uint64_t next = 0;
+    uint64_t keyframeFirst = 0;
+    uint64_t keyframeNext = 0;
+    uint64_t writeOffset = 0;
+    int64_t ticks = 0;
+    uint32_t lastTimestamp = 0;
+};
+
+// Serves time-shifted viewers from a DvrBuffer on one thread, however many
+// there are. Each viewer is a cursor into the buffer: its frames are copied
+// into its fan-out queue when due, with timestamps rewritten so that the
+// viewer sees a continuous stream. Above 1x the gap to live shrinks; once it
+// is gone and the cursor reaches the newest frame, the viewer is handed back
+// to live fan-out, with timestamps that already match it.
+class DvrPlayer {
+public:
+    // Whether the viewer can receive media yet.
+    using Ready = std::function<bool()>;
+    // Called under the buffer lock when the viewer leaves the DVR: frames
+    // numbered `liveFrom` and later go to it live. `caughtUp` is false when
+    // nothing was buffered to start from.
+    using GoLive = std::function<void(uint64_t liveFrom, bool caughtUp)>;
+
+    static constexpr double kMaxCatchUpSpeed = 4.0;
+
+    DvrPlayer(const DvrConfig& config, FanoutEngine& fanout)
+        // At most 120 frames per second over the window
+        : config(config), fanout(fanout),
+          buffer(config.bytes, static_cast<size_t>(config.window.count()) * 120, config.window, config.spillDir) {}
+
+    ~DvrPlayer() { stop(); }
+
+    void start() {
+        stop();
+        stopping = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // Streaming thread: records a frame before it goes out live, and returns
+    // its number for GoLive comparisons.
+    uint64_t append(const std::vector<RtpPacketRef>& frame) {
+        uint64_t number;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            number = buffer.append(frame);
+        }
+        if (viewers.load(std::memory_order_relaxed) > 0) {
+            cv.notify_one();
+        }
+        return number;
+    }
+
+    // Starts `shift.delay` behind live, counted from when the viewer becomes
+    // ready; the start moves back to the keyframe before that point, or up
+    // to the oldest one held.
+    void addViewer(std::weak_ptr<ViewerQueue> queue, const TimeShift& shift, Ready ready, GoLive goLive) {
+        auto reader = std::make_unique<Reader>();
+        reader->queue = std::move(queue);
+        reader->delay = shift.delay;
+        double speed = shift.catchUpSpeed > 0 ? shift.catchUpSpeed : config.catchUpSpeed;
+        reader->speed = std::clamp(speed, 1.0, kMaxCatchUpSpeed);
+        reader->ready = std::move(ready);
+        reader->goLive = std::move(goLive);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(reader));
+        }
+        viewers.fetch_add(1, std::memory_order_relaxed);
+        cv.notify_one();
+    }
+
+    struct Stats {
+        double bufferedSeconds;
+        size_t bytesUsed;
+        size_t capacityBytes;
+        size_t viewers;     // served from the buffer right now
+        uint64_t caughtUp;  // handed back to live
+    };
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {buffer.bufferedSeconds(), buffer.bytesUsed(), buffer.capacity(),
+                viewers.load(std::memory_order_relaxed), caughtUp.load(std::memory_order_relaxed)};
+    }
+
+private:
+    // How often viewers waiting for their track are checked.
+    static constexpr std::chrono::milliseconds kPollInterval{10};
+    // Frames sent to one viewer before the next gets a turn.
+    static constexpr size_t kFramesPerPass = 8;
+
+    struct Reader {
+        std::weak_ptr<ViewerQueue> queue;
+        std::chrono::milliseconds delay;
+        double speed;
+        Ready ready;
+        GoLive goLive;
+        bool started = false;
+        bool needKeyframe = false;
+        uint64_t next = 0;         // frame to send next
+        int64_t lastTicks = 0;     // of the last frame sent, before and after rewriting
+        int64_t lastOutput = 0;
+        // Frame timestamps are paced from here: output ticks t are due at
+        // anchor + (t - anchorTicks).
+        std::chrono::steady_clock::time_point anchor;
+        int64_t anchorTicks = 0;
+        std::vector<RtpPacketRef> packets;  // frame being handed over
+        std::vector<bool> keyframeStarts;
+    };
+
+    void run() {
+        std::vector<std::unique_ptr<Reader>> readers;
+        auto wakeAt = std::chrono::steady_clock::now();
+        uint64_t seen = 0;  // buffer.end() at the last pass
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait_until(lock, wakeAt, [&]() { return stopping || !pending.empty() || buffer.end() != seen; });
+                if (stopping) {
+                    break;
+                }
+                seen = buffer.end();
+                for (auto& reader : pending) {
+                    readers.push_back(std::move(reader));
+                }
+                pending.clear();
+            }
+            auto now = std::chrono::steady_clock::now();
+            // Waiting for a new frame needs no timer; append() wakes us.
+            wakeAt = now + std::chrono::seconds(1);
+            for (auto it = readers.begin(); it != readers.end();) {
+                if (serve(**it, now, wakeAt)) {
+                    ++it;
+                } else {
+                    it = readers.erase(it);
+                    viewers.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        viewers.fetch_sub(readers.size(), std::memory_order_relaxed);
+    }
+
+    // Sends what is due to one viewer and lowers `wakeAt` to when more will
+    // be. False once the viewer has gone or left the DVR.
+    bool serve(Reader& reader, std::chrono::steady_clock::time_point now,
+               std::chrono::steady_clock::time_point& wakeAt) {
+        std::shared_ptr<ViewerQueue> queue = reader.queue.lock();
+        if (!queue) {
+            return false;
+        }
+        if (!reader.started) {
+            if (!reader.ready()) {
+                wakeAt = std::min(wakeAt, now + kPollInterval);
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!startReader(reader, now, queue->viewerId)) {
+                reader.goLive(buffer.end(), false);
+                return false;
+            }
+        }
+        for (size_t sent = 0; sent < kFramesPerPass; ++sent) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!nextFrame(reader)) {
+                    if (reader.needKeyframe || reader.lastOutput != reader.lastTicks) {
+                        return true;
+                    }
+                    // Caught up; frames appended from here on go out live.
+                    // The last push above happened before this lock, so the
+                    // queue keeps one producer at a time.
+                    reader.goLive(reader.next, true);
+                    caughtUp.fetch_add(1, std::memory_order_relaxed);
+                    log_info(dvrLog, {{"viewer", queue->viewerId}}, "Caught up with live");
+                    return false;
+                }
+                const DvrBuffer::Frame& frame = buffer.frame(reader.next);
+                int64_t output = outputTicks(reader, frame.ticks);
+                auto due = reader.anchor + std::chrono::microseconds((output - reader.anchorTicks) * 1000000 /
+                                                                     DvrBuffer::kClockRate);
+                if (due > now) {
+                    wakeAt = std::min(wakeAt, due);
+                    return true;
+                }
+                copyFrame(reader, frame, static_cast<uint32_t>(output));
+                reader.lastTicks = frame.ticks;
+                reader.lastOutput = output;
+                ++reader.next;
+            }
+            if (!reader.packets.empty()) {
+                fanout.enqueueFrame(*queue, reader.packets, reader.keyframeStarts);
+            }
+        }
+        wakeAt = now;
+        return true;
+    }
+
+    // Under `mutex`. The first frame's timestamp is pushed forward by the
+    // whole delay, so the viewer starts on live's timeline and the lag shrinks
+    // to zero exactly as it catches up.
+    bool startReader(Reader& reader, std::chrono::steady_clock::time_point now, const std::string& viewerId) {
+        int64_t newest = buffer.newestTicks();
+        uint64_t start = buffer.keyframeAtOrBefore(newest - reader.delay.count() * DvrBuffer::kClockRate / 1000);
+        if (start == buffer.end()) {
+            log_info(dvrLog, {{"viewer", viewerId}}, "Nothing buffered yet, joining live");
+            return false;
+        }
+        int64_t ticks = buffer.frame(start).ticks;
+        reader.started = true;
+        reader.next = start;
+        reader.lastTicks = ticks;
+        reader.lastOutput = newest;
+        reader.anchor = now;
+        reader.anchorTicks = newest;
+        log_info(dvrLog, {{"viewer", viewerId}}, "Joining ", double(newest - ticks) / DvrBuffer::kClockRate,
+                 " s behind live at ", reader.speed, "x");
+        return true;
+    }
+
+    // Under `mutex`. Moves the cursor onto a frame that can be sent; false
+    // when it is at the newest one.
+    bool nextFrame(Reader& reader) {
+        if (reader.next < buffer.begin()) {
+            // Overwritten before it was sent: resume at the next keyframe
+            reader.next = buffer.keyframeAtOrAfter(buffer.begin());
+            reader.needKeyframe = true;
+        }
+        while (reader.needKeyframe && reader.next < buffer.end()) {
+            const DvrBuffer::Frame& frame = buffer.frame(reader.next);
+            if (frame.keyframe) {
+                reader.needKeyframe = false;
+                // Output continues one source frame interval after the last one sent
+                reader.lastTicks = frame.ticks - std::max<int64_t>(buffer.interval(reader.next), 1);
+                break;
+            }
+            ++reader.next;
+        }
+        return reader.next < buffer.end();
+    }
+
+    // Output timestamp of a frame: source spacing divided by the speed, but
+    // never behind the source, so the lag only shrinks.
+    static int64_t outputTicks(const Reader& reader, int64_t ticks) {
+        int64_t spaced = reader.lastOutput + static_cast<int64_t>((ticks - reader.lastTicks) / reader.speed);
+        return std::max(spaced, ticks);
+    }
+
+    void copyFrame(Reader& reader, const DvrBuffer::Frame& frame, uint32_t timestamp) {
+        reader.packets.clear();
+        reader.keyframeStarts.clear();
+        buffer.forEachPacket(frame, [&](const std::byte *data, size_t size) {
+            RtpPacketRef copy = RtpPacket::copyOf(data, size, [timestamp](std::byte *bytes, size_t length) {
+                rtp::restampFec(bytes, length, 0, rtp::timestamp(bytes), timestamp);
+                rtp::setTimestamp(bytes, timestamp);
+            });
+            if (copy) {
+                reader.keyframeStarts.push_back(rtp::isH264KeyframeStart(copy->data(), copy->size()));
+                reader.packets.push_back(std::move(copy));
+            }
+        });
+    }
+
+    const DvrConfig config;
+    FanoutEngine& fanout;
+    std::mutex mutex;
+    std::condition_variable cv;
+    DvrBuffer buffer;                              // under mutex
+    std::vector<std::unique_ptr<Reader>> pending;  // under mutex
+    bool stopping = false;
+    std::atomic<size_t> viewers{0};
+    std::atomic<uint64_t> caughtUp{0};
+    std::thread thread;
+};
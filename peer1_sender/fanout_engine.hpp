@@ -0,0 +1,629 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "latency_stats.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory fanoutLog("fanout");
+
+enum class OverflowPolicy {
+    DropToKeyframe,  // discard the backlog and resume at the next keyframe
+    Disconnect,      // evict the viewer
+};
+
+struct FanoutConfig {
+    size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+    size_t queueCapacity = 4096;  // packets per viewer, rounded up to a power of two
+    OverflowPolicy overflowPolicy = OverflowPolicy::DropToKeyframe;
+    size_t gopCachePackets = 2048;  // 0 disables the join burst
+    double burstPacketsPerMs = 2.0;  // pacing of the join burst
+    // Pin worker i to the i-th CPU the process may run on, so a viewer's
+    // packets stay on one core's caches.
+    bool pinWorkers = false;
+};
+
+struct ViewerQueueStats {
+    std::string viewerId;
+    size_t depth;
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t sendErrors;
+    bool waitingForKeyframe;
+    double timeToFirstFrameMs;  // negative until the first keyframe is sent
+    double sendSeconds;         // total time spent in Track::send
+};
+
+// Bounded single-producer/single-consumer queue of packets for one viewer.
+// The producer is the streaming thread; the consumer is the one worker the
+// viewer is sharded to.
+class ViewerQueue {
+public:
+    using EvictCallback = std::function<void(const std::shared_ptr<ViewerQueue>& queue)>;
+
+    // Largest queue, in packets: several seconds of even a high-bitrate
+    // stream, and well clear of overflowing the power-of-two rounding.
+    static constexpr size_t kMaxCapacity = 65536;
+
+    ViewerQueue(std::string viewerId, std::shared_ptr<rtc::Track> track, size_t capacity,
+                bool rewriteSequenceNumbers = false)
+        : viewerId(std::move(viewerId)), track(std::move(track)),
+          createdAt(std::chrono::steady_clock::now()) {
+        capacity = std::clamp<size_t>(capacity, 1, kMaxCapacity);
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        slots.resize(rounded);
+        enqueuedAt.resize(rounded);
+        burstSlots.resize(rounded);
+        mask = rounded - 1;
+        if (rewriteSequenceNumbers) {
+            history = std::make_unique<SentHistory>();
+            renumbering.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // With sequence rewriting, a copy of the packet sent to this viewer as
+    // `sequence`, renumbered again, for answering its NACKs. Empty when the
+    // packet is too old or the queue does not rewrite.
+    RtpPacketRef resendCopy(uint16_t sequence) {
+        if (!rewritesSequences()) {
+            return {};
+        }
+        RtpPacketRef original;
+        {
+            std::lock_guard<std::mutex> lock(history->mutex);
+            size_t index = sequence % SentHistory::kSize;
+            if (history->sequences[index] != sequence) {
+                return {};
+            }
+            original = history->packets[index];
+        }
+        std::vector<std::byte> bytes;
+        if (!original || !renumber(*original, sequence, bytes)) {
+            return {};
+        }
+        return RtpPacket::copyOf(bytes.data(), bytes.size());
+    }
+
+    // For a viewer whose answer left out RED: media goes out as plain H.264
+    // and FEC packets are skipped. Turns on sequence rewriting, so skipping
+    // leaves no gap. Call before anything is pushed to the queue.
+    void sendWithoutRed() {
+        if (!history) {
+            history = std::make_unique<SentHistory>();
+        }
+        stripRed.store(true, std::memory_order_relaxed);
+        renumbering.store(true, std::memory_order_release);
+    }
+
+    // Whether the viewer gets its own sequence numbers rather than the
+    // shared packets as they are.
+    bool rewritesSequences() const { return renumbering.load(std::memory_order_acquire); }
+
+    size_t depth() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return slots.size(); }
+
+    ViewerQueueStats stats() const {
+        return {viewerId, depth(), sent.load(std::memory_order_relaxed),
+                dropped.load(std::memory_order_relaxed), sendErrors.load(std::memory_order_relaxed),
+                skipping.load(std::memory_order_relaxed),
+                timeToFirstFrameUs.load(std::memory_order_relaxed) / 1000.0,
+                sendNanos.load(std::memory_order_relaxed) / 1e9};
+    }
+
+    const std::string viewerId;
+    const std::shared_ptr<rtc::Track> track;
+    // Roughly when the viewer asked to join; the queue is created with the
+    // peer connection.
+    const std::chrono::steady_clock::time_point createdAt;
+
+private:
+    friend class FanoutEngine;
+
+    bool push(const RtpPacketRef& packet, std::chrono::steady_clock::time_point now, bool burst = false) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == slots.size()) {
+            return false;
+        }
+        slots[h & mask] = packet;
+        enqueuedAt[h & mask] = now;
+        burstSlots[h & mask] = burst;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // `packet` as this viewer gets it, numbered `sequence`: an FEC packet's
+    // base moves along with it, and RED is removed if the viewer lacks it.
+    // False, with `out` empty, for packets the viewer does not get.
+    bool renumber(const RtpPacket& packet, uint16_t sequence, std::vector<std::byte>& out) const {
+        const std::byte *data = packet.data();
+        size_t size = packet.size();
+        out.resize(size);
+        if (stripRed.load(std::memory_order_relaxed) && rtp::payloadType(data) == rtp::kRedPayloadType) {
+            size_t plain = rtp::unwrapRed(data, size, out.data());
+            if (plain == 0) {
+                out.clear();
+                return false;
+            }
+            out.resize(plain);
+        } else {
+            std::memcpy(out.data(), data, size);
+            uint32_t timestamp = rtp::timestamp(data);
+            rtp::restampFec(out.data(), size, static_cast<uint16_t>(sequence - rtp::sequenceNumber(data)),
+                            timestamp, timestamp);
+        }
+        rtp::setSequenceNumber(out.data(), sequence);
+        return true;
+    }
+
+    bool pop(RtpPacketRef& out, std::chrono::steady_clock::time_point& pushedAt, bool& burst) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out = std::move(slots[t & mask]);
+        pushedAt = enqueuedAt[t & mask];
+        burst = burstSlots[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only: whether the next packet to pop is part of a join burst.
+    bool burstAhead() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t != head.load(std::memory_order_acquire) && burstSlots[t & mask];
+    }
+
+    std::vector<RtpPacketRef> slots;
+    std::vector<std::chrono::steady_clock::time_point> enqueuedAt;  // per slot
+    std::vector<uint8_t> burstSlots;  // per slot, 1 for join-burst packets
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+
+    // Producer side: set on overflow, cleared at the next keyframe once the
+    // worker has acknowledged the purge.
+    std::atomic<bool> skipping{false};
+    std::atomic<bool> purgeRequested{false};
+    std::atomic<bool> evicted{false};
+    std::atomic<bool> detached{false};
+    std::atomic<bool> stripRed{false};
+    std::atomic<bool> renumbering{false};  // `history` is set
+    bool evictionReported = false;  // worker only
+    EvictCallback onEvict;
+    size_t shard = 0;
+
+    // Join burst pacing, worker only. Which packets belong to a burst is
+    // marked in burstSlots, published with the packets themselves.
+    std::chrono::steady_clock::time_point burstStart;
+    size_t burstSent = 0;
+    bool firstKeyframeSent = false;
+    std::atomic<int64_t> timeToFirstFrameUs{-1000};
+
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> sendErrors{0};
+    std::atomic<uint64_t> sendNanos{0};
+
+    // Sequence rewriting: the worker numbers packets as it sends them, so
+    // dropped packets leave no gap, and remembers what it sent for NACKs.
+    struct SentHistory {
+        static constexpr size_t kSize = 1024;
+        std::mutex mutex;
+        std::vector<RtpPacketRef> packets = std::vector<RtpPacketRef>(kSize);
+        std::vector<uint16_t> sequences = std::vector<uint16_t>(kSize);
+    };
+    std::unique_ptr<SentHistory> history;
+    uint16_t nextSequence = 0;  // worker only
+};
+
+// Moves packets from per-viewer queues to tracks on a fixed pool of worker
+// threads, so one congested viewer only delays itself. Viewers are sharded
+// to workers round-robin when attached. One engine can serve several
+// PeerConnectionManagers (one per channel); each queue carries its own
+// eviction callback.
+class FanoutEngine {
+public:
+    using EvictCallback = ViewerQueue::EvictCallback;
+
+    FanoutEngine() {}
+    ~FanoutEngine() { stop(); }
+
+    void start(const FanoutConfig& fanoutConfig) {
+        stop();
+        config = fanoutConfig;
+        config.workerCount = std::max<size_t>(1, config.workerCount);
+        stopping = false;
+        workers.clear();
+        std::vector<int> cpus = config.pinWorkers ? allowedCpus() : std::vector<int>();
+        for (size_t i = 0; i < config.workerCount; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+            if (!cpus.empty()) {
+                workers.back()->cpu = cpus[i % cpus.size()];
+            }
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread([this, w = worker.get()]() { run(*w); });
+        }
+        log_info(fanoutLog, {}, "Fan-out engine started with ", config.workerCount, " workers",
+                 cpus.empty() ? "" : " pinned to cores", ", queue capacity ", config.queueCapacity);
+    }
+
+    void stop() {
+        if (workers.empty()) {
+            return;
+        }
+        stopping = true;
+        for (auto& worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->cv.notify_one();
+        }
+        for (auto& worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+        workers.clear();
+    }
+
+    // `rewriteSequenceNumbers` gives the viewer its own continuous sequence
+    // numbers, for streams that switch between source layers whose numbering
+    // differs, drop FEC for some viewers, or start from DVR copies. `onEvict`
+    // runs on a worker when the viewer overflows under
+    // OverflowPolicy::Disconnect.
+    std::shared_ptr<ViewerQueue> attach(const std::string& viewerId, std::shared_ptr<rtc::Track> track,
+                                        bool rewriteSequenceNumbers, EvictCallback onEvict) {
+        auto queue = std::make_shared<ViewerQueue>(viewerId, std::move(track), config.queueCapacity,
+                                                   rewriteSequenceNumbers);
+        queue->onEvict = std::move(onEvict);
+        if (workers.empty()) {
+            return queue;
+        }
+        queue->shard = nextShard.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        Worker& worker = *workers[queue->shard];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.members.push_back(queue);
+            worker.membersChanged = true;
+        }
+        return queue;
+    }
+
+    void detach(const std::shared_ptr<ViewerQueue>& queue) {
+        if (!queue || workers.empty()) {
+            return;
+        }
+        queue->detached = true;
+        Worker& worker = *workers[queue->shard];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        auto& members = worker.members;
+        members.erase(std::remove(members.begin(), members.end(), queue), members.end());
+        worker.membersChanged = true;
+        worker.signaled = true;
+        worker.cv.notify_one();
+    }
+
+    // Streaming thread: hand one packet to one viewer. Never blocks.
+    void enqueue(ViewerQueue& queue, const RtpPacketRef& packet, bool keyframeStart) {
+        admit(queue, packet, keyframeStart, std::chrono::steady_clock::now());
+        wake(queue.shard);
+    }
+
+    // Streaming thread, or the DVR player for the viewers it feeds: hand a
+    // whole frame to one viewer, waking its worker once. `keyframeStarts[i]`
+    // belongs to `frame[i]`.
+    void enqueueFrame(ViewerQueue& queue, const std::vector<RtpPacketRef>& frame,
+                      const std::vector<bool>& keyframeStarts) {
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < frame.size(); ++i) {
+            admit(queue, frame[i], keyframeStarts[i], now);
+        }
+        wake(queue.shard);
+    }
+
+    // Streaming thread: queue a cached GOP for a viewer that just joined.
+    // The worker sends it paced at config.burstPacketsPerMs.
+    void enqueueBurst(ViewerQueue& queue, const std::vector<RtpPacketRef>& packets) {
+        if (queue.evicted.load(std::memory_order_relaxed) || queue.detached.load(std::memory_order_relaxed) ||
+            packets.empty()) {
+            return;
+        }
+        if (packets.size() > queue.capacity() - queue.depth()) {
+            // Would overflow right away; fall back to live from the next keyframe.
+            queue.dropped.fetch_add(packets.size(), std::memory_order_relaxed);
+            queue.skipping.store(true, std::memory_order_relaxed);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (const RtpPacketRef& packet : packets) {
+            queue.push(packet, now, true);
+        }
+        wake(queue.shard);
+    }
+
+    const FanoutConfig& getConfig() const { return config; }
+
+    // Time from peer creation to the first keyframe packet handed to the
+    // viewer's track, over recent joins.
+    LatencyStats::Summary timeToFirstFrame() const { return firstFrameLatency.summary(); }
+
+    // Per-packet Track::send time, averaged over each drained batch.
+    const metrics::Histogram& sendTime() const { return sendTimeHistogram; }
+
+    // Live packets (not join bursts) from entering a viewer's queue, and from
+    // entering the process, until Track::send returned.
+    const metrics::Histogram& queueTime() const { return queueTimeHistogram; }
+    const metrics::Histogram& ingestToSendTime() const { return ingestToSendHistogram; }
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<bool> signaled{false};
+        std::vector<std::shared_ptr<ViewerQueue>> members;
+        bool membersChanged = false;
+        std::vector<std::byte> scratch;  // renumbered packet being sent
+        int cpu = -1;  // pinned core, -1 for none
+    };
+
+    static constexpr int kBatch = 32;
+
+    void admit(ViewerQueue& queue, const RtpPacketRef& packet, bool keyframeStart,
+               std::chrono::steady_clock::time_point now) {
+        if (queue.evicted.load(std::memory_order_relaxed) || queue.detached.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (queue.skipping.load(std::memory_order_relaxed)) {
+            if (!keyframeStart || queue.purgeRequested.load(std::memory_order_acquire)) {
+                queue.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            queue.skipping.store(false, std::memory_order_relaxed);
+        }
+        if (!queue.push(packet, now)) {
+            queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            if (config.overflowPolicy == OverflowPolicy::Disconnect) {
+                queue.evicted.store(true, std::memory_order_relaxed);
+            } else {
+                queue.skipping.store(true, std::memory_order_relaxed);
+                queue.purgeRequested.store(true, std::memory_order_release);
+            }
+        }
+    }
+
+    // CPUs in the process's affinity mask, which honours taskset and cpusets.
+    static std::vector<int> allowedCpus() {
+        std::vector<int> cpus;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return cpus;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    static void pinCurrentThread(int cpu) {
+        cpu_set_t pinned;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        if (int error = pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned)) {
+            log_warn(fanoutLog, {}, "Could not pin worker to CPU ", cpu, ": error ", error);
+        }
+    }
+
+    void wake(size_t shard) {
+        if (shard >= workers.size()) {
+            return;
+        }
+        Worker& worker = *workers[shard];
+        if (!worker.signaled.exchange(true, std::memory_order_acq_rel)) {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.cv.notify_one();
+        }
+    }
+
+    void run(Worker& worker) {
+        if (worker.cpu >= 0) {
+            pinCurrentThread(worker.cpu);
+        }
+        std::vector<std::shared_ptr<ViewerQueue>> local;
+        std::vector<std::shared_ptr<ViewerQueue>> evictions;
+        bool paced = false;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                auto ready = [&]() { return worker.signaled.load() || stopping.load(); };
+                if (paced) {
+                    // A join burst is waiting for pacing budget.
+                    worker.cv.wait_for(lock, std::chrono::milliseconds(1), ready);
+                } else {
+                    worker.cv.wait(lock, ready);
+                }
+                if (stopping) {
+                    break;
+                }
+                worker.signaled = false;
+                if (worker.membersChanged) {
+                    local = worker.members;
+                    worker.membersChanged = false;
+                }
+            }
+
+            bool progress = true;
+            paced = false;
+            while (progress) {
+                progress = false;
+                paced = false;
+                for (auto& queue : local) {
+                    if (drain(worker, queue, evictions)) {
+                        progress = true;
+                    }
+                    if (queue->burstAhead()) {
+                        paced = true;
+                    }
+                }
+            }
+
+            // Eviction removes the peer, which republishes the registry; do
+            // it outside the drain loop and without holding worker.mutex.
+            for (const auto& queue : evictions) {
+                log_warn(fanoutLog, {{"viewer", queue->viewerId}}, "Overflowed its send queue, disconnecting");
+                if (queue->onEvict) {
+                    queue->onEvict(queue);
+                }
+            }
+            evictions.clear();
+        }
+    }
+
+    // Returns true when more packets may be pending.
+    bool drain(Worker& worker, const std::shared_ptr<ViewerQueue>& queuePtr,
+               std::vector<std::shared_ptr<ViewerQueue>>& evictions) {
+        ViewerQueue& queue = *queuePtr;
+        RtpPacketRef packet;
+        std::chrono::steady_clock::time_point pushedAt;
+        bool burst = false;
+        if (queue.detached.load(std::memory_order_relaxed)) {
+            while (queue.pop(packet, pushedAt, burst)) {
+            }
+            return false;
+        }
+        if (queue.evicted.load(std::memory_order_relaxed)) {
+            while (queue.pop(packet, pushedAt, burst)) {
+                queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (!queue.evictionReported) {
+                queue.evictionReported = true;
+                evictions.push_back(queuePtr);
+            }
+            return false;
+        }
+        if (queue.purgeRequested.load(std::memory_order_acquire)) {
+            while (queue.pop(packet, pushedAt, burst)) {
+                queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            queue.burstSent = 0;
+            queue.purgeRequested.store(false, std::memory_order_release);
+            return false;
+        }
+
+        // Only burst packets are paced; live ones queued behind a burst go
+        // out as soon as the burst has.
+        size_t burstBudget = 0;
+        if (queue.burstAhead()) {
+            auto now = std::chrono::steady_clock::now();
+            if (queue.burstSent == 0) {
+                queue.burstStart = now;
+            }
+            double elapsedMs = std::chrono::duration<double, std::milli>(now - queue.burstStart).count();
+            size_t allowed = kBatch + static_cast<size_t>(elapsedMs * config.burstPacketsPerMs);
+            burstBudget = allowed > queue.burstSent ? allowed - queue.burstSent : 0;
+        }
+
+        size_t sent = 0;
+        std::chrono::steady_clock::time_point started;
+        while (sent < kBatch && (burstBudget > 0 || !queue.burstAhead()) && queue.pop(packet, pushedAt, burst)) {
+            if (sent == 0) {
+                started = std::chrono::steady_clock::now();
+            }
+            if (!queue.firstKeyframeSent && rtp::isH264KeyframeStart(packet->data(), packet->size())) {
+                queue.firstKeyframeSent = true;
+                auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - queue.createdAt);
+                queue.timeToFirstFrameUs.store(latency.count(), std::memory_order_relaxed);
+                firstFrameLatency.record(latency);
+            }
+            try {
+                bool delivered = true;
+                if (queue.history) {
+                    delivered = sendRenumbered(worker, queue, packet);
+                } else {
+                    queue.track->send(packet->data(), packet->size());
+                }
+                if (delivered) {
+                    queue.sent.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (delivered && !burst) {
+                    auto now = std::chrono::steady_clock::now();
+                    queueTimeHistogram.observe(std::chrono::duration<double>(now - pushedAt).count());
+                    ingestToSendHistogram.observe(std::chrono::duration<double>(now - packet->createdAt()).count());
+                }
+            } catch (const std::exception&) {
+                queue.sendErrors.fetch_add(1, std::memory_order_relaxed);
+            }
+            ++sent;
+            if (burst) {
+                --burstBudget;
+                ++queue.burstSent;
+            }
+        }
+        if (!queue.burstAhead()) {
+            // The burst is out; the next one starts its own pacing
+            queue.burstSent = 0;
+        }
+        if (sent > 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started);
+            queue.sendNanos.fetch_add(elapsed.count(), std::memory_order_relaxed);
+            sendTimeHistogram.observe(elapsed.count() / 1e9 / sent, sent);
+        }
+        return sent == kBatch;
+    }
+
+    // False when the packet is not for this viewer (FEC without RED, or RED
+    // that does not unwrap); it then takes no sequence number.
+    bool sendRenumbered(Worker& worker, ViewerQueue& queue, const RtpPacketRef& packet) {
+        if (queue.stripRed.load(std::memory_order_relaxed) && rtp::isUlpfec(packet->data(), packet->size())) {
+            return false;
+        }
+        uint16_t sequence = queue.nextSequence;
+        if (!queue.renumber(*packet, sequence, worker.scratch)) {
+            return false;
+        }
+        ++queue.nextSequence;
+        {
+            std::lock_guard<std::mutex> lock(queue.history->mutex);
+            size_t index = sequence % ViewerQueue::SentHistory::kSize;
+            queue.history->packets[index] = packet;
+            queue.history->sequences[index] = sequence;
+        }
+        queue.track->send(worker.scratch.data(), worker.scratch.size());
+        return true;
+    }
+
+    FanoutConfig config;
+    LatencyStats firstFrameLatency;
+    metrics::Histogram sendTimeHistogram{{1e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 1e-3, 1e-2}};
+    metrics::Histogram queueTimeHistogram{{1e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 5e-2, 0.1}};
+    metrics::Histogram ingestToSendHistogram{{1e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 5e-2, 0.1}};
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> nextShard{0};
+    std::atomic<bool> stopping{false};
+};
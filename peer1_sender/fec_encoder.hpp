@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "logger.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory fecLog("fec");
+
+// ULPFEC (RFC 5109) inside RED (RFC 2198), the way WebRTC protects video.
+// Runs once per stream on its streaming thread, before fan-out, so every
+// viewer shares the same FEC packets as it shares the media.
+//
+// A frame is cut into blocks of up to kBlockPackets media packets. A block
+// with n packets gets k = ceil(n * protection / 100) FEC packets. FEC packet
+// i covers packets i, i + k, i + 2k, ... of the block, so any k consecutive
+// losses in the block can be recovered. FEC packets only cover their own
+// frame and go out just before the block's last media packet, so the marker
+// bit still ends the frame. Media and FEC share one sequence space,
+// numbered here. Packets too large to protect go out in it as plain media.
+class FecEncoder {
+public:
+    // A block's media and FEC then span at most 48 sequence numbers, the
+    // reach of ULPFEC's long mask.
+    static constexpr size_t kBlockPackets = 24;
+    // Larger packets leave no room in a slab for the RED header, or for the
+    // FEC headers in front of their protected bytes.
+    static constexpr size_t kMaxProtectedSize = RtpPacket::kSlabSize - 1 - rtp::kFecHeaderSize - 8;
+
+    struct Stats {
+        unsigned protectionPercent;
+        uint64_t mediaPackets;
+        uint64_t mediaBytes;  // RED-wrapped, as sent
+        uint64_t fecPackets;
+        uint64_t fecBytes;
+        uint64_t unprotectedPackets;  // sent as plain media
+    };
+
+    // FEC packets per 100 media packets, up to 100. Takes effect at the
+    // next frame; safe from any thread.
+    void setProtection(unsigned percent) {
+        protection.store(std::min(percent, 100u), std::memory_order_relaxed);
+    }
+
+    unsigned getProtection() const { return protection.load(std::memory_order_relaxed); }
+
+    Stats stats() const {
+        return {getProtection(), mediaPackets.load(std::memory_order_relaxed),
+                mediaBytes.load(std::memory_order_relaxed), fecPackets.load(std::memory_order_relaxed),
+                fecBytes.load(std::memory_order_relaxed), unprotectedPackets.load(std::memory_order_relaxed)};
+    }
+
+    // Streaming thread. The frame as it should be sent: every packet wrapped
+    // in RED, FEC packets added. Valid until the next call.
+    const std::vector<RtpPacketRef>& protect(const std::vector<RtpPacketRef>& frame) {
+        output.clear();
+        block.clear();
+        for (const RtpPacketRef& packet : frame) {
+            if (!rtp::isValid(packet->data(), packet->size())) {
+                output.push_back(packet);
+                continue;
+            }
+            if (!started) {
+                started = true;
+                nextSequence = rtp::sequenceNumber(packet->data());
+            }
+            if (rtp::payloadOffset(packet->data(), packet->size()) == 0 || packet->size() > kMaxProtectedSize) {
+                // Behind what the block has so far, to keep the order
+                if (!block.empty()) {
+                    protectBlock();
+                }
+                sendUnprotected(packet, nextSequence++);
+                continue;
+            }
+            block.push_back(&packet);
+            if (block.size() == kBlockPackets) {
+                protectBlock();
+            }
+        }
+        if (!block.empty()) {
+            protectBlock();
+        }
+        return output;
+    }
+
+private:
+    void protectBlock() {
+        const size_t count = block.size();
+        const size_t fecCount = (count * protection.load(std::memory_order_relaxed) + 99) / 100;
+        const uint16_t base = nextSequence;
+        // Media packets take base.., the FEC packets follow and the block's
+        // last packet comes after them.
+        auto mediaOffset = [&](size_t index) { return index + 1 < count ? index : count - 1 + fecCount; };
+
+        for (size_t i = 0; i + 1 < count; ++i) {
+            wrap(*block[i], static_cast<uint16_t>(base + mediaOffset(i)));
+        }
+        for (size_t i = 0; i < fecCount; ++i) {
+            addFec(i, fecCount, base, mediaOffset);
+        }
+        wrap(*block[count - 1], static_cast<uint16_t>(base + mediaOffset(count - 1)));
+        nextSequence = static_cast<uint16_t>(base + count + fecCount);
+        block.clear();
+    }
+
+    // The media packet with its payload behind a one-byte RED header.
+    void wrap(const RtpPacketRef& media, uint16_t sequence) {
+        const std::byte *data = media->data();
+        size_t size = media->size();
+        size_t offset = rtp::payloadOffset(data, size);
+        RtpPacketRef red = RtpPacket::create(size + 1, [&](std::byte *bytes) {
+            std::memcpy(bytes, data, offset);
+            bytes[offset] = std::byte(rtp::payloadType(data));
+            std::memcpy(bytes + offset + 1, data + offset, size - offset);
+            rtp::setPayloadType(bytes, rtp::kRedPayloadType);
+            rtp::setSequenceNumber(bytes, sequence);
+        });
+        if (!red) {
+            sendUnprotected(media, sequence);
+            return;
+        }
+        mediaPackets.fetch_add(1, std::memory_order_relaxed);
+        mediaBytes.fetch_add(red->size(), std::memory_order_relaxed);
+        output.push_back(std::move(red));
+    }
+
+    // The packet as it is, in this sequence space. One that does not fit a
+    // slab cannot be renumbered and goes out with the payloader's number.
+    void sendUnprotected(const RtpPacketRef& media, uint16_t sequence) {
+        RtpPacketRef plain = RtpPacket::copyOf(media->data(), media->size(), [sequence](std::byte *bytes, size_t) {
+            rtp::setSequenceNumber(bytes, sequence);
+        });
+        if (!plain) {
+            log_error(fecLog, {}, "Packet of ", media->size(), " bytes too large to renumber, sent out of sequence");
+        }
+        unprotectedPackets.fetch_add(1, std::memory_order_relaxed);
+        output.push_back(plain ? std::move(plain) : media);
+    }
+
+    // FEC packet `index` of `fecCount`, over the media packets it covers as
+    // they are before RED: header fields and everything after the fixed
+    // header XORed, level 0 only.
+    template <typename MediaOffset>
+    void addFec(size_t index, size_t fecCount, uint16_t base, MediaOffset mediaOffset) {
+        const RtpPacket& first = **block[index];
+        uint8_t bits0 = 0;
+        uint8_t bits1 = 0;
+        uint32_t timestamp = 0;
+        uint16_t length = 0;
+        size_t protectedLength = 0;
+        uint64_t mask = 0;
+        for (size_t i = index; i < block.size(); i += fecCount) {
+            const RtpPacket& media = **block[i];
+            bits0 ^= rtp::byteAt(media.data(), 0);
+            bits1 ^= rtp::byteAt(media.data(), 1);
+            timestamp ^= rtp::timestamp(media.data());
+            length ^= static_cast<uint16_t>(media.size() - rtp::kHeaderSize);
+            protectedLength = std::max(protectedLength, media.size() - rtp::kHeaderSize);
+            mask |= uint64_t(1) << (47 - mediaOffset(i));
+        }
+        const bool longMask = mediaOffset(block.size() - 1) >= 16;
+        const size_t levelHeader = longMask ? 8 : 4;
+        const size_t headerSize = rtp::kHeaderSize + 1 + rtp::kFecHeaderSize + levelHeader;
+        const uint16_t sequence = static_cast<uint16_t>(base + block.size() - 1 + index);
+
+        RtpPacketRef fec = RtpPacket::create(headerSize + protectedLength, [&](std::byte *bytes) {
+            std::memcpy(bytes, first.data(), rtp::kHeaderSize);
+            bytes[0] = std::byte(0x80);  // V=2, no padding, extension or CSRCs
+            bytes[1] = std::byte(rtp::kRedPayloadType);  // marker clear
+            rtp::setSequenceNumber(bytes, sequence);
+            std::byte *red = bytes + rtp::kHeaderSize;
+            red[0] = std::byte(rtp::kUlpfecPayloadType);
+
+            std::byte *header = red + 1;
+            header[0] = std::byte((longMask ? 0x40 : 0x00) | (bits0 & 0x3F));
+            header[1] = std::byte(bits1);
+            header[2] = std::byte(base >> 8);
+            header[3] = std::byte(base & 0xFF);
+            for (int i = 0; i < 4; ++i) {
+                header[4 + i] = std::byte((timestamp >> (24 - 8 * i)) & 0xFF);
+            }
+            header[8] = std::byte(length >> 8);
+            header[9] = std::byte(length & 0xFF);
+
+            std::byte *level = header + rtp::kFecHeaderSize;
+            level[0] = std::byte(protectedLength >> 8);
+            level[1] = std::byte(protectedLength & 0xFF);
+            for (size_t i = 0; i + 2 < levelHeader; ++i) {
+                level[2 + i] = std::byte((mask >> (40 - 8 * i)) & 0xFF);
+            }
+
+            std::byte *payload = level + levelHeader;
+            std::memset(payload, 0, protectedLength);
+            for (size_t i = index; i < block.size(); i += fecCount) {
+                const RtpPacket& media = **block[i];
+                const std::byte *source = media.data() + rtp::kHeaderSize;
+                for (size_t j = 0; j < media.size() - rtp::kHeaderSize; ++j) {
+                    payload[j] ^= source[j];
+                }
+            }
+        });
+        if (!fec) {
+            return;
+        }
+        fecPackets.fetch_add(1, std::memory_order_relaxed);
+        fecBytes.fetch_add(fec->size(), std::memory_order_relaxed);
+        output.push_back(std::move(fec));
+    }
+
+    std::atomic<unsigned> protection{0};
+    // Streaming thread only.
+    std::vector<const RtpPacketRef*> block;  // in the caller's frame
+    std::vector<RtpPacketRef> output;
+    bool started = false;
+    uint16_t nextSequence = 0;
+
+    std::atomic<uint64_t> mediaPackets{0};
+    std::atomic<uint64_t> mediaBytes{0};
+    std::atomic<uint64_t> fecPackets{0};
+    std::atomic<uint64_t> fecBytes{0};
+    std::atomic<uint64_t> unprotectedPackets{0};
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+// Packets from the most recent keyframe onward, SPS/PPS included, used to
+// give a joining viewer a decodable picture right away instead of waiting
+// for the next IDR. Owned by the streaming thread; not thread safe.
+class GopCache {
+public:
+    explicit GopCache(size_t maxPackets = 2048) { setMaxPackets(maxPackets); }
+
+    void setMaxPackets(size_t maxPackets) {
+        limit = maxPackets;
+        packets.clear();
+        packets.reserve(limit);
+        burstPackets.clear();
+        burstPackets.reserve(limit);
+        burstBuiltFor = 0;
+        overflowed = true;
+    }
+
+    void add(const RtpPacketRef& packet, bool keyframeStart) {
+        if (limit == 0) {
+            return;
+        }
+        if (keyframeStart) {
+            // SPS, PPS and every IDR slice of one access unit share a
+            // timestamp; only a new access unit starts a new GOP.
+            bool sameAccessUnit = !overflowed && !packets.empty() &&
+                                  rtp::timestamp(packets.front()->data()) == rtp::timestamp(packet->data());
+            if (!sameAccessUnit) {
+                packets.clear();
+            }
+            overflowed = false;
+        }
+        if (overflowed) {
+            return;
+        }
+        if (packets.size() == limit) {
+            // GOP longer than the cache: give up until the next keyframe.
+            packets.clear();
+            overflowed = true;
+            return;
+        }
+        packets.push_back(packet);
+    }
+
+    bool valid() const { return !overflowed && !packets.empty(); }
+    size_t size() const { return packets.size(); }
+
+    // The cached GOP ready to send to a new viewer, ending with the newest
+    // packet. Frames older than the newest one get timestamps 1 tick apart
+    // just below it, so the receiver decodes them immediately and shows the
+    // current picture instead of replaying the GOP in real time. Sequence
+    // numbers are untouched and continue into the live stream. Rebuilt only
+    // when the cache has changed since the last call.
+    const std::vector<RtpPacketRef>& burst() {
+        if (burstBuiltFor == packets.size() && !burstPackets.empty() &&
+            burstPackets.back().get() == packets.back().get()) {
+            return burstPackets;
+        }
+        burstPackets.clear();
+        burstBuiltFor = packets.size();
+        if (packets.empty()) {
+            return burstPackets;
+        }
+
+        const uint32_t newest = rtp::timestamp(packets.back()->data());
+        uint32_t olderFrames = 0;
+        uint32_t previous = rtp::timestamp(packets.front()->data());
+        for (const RtpPacketRef& packet : packets) {
+            uint32_t timestamp = rtp::timestamp(packet->data());
+            if (timestamp == newest) {
+                break;
+            }
+            if (timestamp != previous || olderFrames == 0) {
+                ++olderFrames;
+                previous = timestamp;
+            }
+        }
+
+        uint32_t frameIndex = 0;
+        previous = rtp::timestamp(packets.front()->data());
+        for (const RtpPacketRef& packet : packets) {
+            uint32_t timestamp = rtp::timestamp(packet->data());
+            if (timestamp == newest) {
+                burstPackets.push_back(packet);
+                continue;
+            }
+            if (timestamp != previous) {
+                ++frameIndex;
+                previous = timestamp;
+            }
+            uint32_t rewritten = newest - (olderFrames - frameIndex);
+            RtpPacketRef copy = RtpPacket::copyOf(packet->data(), packet->size(),
+                                                  [rewritten](std::byte *bytes, size_t) {
+                                                      rtp::setTimestamp(bytes, rewritten);
+                                                  });
+            burstPackets.push_back(copy ? copy : packet);
+        }
+        return burstPackets;
+    }
+
+private:
+    std::vector<RtpPacketRef> packets;
+    std::vector<RtpPacketRef> burstPackets;
+    size_t burstBuiltFor = 0;
+    size_t limit = 0;
+    bool overflowed = true;
+};
@@ -0,0 +1,198 @@
+// Headless viewer that measures how late frames arrive against the
+// abs-capture-time the sender stamps on them. It joins a signaling server
+// the way a browser does (through RelaySource) and prints per-stage latency
+// histograms at a fixed interval. Sender and probe must share a clock: run
+// them on one machine, or on NTP-synced hosts.
+#include <rtc/rtc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.hpp"
+#include "relay_source.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory probeLog("probe");
+
+// Latency samples of one stage over the current interval, in milliseconds.
+class StageStats {
+public:
+    explicit StageStats(std::string stageName) : name(std::move(stageName)) {}
+
+    void record(double ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back(ms);
+    }
+
+    // One line of percentiles and bucket counts; clears the interval.
+    std::string report() {
+        std::vector<double> taken;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            taken.swap(samples);
+        }
+        std::string line = name + ":";
+        if (taken.empty()) {
+            return line + " no samples";
+        }
+        std::sort(taken.begin(), taken.end());
+        auto percentile = [&](double p) { return taken[std::min(taken.size() - 1, size_t(p * taken.size()))]; };
+        char summary[128];
+        std::snprintf(summary, sizeof(summary), " n=%zu p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms |",
+                      taken.size(), percentile(0.5), percentile(0.9), percentile(0.99), taken.back());
+        line += summary;
+        size_t counted = 0;
+        for (double bound : kBucketsMs) {
+            size_t upTo = std::upper_bound(taken.begin(), taken.end(), bound) - taken.begin();
+            line += " <=" + format(bound) + "ms:" + std::to_string(upTo - counted);
+            counted = upTo;
+        }
+        line += " more:" + std::to_string(taken.size() - counted);
+        return line;
+    }
+
+private:
+    static constexpr double kBucketsMs[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+
+    static std::string format(double value) {
+        char text[16];
+        std::snprintf(text, sizeof(text), "%g", value);
+        return text;
+    }
+
+    const std::string name;
+    std::mutex mutex;
+    std::vector<double> samples;
+};
+
+struct ProbeOptions {
+    std::string signalingUrl = "ws://localhost:8765";
+    std::string channel;
+    std::vector<std::string> iceServers{"stun:stun.l.google.com:19302"};
+    std::chrono::seconds interval{5};
+    std::chrono::seconds duration{0};  // 0 runs until interrupted
+};
+
+std::atomic<bool> interrupted{false};
+
+static void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [signaling_url] [options]" << std::endl;
+    std::cerr << "Example: " << program << " ws://localhost:8765 --ice-server=none" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --channel=NAME        channel to watch (default: the sender's default)" << std::endl;
+    std::cerr << "  --ice-server=URL      STUN/TURN server, repeatable; 'none' for host candidates only" << std::endl;
+    std::cerr << "  --interval=S          seconds between reports (default: 5)" << std::endl;
+    std::cerr << "  --duration=S          stop after S seconds, 0 to run until Ctrl+C (default: 0)" << std::endl;
+}
+
+static ProbeOptions parse_options(int argc, char *argv[]) {
+    ProbeOptions options;
+    bool iceServersGiven = false;
+    bool urlGiven = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            if (urlGiven) {
+                throw std::runtime_error("Unexpected argument: " + arg);
+            }
+            options.signalingUrl = arg;
+            urlGiven = true;
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "channel") {
+            options.channel = value;
+        } else if (name == "ice-server") {
+            if (!iceServersGiven) {
+                options.iceServers.clear();
+                iceServersGiven = true;
+            }
+            if (value != "none") {
+                options.iceServers.push_back(value);
+            }
+        } else if (name == "interval") {
+            options.interval = std::chrono::seconds(std::max(1ul, std::stoul(value)));
+        } else if (name == "duration") {
+            options.duration = std::chrono::seconds(std::stoul(value));
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    ProbeOptions options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::signal(SIGINT, [](int) { interrupted = true; });
+    std::signal(SIGTERM, [](int) { interrupted = true; });
+
+    // Stages as seen from here; the sender's own stages are on its /metrics.
+    StageStats firstPacket("ingest -> first packet");
+    StageStats frameComplete("ingest -> frame complete");
+    StageStats frameSpread("first -> last packet");
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> unstamped{0};
+
+    // RelaySource copies each packet as it arrives, so createdAt() is the
+    // arrival time; the steady clock is mapped onto the sender's wall clock.
+    RelaySource source({options.signalingUrl, options.channel, options.iceServers},
+                       [&](const std::vector<RtpPacketRef>& frame) {
+        frames.fetch_add(1, std::memory_order_relaxed);
+        uint64_t captureNtp = rtp::absCaptureTime(frame.front()->data(), frame.front()->size());
+        if (captureNtp == 0) {
+            unstamped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto wallOffset = std::chrono::system_clock::now().time_since_epoch() -
+                          std::chrono::steady_clock::now().time_since_epoch();
+        auto captured = rtp::fromNtp(captureNtp).time_since_epoch();
+        auto first = frame.front()->createdAt().time_since_epoch() + wallOffset;
+        auto last = frame.back()->createdAt().time_since_epoch() + wallOffset;
+        using Ms = std::chrono::duration<double, std::milli>;
+        firstPacket.record(std::chrono::duration_cast<Ms>(first - captured).count());
+        frameComplete.record(std::chrono::duration_cast<Ms>(last - captured).count());
+        frameSpread.record(std::chrono::duration_cast<Ms>(last - first).count());
+    });
+    log_info(probeLog, {{"url", options.signalingUrl}}, "Joining as a viewer");
+    source.start();
+
+    auto start = std::chrono::steady_clock::now();
+    auto nextReport = start + options.interval;
+    while (!interrupted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto now = std::chrono::steady_clock::now();
+        if (options.duration.count() > 0 && now - start >= options.duration) {
+            break;
+        }
+        if (now < nextReport) {
+            continue;
+        }
+        nextReport += options.interval;
+        RelaySource::Stats stats = source.stats();
+        std::cout << "frames " << frames.exchange(0) << ", without capture time " << unstamped.exchange(0)
+                  << ", packets " << stats.packets << (stats.connected ? "" : ", not connected") << "\n"
+                  << "  " << firstPacket.report() << "\n"
+                  << "  " << frameComplete.report() << "\n"
+                  << "  " << frameSpread.report() << std::endl;
+    }
+    source.stop();
+    Logger::instance().stop();
+    return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Keeps the most recent latency samples in a fixed ring and reports
+// percentiles over them. Meant for per-event timings (joins, negotiations),
+// not for per-packet use.
+class LatencyStats {
+public:
+    struct Summary {
+        uint64_t count;   // samples recorded since start
+        double sumMs;     // their total
+        double p50Ms;
+        double p99Ms;
+        double maxMs;
+    };
+
+    explicit LatencyStats(size_t window = 1024) : samples(window, 0) {}
+
+    void record(std::chrono::microseconds latency) {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples[total % samples.size()] = latency.count();
+        ++total;
+        totalUs += latency.count();
+    }
+
+    Summary summary() const {
+        std::vector<int64_t> sorted;
+        uint64_t count;
+        double sumMs;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            count = total;
+            sumMs = totalUs / 1000.0;
+            size_t n = std::min<uint64_t>(total, samples.size());
+            sorted.assign(samples.begin(), samples.begin() + n);
+        }
+        if (sorted.empty()) {
+            return {0, 0, 0, 0, 0};
+        }
+        std::sort(sorted.begin(), sorted.end());
+        auto at = [&](double q) {
+            size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+            return sorted[index] / 1000.0;
+        };
+        return {count, sumMs, at(0.50), at(0.99), sorted.back() / 1000.0};
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::vector<int64_t> samples;
+    uint64_t total = 0;
+    int64_t totalUs = 0;
+};
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum class LogLevel {
+    Debug,
+    Info,
+    Warn,
+    Error,
+};
+
+// Structured fields, e.g. {{"viewer", viewerId}, {"session", sessionId}}.
+// Views only: nothing is copied unless the message is actually logged.
+using LogFields = std::initializer_list<std::pair<const char*, std::string_view>>;
+
+// A source of log messages, rate limited on its own so one noisy category
+// cannot crowd out the others. Categories live for the whole process.
+class LogCategory {
+public:
+    explicit LogCategory(const char *name);
+
+    const char *const name;
+
+private:
+    friend class Logger;
+
+    std::atomic<int64_t> window{-1};  // steady-clock second being counted
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint64_t> suppressed{0};
+};
+
+// Process-wide asynchronous logger. Callers format into a string and push
+// it onto a bounded lock-free ring; one background thread writes batches to
+// stdout (debug, info) or stderr (warn, error) in logfmt. Messages below the
+// level or over their category's rate are never formatted. A full ring drops
+// the message rather than block the caller. An idle writer spins briefly,
+// then sleeps until a message arrives. Intentionally never destroyed, like
+// RtpPacketPool, so logging during exit stays safe; stop() at the end of
+// main writes out the ring and joins the writer, after which messages are
+// written by the thread logging them.
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger *logger = new Logger();
+        return *logger;
+    }
+
+    void setLevel(LogLevel level) { minLevel.store(level, std::memory_order_relaxed); }
+
+    // Messages per second per category; 0 disables rate limiting.
+    void setRateLimit(uint32_t perSecond) { rateLimit.store(perSecond, std::memory_order_relaxed); }
+
+    bool enabled(LogLevel level) const { return level >= minLevel.load(std::memory_order_relaxed); }
+
+    template <typename... Args>
+    void log(LogLevel level, LogCategory& category, LogFields fields, const Args&... args) {
+        if (!enabled(level) || !admit(category)) {
+            return;
+        }
+        std::ostringstream message;
+        (message << ... << args);
+        std::string line = levelName(level);
+        line += " cat=";
+        line += category.name;
+        for (const auto& [key, value] : fields) {
+            line += ' ';
+            line += key;
+            line += '=';
+            appendValue(line, value);
+        }
+        line += " msg=";
+        appendValue(line, message.str());
+        push(level, std::move(line));
+        if (stopped.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(drainMutex);
+            drain();
+        }
+    }
+
+    // Blocks until everything logged so far has been written.
+    void flush() {
+        uint64_t target = accepted.load(std::memory_order_acquire);
+        while (written.load(std::memory_order_acquire) < target) {
+            if (stopped.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(drainMutex);
+                drain();
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    // Writes out everything queued and joins the writer thread.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stopping.store(true, std::memory_order_release);
+        }
+        wake.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        stopped.store(true, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> lock(drainMutex);
+        drain();
+        if (reportLosses()) {
+            std::fflush(stderr);
+        }
+    }
+
+    void registerCategory(LogCategory *category) {
+        std::lock_guard<std::mutex> lock(categoriesMutex);
+        categories.push_back(category);
+    }
+
+private:
+    static constexpr size_t kCapacity = 8192;  // power of two
+    static constexpr unsigned kIdleSpins = 64;  // empty passes before the writer sleeps
+
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        std::chrono::system_clock::time_point time;
+        std::string line;
+    };
+
+    // Bounded multi-producer queue (Vyukov); the writer is its only consumer.
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    Logger() : slots(new Slot[kCapacity]) {
+        for (size_t i = 0; i < kCapacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer = std::thread([this]() { run(); });
+    }
+
+    static const char* levelName(LogLevel level) {
+        switch (level) {
+            case LogLevel::Debug: return "level=debug";
+            case LogLevel::Info: return "level=info";
+            case LogLevel::Warn: return "level=warn";
+            case LogLevel::Error: return "level=error";
+        }
+        return "level=info";
+    }
+
+    // Quoted when it holds spaces, quotes or '='; empty values become "".
+    static void appendValue(std::string& line, std::string_view value) {
+        bool quote = value.empty() || value.find_first_of(" \"=\t\r\n") != std::string_view::npos;
+        if (!quote) {
+            line.append(value.data(), value.size());
+            return;
+        }
+        line += '"';
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                line += '\\';
+                line += c;
+            } else if (c == '\n') {
+                line += "\\n";
+            } else if (c == '\r') {
+                line += "\\r";
+            } else {
+                line += c;
+            }
+        }
+        line += '"';
+    }
+
+    bool admit(LogCategory& category) {
+        uint32_t limit = rateLimit.load(std::memory_order_relaxed);
+        if (limit == 0) {
+            return true;
+        }
+        int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t window = category.window.load(std::memory_order_relaxed);
+        if (window != second && category.window.compare_exchange_strong(window, second, std::memory_order_relaxed)) {
+            category.count.store(0, std::memory_order_relaxed);
+        }
+        if (category.count.fetch_add(1, std::memory_order_relaxed) < limit) {
+            return true;
+        }
+        category.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void push(LogLevel level, std::string line) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[position & (kCapacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        slot->record.level = level;
+        slot->record.time = std::chrono::system_clock::now();
+        slot->record.line = std::move(line);
+        accepted.fetch_add(1, std::memory_order_release);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        // Pairs with the fence in run(): either the writer sees this message
+        // before it sleeps, or this sees it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wake.notify_one();
+        }
+    }
+
+    bool pop(Record& out) {
+        Slot& slot = slots[dequeuePosition & (kCapacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1) {
+            return false;
+        }
+        out = std::move(slot.record);
+        slot.sequence.store(dequeuePosition + kCapacity, std::memory_order_release);
+        ++dequeuePosition;
+        return true;
+    }
+
+    // Writes what the ring holds; the caller holds drainMutex.
+    uint64_t drain() {
+        bool wroteOut = false;
+        bool wroteErr = false;
+        uint64_t count = 0;
+        while (pop(record)) {
+            FILE *stream = record.level >= LogLevel::Warn ? stderr : stdout;
+            writeLine(stream, record.time, record.line);
+            (stream == stderr ? wroteErr : wroteOut) = true;
+            ++count;
+        }
+        if (wroteOut) {
+            std::fflush(stdout);
+        }
+        if (wroteErr) {
+            std::fflush(stderr);
+        }
+        written.fetch_add(count, std::memory_order_release);
+        return count;
+    }
+
+    void run() {
+        auto lastReport = std::chrono::steady_clock::now();
+        unsigned idle = 0;
+        while (true) {
+            uint64_t count;
+            {
+                std::lock_guard<std::mutex> lock(drainMutex);
+                count = drain();
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport >= std::chrono::seconds(1)) {
+                lastReport = now;
+                if (reportLosses()) {
+                    std::fflush(stderr);
+                }
+            }
+            if (count > 0) {
+                idle = 0;
+                continue;
+            }
+            if (stopping.load(std::memory_order_acquire)) {
+                return;  // stop() drains what came in since
+            }
+            if (++idle < kIdleSpins) {
+                std::this_thread::yield();
+                continue;
+            }
+            idle = 0;
+            // Woken by push(), or after a second for the loss report
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wake.wait_for(lock, std::chrono::seconds(1), [this]() {
+                return stopping.load(std::memory_order_relaxed) ||
+                       accepted.load(std::memory_order_acquire) > written.load(std::memory_order_relaxed);
+            });
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    static void writeLine(FILE *stream, std::chrono::system_clock::time_point time, const std::string& line) {
+        std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+        int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            time.time_since_epoch()).count() % 1000);
+        std::tm utc;
+        gmtime_r(&seconds, &utc);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        std::fprintf(stream, "ts=%s.%03dZ %s\n", stamp, millis, line.c_str());
+    }
+
+    // Messages lost to rate limits or a full ring, once a second.
+    bool reportLosses() {
+        bool wrote = false;
+        auto now = std::chrono::system_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(categoriesMutex);
+            for (LogCategory *category : categories) {
+                if (uint64_t suppressed = category->suppressed.exchange(0, std::memory_order_relaxed)) {
+                    writeLine(stderr, now, std::string("level=warn cat=") + category->name +
+                              " suppressed=" + std::to_string(suppressed) + " msg=\"rate limited\"");
+                    wrote = true;
+                }
+            }
+        }
+        if (uint64_t lost = dropped.exchange(0, std::memory_order_relaxed)) {
+            writeLine(stderr, now, "level=warn cat=log dropped=" + std::to_string(lost) + " msg=\"log ring full\"");
+            wrote = true;
+        }
+        return wrote;
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> enqueuePosition{0};
+    alignas(64) size_t dequeuePosition = 0;  // under drainMutex
+    Record record;                           // under drainMutex
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<LogLevel> minLevel{LogLevel::Info};
+    std::atomic<uint32_t> rateLimit{100};
+    std::mutex drainMutex;  // the ring's one consumer at a time
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> stopped{false};  // writer joined
+    std::thread writer;
+    std::mutex categoriesMutex;
+    std::vector<LogCategory*> categories;
+};
+
+inline LogCategory::LogCategory(const char *name) : name(name) {
+    Logger::instance().registerCategory(this);
+}
+
+template <typename... Args>
+void log_debug(LogCategory& category, LogFields fields, const Args&... args) {
+    Logger::instance().log(LogLevel::Debug, category, fields, args...);
+}
+
+template <typename... Args>
+void log_info(LogCategory& category, LogFields fields, const Args&... args) {
+    Logger::instance().log(LogLevel::Info, category, fields, args...);
+}
+
+template <typename... Args>
+void log_warn(LogCategory& category, LogFields fields, const Args&... args) {
+    Logger::instance().log(LogLevel::Warn, category, fields, args...);
+}
+
+template <typename... Args>
+void log_error(LogCategory& category, LogFields fields, const Args&... args) {
+    Logger::instance().log(LogLevel::Error, category, fields, args...);
+}
@@ -1,446 +1,830 @@
 #include <rtc/rtc.hpp>
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
+#include <gst/pbutils/pbutils.h>
+#include <gst/video/video.h>
 #include <websocketpp/config/asio_no_tls_client.hpp>
 #include <websocketpp/client.hpp>
 #include <nlohmann/json.hpp>
+#include <algorithm>
 #include <iostream>
 #include <thread>
+#include <chrono>
 #include <string>
 #include <stdexcept>
 #include <atomic>
+#include <fstream>
 #include <map>
 #include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+#include <sys/resource.h>
+#include "bandwidth_estimator.hpp"
+#include "dvr_buffer.hpp"
+#include "fanout_engine.hpp"
+#include "fec_encoder.hpp"
+#include "latency_stats.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "peer_connection_manager.hpp"
+#include "relay_source.hpp"
+#include "rtp_file_cache.hpp"
+#include "rtp_packet.hpp"
+#include "strand_executor.hpp"
 
 using json = nlohmann::json;
 using ws_client = websocketpp::client<websocketpp::config::asio_client>;
 
+ws_client client;
+websocketpp::connection_hdl ws_hdl;
+std::atomic<bool> ws_connected{false};
+std::string localClientId; // ID của client này (sender)
 
-class PeerConnectionManager {
-public:
-    struct PeerInfo {
-        std::shared_ptr<rtc::PeerConnection> pc;
-        std::shared_ptr<rtc::Track> videoTrack;
-        std::string sessionId;
-        std::atomic<bool> trackOpen{false};
-    };
-
-    PeerConnectionManager() {}
-
-    std::shared_ptr<PeerInfo> createPeerConnection(const std::string& viewerId, const std::string& sessionId) {
-        std::lock_guard<std::mutex> lock(mutex);
+LogCategory senderLog("sender");
+LogCategory ingestLog("ingest");
+LogCategory signalingLog("signaling");
+LogCategory pipelineLog("pipeline");
+LogCategory statsLog("stats");
 
-        auto it = connections.find(viewerId);
-        if (it != connections.end()) {
-            if (it->second->pc) {
-                it->second->pc->close();
-            }
-            connections.erase(it);
-        }
-
-        auto peerInfo = std::make_shared<PeerInfo>();
-        peerInfo->sessionId = sessionId;
+// Encoder bitrate driven by viewers' bandwidth estimates; transcode only.
+struct AdaptiveBitrate {
+    BitrateController controller;
+    GstElement *encoder;
+};
 
-        rtc::Configuration config;
-        config.iceServers.emplace_back("stun:stun.l.google.com:19302");
-        config.disableAutoNegotiation = true;
+// One source and the viewers watching it. Without --channels the sender
+// runs a single channel. Channels are created at startup and live until
+// exit, so callbacks may hold plain pointers to them.
+struct Channel {
+    std::string name;
+    PeerConnectionManager peers;
+    GstElement *pipeline = nullptr;
+    std::vector<std::thread> ingestReaders;
+    RtpFileCache fileCache;
+    std::unique_ptr<RtpCachePlayer> cachePlayer;
+    std::unique_ptr<AdaptiveBitrate> adaptiveBitrate;
+    // Shared with the keyframe request handler, which forwards PLIs upstream.
+    std::shared_ptr<RelaySource> relay;
+    // One per layer with --fec; relays forward the origin's FEC instead.
+    std::vector<std::unique_ptr<FecEncoder>> fec;
+    // Over all layers' streaming threads.
+    metrics::Counter ingestPackets;
+    metrics::Counter ingestBytes;
+    metrics::Counter ingestFrames;
+    // Pool joins seen by rebalance_pools, and its decayed count of recent ones
+    uint64_t poolJoins = 0;
+    double poolDemand = 0;
+};
 
+// Fixed once streaming starts; the first channel is the default.
+std::vector<std::unique_ptr<Channel>> channels;
+// Send workers shared by every channel.
+std::shared_ptr<FanoutEngine> fanoutEngine;
+std::atomic<uint64_t> ingestMaxFramePackets{0};  // since the last report
+// Live pipelines stamp abs-capture-time on each frame's first packet; set before streaming.
+bool stampCaptureTime = true;
+// From a frame's first packet entering the process until every viewer queue has the frame.
+metrics::Histogram frameHandoffTime{{1e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 5e-2, 0.1}};
 
-        peerInfo->pc = std::make_shared<rtc::PeerConnection>(config);
+// Common entry point for frames from the live pipeline or the file cache.
+static void ingest_frame(Channel& channel, const std::vector<RtpPacketRef>& frame, size_t layer) {
+    uint64_t bytes = 0;
+    for (const RtpPacketRef& packet : frame) {
+        bytes += packet->size();
+    }
+    channel.ingestFrames.add();
+    channel.ingestPackets.add(frame.size());
+    channel.ingestBytes.add(bytes);
+    uint64_t largest = ingestMaxFramePackets.load(std::memory_order_relaxed);
+    while (frame.size() > largest &&
+           !ingestMaxFramePackets.compare_exchange_weak(largest, frame.size(), std::memory_order_relaxed)) {
+    }
+    try {
+        // Gửi video frame tới tất cả kết nối
+        channel.peers.sendFrameToAll(channel.fec.empty() ? frame : channel.fec[layer]->protect(frame), layer);
+        frameHandoffTime.observe(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - frame.front()->createdAt()).count());
+    } catch (const std::exception &e) {
+        log_error(ingestLog, {{"channel", channel.name}, {"layer", std::to_string(layer)}},
+                  "Error sending video data: ", e.what());
+    }
+}
 
-        rtc::Description::Video media("video", rtc::Description::Direction::SendOnly);
-        media.addH264Codec(96);
-        peerInfo->videoTrack = peerInfo->pc->addTrack(media);
+// Frames are cut after the marker bit, which rtph264pay sets on the last
+// packet of each access unit; the cap only guards against a missing marker.
+constexpr size_t kMaxFramePackets = 1024;
 
-       
-        std::weak_ptr<PeerInfo> weakInfo = peerInfo;
+static void append_to_frame(Channel& channel, std::vector<RtpPacketRef>& frame, GstBuffer *buffer,
+                            size_t layer) {
+    // Only a frame's first packet carries its arrival time, so the rest stay
+    // mapped without a copy
+    RtpPacketRef packet = stampCaptureTime && frame.empty()
+                              ? RtpPacket::fromGstBuffer(buffer, rtp::toNtp(std::chrono::system_clock::now()))
+                              : RtpPacket::fromGstBuffer(buffer);
+    if (!packet) {
+        log_error(ingestLog, {{"channel", channel.name}}, "Unable to map buffer");
+        return;
+    }
+    bool last = rtp::isValid(packet->data(), packet->size()) && rtp::marker(packet->data());
+    frame.push_back(std::move(packet));
+    if (last || frame.size() >= kMaxFramePackets) {
+        ingest_frame(channel, frame, layer);
+        frame.clear();
+    }
+}
 
-        peerInfo->videoTrack->onOpen([weakInfo]() {
-            if (auto shared = weakInfo.lock()) {
-                shared->trackOpen = true;
-                std::cout << "Video track is now open for viewer" << std::endl;
+// Pulls one appsink on a dedicated thread until EOS or shutdown. Samples
+// are buffer lists from rtph264pay, or single buffers. The appsink does not
+// drop: when this thread falls behind, the pipeline blocks instead.
+static void run_appsink_reader(Channel *channel, GstElement *appsink, size_t layer) {
+    std::vector<RtpPacketRef> frame;
+    frame.reserve(kMaxFramePackets);
+    while (GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) {
+        if (GstBufferList *list = gst_sample_get_buffer_list(sample)) {
+            guint length = gst_buffer_list_length(list);
+            for (guint i = 0; i < length; ++i) {
+                append_to_frame(*channel, frame, gst_buffer_list_get(list, i), layer);
             }
-        });
+        } else if (GstBuffer *buffer = gst_sample_get_buffer(sample)) {
+            append_to_frame(*channel, frame, buffer, layer);
+        }
+        gst_sample_unref(sample);
+    }
+    if (!frame.empty()) {
+        ingest_frame(*channel, frame, layer);
+    }
+    gst_object_unref(appsink);
+}
 
-        peerInfo->videoTrack->onClosed([weakInfo]() {
-            if (auto shared = weakInfo.lock()) {
-                shared->trackOpen = false;
-                std::cout << "Video track is now closed for viewer" << std::endl;
-            }
-        });
+// Time from a viewer asking to join until its offer is on the websocket.
+LatencyStats offerLatency;
+// Time from a viewer asking to join until its peer connection is up.
+LatencyStats negotiationLatency;
 
-        connections[viewerId] = peerInfo;
+// Incoming messages are parsed on the websocket thread, then handled on a
+// strand per viewer, so one slow offer does not hold up other viewers'
+// answers and candidates.
+StrandExecutor signalingDispatcher;
+std::atomic<uint64_t> signalingMessagesIn{0};
+std::atomic<uint64_t> signalingMessagesOut{0};
 
-        return peerInfo;
-    }
+// ws_hdl is replaced on every reconnect.
+std::mutex ws_mutex;
+std::string signalingUrl;
+std::atomic<bool> signalingStopping{false};
+std::chrono::milliseconds reconnectDelay{500};
+constexpr std::chrono::milliseconds kMaxReconnectDelay{30000};
 
-    std::shared_ptr<PeerInfo> getPeerInfo(const std::string& viewerId) {
-        std::lock_guard<std::mutex> lock(mutex);
-        auto it = connections.find(viewerId);
-        if (it != connections.end()) {
-            return it->second;
-        }
-        return nullptr;
+static bool send_signaling(const json& j) {
+    if (!ws_connected) {
+        return false;
+    }
+    std::string payload = j.dump();
+    websocketpp::lib::error_code ec;
+    {
+        std::lock_guard<std::mutex> lock(ws_mutex);
+        client.send(ws_hdl, payload, websocketpp::frame::opcode::text, ec);
+    }
+    if (ec) {
+        log_error(signalingLog, {}, "Error sending signaling message: ", ec.message());
+        return false;
     }
+    signalingMessagesOut.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
 
-    
-    void removePeerConnection(const std::string& viewerId) {
-        std::lock_guard<std::mutex> lock(mutex);
-        auto it = connections.find(viewerId);
-        if (it != connections.end()) {
-            if (it->second->pc) {
-                it->second->pc->close();
-            }
-            connections.erase(it);
-            std::cout << "Removed peer connection for viewer: " << viewerId << std::endl;
-        }
+static void send_local_description(const std::string& viewerId, const std::string& sessionId,
+                                   const rtc::Description& desc,
+                                   std::chrono::steady_clock::time_point requestedAt) {
+    if (!ws_connected) {
+        log_warn(signalingLog, {{"viewer", viewerId}}, "WebSocket not connected, can't send local description");
+        return;
     }
 
-    void sendVideoFrameToAll(const std::vector<std::byte>& data) {
-        std::vector<std::shared_ptr<PeerInfo>> peers;
-        {
-            std::lock_guard<std::mutex> lock(mutex);
-            for (auto& [_, peerInfo] : connections) {
-                peers.push_back(peerInfo);
-            }
-        }
+    json j = {
+        {"type", desc.typeString()},
+        {"sdp", std::string(desc)},
+        {"target_id", viewerId}, 
+        {"session_id", sessionId}
+    };
 
-        for (auto& peerInfo : peers) {
-            if (peerInfo && peerInfo->videoTrack && peerInfo->trackOpen &&
-                peerInfo->pc->state() == rtc::PeerConnection::State::Connected) {
-                try {
-                    peerInfo->videoTrack->send(data);
-                } catch (const std::exception& e) {
-                    std::cerr << "Error sending video: " << e.what() << std::endl;
-                }
-            }
-        }
+    log_info(signalingLog, {{"viewer", viewerId}, {"session", sessionId}}, "Sending local description");
+    if (send_signaling(j)) {
+        offerLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - requestedAt));
     }
+}
 
-    std::vector<std::string> getAllViewerIds() {
-        std::lock_guard<std::mutex> lock(mutex);
-        std::vector<std::string> ids;
-        for (const auto& [viewerId, _] : connections) {
-            ids.push_back(viewerId);
-        }
-        return ids;
+// Tells a viewer it gets no offer, so it can show why or try again later.
+// "viewer_limit" is temporary; "unknown_channel" is not.
+static void send_rejection(const std::string& viewerId, const std::string& sessionId, const char *reason) {
+    if (!ws_connected) {
+        return;
     }
+    json j = {
+        {"type", "rejected"},
+        {"reason", reason},
+        {"target_id", viewerId},
+        {"session_id", sessionId}
+    };
+    send_signaling(j);
+}
 
-    size_t getConnectionCount() {
-        std::lock_guard<std::mutex> lock(mutex);
-        return connections.size();
-    }
+// Trickle candidates are held briefly and sent to each viewer in one
+// message: "candidates" carries them all, "candidate" the first one for
+// receivers that only read a single candidate.
+constexpr long kCandidateBatchMs = 20;
 
+struct PendingCandidates {
+    std::string sessionId;
+    std::vector<std::string> candidates;
+};
+std::mutex candidateMutex;
+std::map<std::string, PendingCandidates> pendingCandidates;
 
-    void closeAll() {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (auto& [_, peerInfo] : connections) {
-            if (peerInfo->pc) {
-                peerInfo->pc->close();
-            }
+static void flush_candidates(const std::string& viewerId) {
+    PendingCandidates batch;
+    {
+        std::lock_guard<std::mutex> lock(candidateMutex);
+        auto it = pendingCandidates.find(viewerId);
+        if (it == pendingCandidates.end()) {
+            return;
         }
-        connections.clear();
+        batch = std::move(it->second);
+        pendingCandidates.erase(it);
+    }
+    if (batch.candidates.empty()) {
+        return;
+    }
+    if (!ws_connected) {
+        log_warn(signalingLog, {{"viewer", viewerId}}, "WebSocket not connected, can't send candidates");
+        return;
     }
 
-private:
-    std::map<std::string, std::shared_ptr<PeerInfo>> connections;
-    std::mutex mutex;
-};
+    json j = {
+        {"candidate", batch.candidates.front()},
+        {"candidates", batch.candidates},
+        {"sdpMLineIndex", 0},
+        {"sdpMid", "video"},
+        {"target_id", viewerId},
+        {"session_id", batch.sessionId}
+    };
 
+    log_info(signalingLog, {{"viewer", viewerId}, {"session", batch.sessionId}},
+             "Sending ", batch.candidates.size(), " local ICE candidates");
+    send_signaling(j);
+}
 
+static void queue_local_candidate(const std::string& viewerId, const std::string& sessionId,
+                                  const std::string& candidate) {
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lock(candidateMutex);
+        PendingCandidates& pending = pendingCandidates[viewerId];
+        first = pending.candidates.empty();
+        pending.sessionId = sessionId;
+        pending.candidates.push_back(candidate);
+    }
+    if (first) {
+        client.set_timer(kCandidateBatchMs, [viewerId](const websocketpp::lib::error_code& ec) {
+            if (!ec) {
+                flush_candidates(viewerId);
+            }
+        });
+    }
+}
 
-PeerConnectionManager peerConnectionManager;
-ws_client client;
-websocketpp::connection_hdl ws_hdl;
-std::atomic<bool> ws_connected{false};
-std::string localClientId; // ID của client này (sender)
+// The channel a joining viewer asked for with "channel", or the default
+// one. A single-channel sender serves every viewer; otherwise an unknown
+// name yields nullptr.
+static Channel* requested_channel(const json& j) {
+    if (channels.size() == 1 || !j.contains("channel") || !j["channel"].is_string()) {
+        return channels.front().get();
+    }
+    std::string name = j["channel"];
+    for (const auto& channel : channels) {
+        if (channel->name == name) {
+            return channel.get();
+        }
+    }
+    return nullptr;
+}
 
-static GstFlowReturn on_new_sample(GstElement *appsink, gpointer) {
-    GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
-    if (!sample) {
-        std::cerr << "Error: No sample received from appsink" << std::endl;
-        return GST_FLOW_ERROR;
+// How far behind live a joining viewer asked to start, with "delay" in
+// seconds, and how fast to catch up, with "catchup".
+static TimeShift requested_time_shift(const json& j) {
+    TimeShift shift;
+    if (j.contains("delay") && j["delay"].is_number() && j["delay"].get<double>() > 0) {
+        shift.delay = std::chrono::milliseconds(static_cast<int64_t>(j["delay"].get<double>() * 1000));
     }
-    
-    GstBuffer *buffer = gst_sample_get_buffer(sample);
-    GstMapInfo map;
-    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-        try {
-            // std::cout << "Sending " << map.size << " bytes of video data to all peers" << std::endl;
-            std::vector<std::byte> message(reinterpret_cast<std::byte*>(map.data),
-                                           reinterpret_cast<std::byte*>(map.data + map.size));
-            
-            // Gửi video frame tới tất cả kết nối
-            peerConnectionManager.sendVideoFrameToAll(message);
-            
-        } catch (const std::exception &e) {
-            std::cerr << "Error sending video data: " << e.what() << std::endl;
+    if (j.contains("catchup") && j["catchup"].is_number()) {
+        shift.catchUpSpeed = j["catchup"].get<double>();
+    }
+    return shift;
+}
+
+// The channel holding the viewer's peer connection, for its answer and
+// candidates, which do not name a channel.
+static std::pair<Channel*, std::shared_ptr<PeerConnectionManager::PeerInfo>> find_viewer(const std::string& viewerId) {
+    for (const auto& channel : channels) {
+        if (auto peerInfo = channel->peers.getPeerInfo(viewerId)) {
+            return {channel.get(), peerInfo};
         }
-        gst_buffer_unmap(buffer, &map);
-    } else {
-        std::cerr << "Error: Unable to map buffer" << std::endl;
     }
-    
-    gst_sample_unref(sample);
-    return GST_FLOW_OK;
+    return {nullptr, nullptr};
 }
 
-void create_offer_for_viewer(const std::string& viewerId, const std::string& sessionId) {
-    std::cout << "Creating new offer for viewer: " << viewerId << " with session: " << sessionId << std::endl;
-    
-    auto peerInfo = peerConnectionManager.createPeerConnection(viewerId, sessionId);
-    
-    // SEND SDP -> SIGNALING
-    peerInfo->pc->onLocalDescription([viewerId, sessionId](rtc::Description desc) {
-        try {
-            if (!ws_connected) {
-                std::cerr << "WebSocket not connected, can't send local description" << std::endl;
-                return;
-            }
+void create_offer_for_viewer(Channel *channel, const std::string& viewerId, const std::string& sessionId,
+                             const TimeShift& shift = {}) {
+    log_info(peerLog, {{"viewer", viewerId}, {"session", sessionId}, {"channel", channel->name}}, "Creating new offer");
+    auto requestedAt = std::chrono::steady_clock::now();
+    if (shift.delay.count() > 0 && !channel->peers.hasDvr()) {
+        log_info(peerLog, {{"viewer", viewerId}, {"channel", channel->name}},
+                 "Time shift requested without a DVR, joining live");
+    }
 
-            json j = {
-                {"type", desc.typeString()},
-                {"sdp", std::string(desc)},
-                {"target_id", viewerId}, 
-                {"session_id", sessionId}
-            };
+    auto peerInfo = channel->peers.createPeerConnection(viewerId, sessionId, shift);
+    if (!peerInfo) {
+        log_warn(peerLog, {{"viewer", viewerId}, {"session", sessionId}, {"channel", channel->name}},
+                 "Viewer limit reached, not creating an offer");
+        send_rejection(viewerId, sessionId, "viewer_limit");
+        return;
+    }
 
-            std::cout << "Sending local description to viewer " << viewerId << std::endl;
-            client.send(ws_hdl, j.dump(), websocketpp::frame::opcode::text);
-        } catch (const std::exception &e) {
-            std::cerr << "Error sending local description: " << e.what() << std::endl;
+    // A viewer switching channels leaves the one it was watching, once the
+    // new one has let it in; a full channel leaves it where it was
+    for (const auto& other : channels) {
+        if (other.get() != channel && other->peers.getPeerInfo(viewerId)) {
+            other->peers.removePeerConnection(viewerId);
         }
+    }
+    
+    // SEND SDP -> SIGNALING
+    peerInfo->pc->onLocalDescription([viewerId, sessionId, requestedAt](rtc::Description desc) {
+        send_local_description(viewerId, sessionId, desc, requestedAt);
     });
 
     // SEND ICE candidate
     peerInfo->pc->onLocalCandidate([viewerId, sessionId](rtc::Candidate cand) {
-        try {
-            if (!ws_connected) {
-                std::cerr << "WebSocket not connected, can't send candidate" << std::endl;
-                return;
-            }
-
-            std::string candidateStr = std::string(cand);
-            int mLineIndex = 0;
-            std::string sdpMid = "video";
-
-            json j = {
-                {"candidate", candidateStr},
-                {"sdpMLineIndex", mLineIndex},
-                {"sdpMid", sdpMid},
-                {"target_id", viewerId},  
-                {"session_id", sessionId} 
-            };
-
-            std::cout << "Sending local ICE candidate to viewer " << viewerId << std::endl;
-            client.send(ws_hdl, j.dump(), websocketpp::frame::opcode::text);
-        } catch (const std::exception &e) {
-            std::cerr << "Error sending candidate: " << e.what() << std::endl;
-        }
+        queue_local_candidate(viewerId, sessionId, std::string(cand));
     });
 
     // Handle State Connection for PeerConnection
-    peerInfo->pc->onStateChange([viewerId](rtc::PeerConnection::State state) {
-        std::cout << "PeerConnection state for " << viewerId << ": ";
-        switch (state) {
-            case rtc::PeerConnection::State::New: std::cout << "New"; break;
-            case rtc::PeerConnection::State::Connecting: std::cout << "Connecting"; break;
-            case rtc::PeerConnection::State::Connected: std::cout << "Connected"; break;
-            case rtc::PeerConnection::State::Disconnected: std::cout << "Disconnected";  break;
-            case rtc::PeerConnection::State::Failed: std::cout << "Failed"; break;
-            case rtc::PeerConnection::State::Closed: std::cout << "Closed"; break;
-            default: std::cout << "Unknown"; break;
-        }
-        std::cout << std::endl;
-
-        std::cout << "Num connection count before remove: "
-              << peerConnectionManager.getConnectionCount() << std::endl;
-        
-        // auto ids = peerConnectionManager.getAllViewerIds();
-        // std::cout << "👥 Viewers current: ";
-        // for (const auto& id : ids) {
-        //     std::cout << id << " ";
-        // }
-        // std::cout << std::endl;
-
-        // if (state == rtc::PeerConnection::State::Disconnected || 
-        //     state == rtc::PeerConnection::State::Failed || 
-        //     state == rtc::PeerConnection::State::Closed) {
-        //     std::cout << "Remove peerconnection ...." << std::endl;
-        //     peerConnectionManager.removePeerConnection(viewerId);
-        // }
-
-        // std::cout << "Num connection count after remove: "
-        //       << peerConnectionManager.getConnectionCount() << std::endl;
+    std::weak_ptr<PeerConnectionManager::PeerInfo> weakInfo = peerInfo;
+    peerInfo->pc->onStateChange([channel, viewerId, weakInfo, requestedAt](rtc::PeerConnection::State state) {
+        if (auto shared = weakInfo.lock()) {
+            channel->peers.updatePeerState(shared, state);
+        }
+        if (state == rtc::PeerConnection::State::Connected) {
+            negotiationLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - requestedAt));
+        }
 
+        const char *name = "Unknown";
+        switch (state) {
+            case rtc::PeerConnection::State::New: name = "New"; break;
+            case rtc::PeerConnection::State::Connecting: name = "Connecting"; break;
+            case rtc::PeerConnection::State::Connected: name = "Connected"; break;
+            case rtc::PeerConnection::State::Disconnected: name = "Disconnected";  break;
+            case rtc::PeerConnection::State::Failed: name = "Failed"; break;
+            case rtc::PeerConnection::State::Closed: name = "Closed"; break;
+            default: break;
+        }
+        log_info(peerLog, {{"viewer", viewerId}, {"state", name}}, "PeerConnection state changed");
     });
     // Handale State Gathering for PeerCOnnection
-    peerInfo->pc->onGatheringStateChange([](rtc::PeerConnection::GatheringState gatheringState) {
-        std::cout << "Gathering state changed: ";
+    peerInfo->pc->onGatheringStateChange([viewerId](rtc::PeerConnection::GatheringState gatheringState) {
+        if (gatheringState == rtc::PeerConnection::GatheringState::Complete) {
+            flush_candidates(viewerId);
+        }
+        const char *name = "Unknown";
         switch (gatheringState) {
             case rtc::PeerConnection::GatheringState::New:
-                std::cout << "New";
+                name = "New";
                 break;
             case rtc::PeerConnection::GatheringState::InProgress:
-                std::cout << "InProgress";
+                name = "InProgress";
                 break;
             case rtc::PeerConnection::GatheringState::Complete:
-                std::cout << "Complete";
+                name = "Complete";
                 break;
         }
-        std::cout << std::endl;
+        log_debug(peerLog, {{"viewer", viewerId}, {"state", name}}, "Gathering state changed");
     });
     
-    // Make Offer 
+    // Make Offer; a pooled connection already has one with all candidates
+    if (peerInfo->prewarmed) {
+        if (auto desc = peerInfo->pc->localDescription()) {
+            send_local_description(viewerId, sessionId, *desc, requestedAt);
+            return;
+        }
+    }
     peerInfo->pc->setLocalDescription();
 }
 
-void start_signaling(const std::string& ws_url) {
+// The viewer a message is about, used to pick its strand.
+static std::string signaling_viewer_id(const json& j) {
+    for (const char *field : {"target_id", "from", "viewer_id"}) {
+        if (j.contains(field) && j[field].is_string()) {
+            return j[field].get<std::string>();
+        }
+    }
+    return "unknown";
+}
+
+// Runs on the viewer's strand of signalingDispatcher.
+static void handle_signaling_message(const json& j) {
+    // Full SDPs; only formatted at debug level
+    log_debug(signalingLog, {}, "Received message: ", j);
+
+    // Process requests to create new offers when new viewers connect
+    if (j.contains("type") && j["type"] == "create_new_offer") {
+        std::string viewerId = j["viewer_id"];
+        std::string sessionId = j.contains("session_id") ? j["session_id"].get<std::string>() : std::to_string(rand());
+
+        Channel *channel = requested_channel(j);
+        if (!channel) {
+            log_warn(signalingLog, {{"viewer", viewerId}, {"channel", j["channel"].get<std::string>()}},
+                     "Unknown channel, not creating an offer");
+            send_rejection(viewerId, sessionId, "unknown_channel");
+            return;
+        }
+        create_offer_for_viewer(channel, viewerId, sessionId, requested_time_shift(j));
+        return;
+    }
+    
+    // SDP processing
+    if (j.contains("sdp")) {
+        std::string sdp = j["sdp"];
+        std::string type = j["type"];
+        std::string viewerId = signaling_viewer_id(j);
+        std::string sessionId = j.contains("session_id") ? j["session_id"] : "default";
+        
+        log_info(signalingLog, {{"viewer", viewerId}, {"session", sessionId}}, "Received SDP ", type);
+        
+        // If it is an answer, need to update remote description for specific viewer
+        if (type == "answer") {
+            auto peerInfo = find_viewer(viewerId).second;
+            if (peerInfo && peerInfo->pc) {
+                try {
+                    peerInfo->pc->setRemoteDescription(rtc::Description(sdp, type));
+                } catch (const std::exception& e) {
+                    log_error(signalingLog, {{"viewer", viewerId}}, "Error setting remote description: ", e.what());
+                }
+            } else {
+                log_warn(signalingLog, {{"viewer", viewerId}}, "No peer connection found for answer");
+                // If no connection found, create a new one
+                if (Channel *requested = requested_channel(j)) {
+                    create_offer_for_viewer(requested, viewerId, sessionId);
+                }
+            }
+        }
+    } 
+    // ICE candidate processing, one or a batch
+    else if (j.contains("candidate") || j.contains("candidates")) {
+        std::vector<std::string> candidates;
+        if (j.contains("candidates") && j["candidates"].is_array()) {
+            candidates = j["candidates"].get<std::vector<std::string>>();
+        } else {
+            candidates.push_back(j["candidate"].get<std::string>());
+        }
+        std::string viewerId = signaling_viewer_id(j);
+        
+        log_debug(signalingLog, {{"viewer", viewerId}}, "Received ", candidates.size(), " ICE candidates");
+        
+        auto peerInfo = find_viewer(viewerId).second;
+        if (!peerInfo || !peerInfo->pc) {
+            log_warn(signalingLog, {{"viewer", viewerId}}, "No peer connection found for candidates");
+            return;
+        }
+        for (const std::string& candidate : candidates) {
+            try {
+                peerInfo->pc->addRemoteCandidate(rtc::Candidate(candidate));
+            } catch (const std::exception& e) {
+                log_error(signalingLog, {{"viewer", viewerId}}, "Error adding remote candidate: ", e.what());
+            }
+        }
+    }
+    // Handle session join requests from new viewers
+    else if (j.contains("type") && j["type"] == "viewer_joined") {
+        std::string viewerId = j["viewer_id"];
+        std::string sessionId = j.contains("session_id") ? j["session_id"].get<std::string>() : std::to_string(rand());
+
+        Channel *channel = requested_channel(j);
+        if (!channel) {
+            log_warn(signalingLog, {{"viewer", viewerId}, {"channel", j["channel"].get<std::string>()}},
+                     "Unknown channel, not creating an offer");
+            send_rejection(viewerId, sessionId, "unknown_channel");
+            return;
+        }
+        log_info(signalingLog, {{"viewer", viewerId}, {"session", sessionId}, {"channel", channel->name}},
+                 "New viewer joined, creating offer");
+        create_offer_for_viewer(channel, viewerId, sessionId, requested_time_shift(j));
+    }
+}
+
+static void connect_signaling();
+
+// Called on the websocket thread, which also owns reconnectDelay.
+static void schedule_reconnect() {
+    if (signalingStopping) {
+        return;
+    }
+    std::chrono::milliseconds delay = reconnectDelay;
+    reconnectDelay = std::min(reconnectDelay * 2, kMaxReconnectDelay);
+    log_warn(signalingLog, {}, "Reconnecting to signaling server in ", delay.count(), " ms");
+    client.set_timer(delay.count(), [](const websocketpp::lib::error_code& ec) {
+        if (!ec) {
+            connect_signaling();
+        }
+    });
+}
+
+static void connect_signaling() {
+    if (signalingStopping) {
+        return;
+    }
+    websocketpp::lib::error_code ec;
+    auto con = client.get_connection(signalingUrl, ec);
+    if (ec) {
+        // A bad URL will not get better by retrying
+        log_error(signalingLog, {}, "WebSocket connection error: ", ec.message());
+        return;
+    }
+    client.connect(con);
+}
+
+void start_signaling(const std::string& ws_url, size_t dispatcher_threads) {
     try {
+        signalingUrl = ws_url;
+        signalingDispatcher.start(dispatcher_threads);
+
         client.init_asio();
         client.clear_access_channels(websocketpp::log::alevel::all);
         client.set_access_channels(websocketpp::log::alevel::connect | 
                                   websocketpp::log::alevel::disconnect | 
                                   websocketpp::log::alevel::app);
+        // Keep run() alive between connections so reconnect timers fire
+        client.start_perpetual();
         
         client.set_open_handler([](websocketpp::connection_hdl hdl) {
-            ws_hdl = hdl;
+            {
+                std::lock_guard<std::mutex> lock(ws_mutex);
+                ws_hdl = hdl;
+            }
             ws_connected = true;
-            std::cout << "Connected to signaling server" << std::endl;
-            try {
-                json client_info = {
-                    {"client_type", "sender"}  
-                };
-                std::string message = client_info.dump();
-                client.send(hdl, message, websocketpp::frame::opcode::text);
-            } catch (const std::exception& e) {
-                std::cerr << "Error sending client info: " << e.what() << std::endl;
+            reconnectDelay = std::chrono::milliseconds(500);
+            log_info(signalingLog, {}, "Connected to signaling server");
+            json client_info = {
+                {"client_type", "sender"},
+                {"channels", json::array()}
+            };
+            for (const auto& channel : channels) {
+                client_info["channels"].push_back(channel->name);
             }
+            send_signaling(client_info);
         });
         
         client.set_close_handler([](websocketpp::connection_hdl) {
             ws_connected = false;
-            std::cout << "Disconnected from signaling server" << std::endl;
+            log_warn(signalingLog, {}, "Disconnected from signaling server");
+            schedule_reconnect();
         });
         
         client.set_fail_handler([](websocketpp::connection_hdl) {
             ws_connected = false;
-            std::cerr << "Failed to connect to signaling server" << std::endl;
+            log_error(signalingLog, {}, "Failed to connect to signaling server");
+            schedule_reconnect();
         });
         
         client.set_message_handler([](websocketpp::connection_hdl, ws_client::message_ptr msg) {
+            signalingMessagesIn.fetch_add(1, std::memory_order_relaxed);
             try {
-                auto data = msg->get_payload();
-                std::cout << "Received message: " << data << std::endl;
-                auto j = json::parse(data);
+                json j = json::parse(msg->get_payload());
 
                 if (j.contains("type") && j["type"] == "registration_successful") {
                     if (j.contains("client_id")) {
                         localClientId = j["client_id"];
-                        std::cout << "Registration successful. Local client ID: " << localClientId << std::endl;
+                        log_info(signalingLog, {{"client", localClientId}}, "Registration successful");
                     }
                     return;
                 }
-                
-                // Process requests to create new offers when new viewers connect
-                if (j.contains("type") && j["type"] == "create_new_offer") {
-                    std::string viewerId = j["viewer_id"];
-                    std::string sessionId = j.contains("session_id") ? j["session_id"].get<std::string>() : std::to_string(rand());
 
-                    create_offer_for_viewer(viewerId, sessionId);
-                    return;
-                }
-                
-                // SDP processing
-                if (j.contains("sdp")) {
-                    std::string sdp = j["sdp"];
-                    std::string type = j["type"];
-                    std::string viewerId = j.contains("target_id") ? j["target_id"] : 
-                                        (j.contains("from") ? j["from"] : "unknown");
-                    std::string sessionId = j.contains("session_id") ? j["session_id"] : "default";
-                    
-                    std::cout << "Received SDP " << type << " from " << viewerId << " session " << sessionId << std::endl;
-                    
-                    // If it is an answer, need to update remote description for specific viewer
-                    if (type == "answer") {
-                        auto peerInfo = peerConnectionManager.getPeerInfo(viewerId);
-                        if (peerInfo && peerInfo->pc) {
-                            try {
-                                peerInfo->pc->setRemoteDescription(rtc::Description(sdp, type));
-                            } catch (const std::exception& e) {
-                                std::cerr << "Error setting remote description: " << e.what() << std::endl;
-                            }
-                        } else {
-                            std::cerr << "No peer connection found for viewer: " << viewerId << std::endl;
-                            // If no connection found, create a new one
-                            create_offer_for_viewer(viewerId, sessionId);
-                        }
-                    }
-                } 
-                // ICE candidate processing
-                else if (j.contains("candidate")) {
-                    std::string candidate = j["candidate"];
-                    std::string viewerId = j.contains("target_id") ? j["target_id"] : 
-                                        (j.contains("from") ? j["from"] : "unknown");
-                    
-                    std::cout << "Received ICE candidate from " << viewerId << std::endl;
-                    
-                    auto peerInfo = peerConnectionManager.getPeerInfo(viewerId);
-                    if (peerInfo && peerInfo->pc) {
-                        try {
-                            peerInfo->pc->addRemoteCandidate(rtc::Candidate(candidate));
-                        } catch (const std::exception& e) {
-                            std::cerr << "Error adding remote candidate: " << e.what() << std::endl;
-                        }
-                    } else {
-                        std::cerr << "No peer connection found for viewer: " << viewerId << std::endl;
-                    }
-                }
-                // Handle session join requests from new viewers
-                else if (j.contains("type") && j["type"] == "viewer_joined") {
-                    std::string viewerId = j["viewer_id"];
-                    std::string sessionId = j.contains("session_id") ? j["session_id"].get<std::string>() : std::to_string(rand());
-
-                    
-                    std::cout << "New viewer joined: " << viewerId << ", creating offer..." << std::endl;
-                    create_offer_for_viewer(viewerId, sessionId);
-                }
+                std::string viewerId = signaling_viewer_id(j);
+                signalingDispatcher.post(viewerId, [j = std::move(j)]() {
+                    handle_signaling_message(j);
+                });
             } catch (const std::exception &e) {
-                std::cerr << "Error handling WebSocket message: " << e.what() << std::endl;
+                log_error(signalingLog, {}, "Error handling WebSocket message: ", e.what());
             }
         });
         
-        websocketpp::lib::error_code ec;
-        auto con = client.get_connection(ws_url, ec);
-        if (ec) {
-            std::cerr << "WebSocket connection error: " << ec.message() << std::endl;
-            return;
-        }
-        
-        client.connect(con);
+        connect_signaling();
         std::thread ws_thread([&]() { 
             try {
                 client.run();
             } catch (const std::exception& e) {
-                std::cerr << "WebSocket thread error: " << e.what() << std::endl;
+                log_error(signalingLog, {}, "WebSocket thread error: ", e.what());
             }
         });
         ws_thread.detach();
         
     } catch (const std::exception &e) {
-        std::cerr << "Error initializing WebSocket client: " << e.what() << std::endl;
+        log_error(signalingLog, {}, "Error initializing WebSocket client: ", e.what());
+    }
+}
+
+// Stops reconnecting and closes the link; pending messages are dropped.
+void stop_signaling() {
+    signalingStopping = true;
+    signalingDispatcher.stop();
+    client.stop_perpetual();
+    if (ws_connected) {
+        websocketpp::lib::error_code ec;
+        std::lock_guard<std::mutex> lock(ws_mutex);
+        client.close(ws_hdl, websocketpp::close::status::normal, "Finished streaming", ec);
     }
 }
 
-GstElement* setup_gstreamer_pipeline(const std::string& video_path) {
-    std::string pipeline_str =
-    "filesrc location=" + video_path + " ! "
-    "qtdemux ! avdec_h264 ! videoconvert ! x264enc tune=zerolatency bitrate=1000 ! "
-    "video/x-h264,profile=baseline,stream-format=byte-stream ! "
-    "rtph264pay pt=96 config-interval=-1 ! "
-    "appsink name=appsink";
+enum class PipelineMode {
+    Auto,         // passthrough when the source allows it, else transcode
+    Passthrough,  // qtdemux ! h264parse ! rtph264pay, no decode/encode
+    Transcode,    // decode and re-encode with x264enc
+};
+
+// The level in the H.264 codec we offer in the SDP (libdatachannel's
+// default profile-level-id=42e01f), as level_idc.
+constexpr int kOfferedH264Level = 31;
+
+// "3.1" as 31 and "1b" as 10, as caps spell levels; -1 when unparsable.
+static int h264_level_idc(const std::string& level) {
+    if (level == "1b") {
+        return 10;
+    }
+    size_t dot = level.find('.');
+    try {
+        int major = std::stoi(level.substr(0, dot));
+        int minor = dot == std::string::npos ? 0 : std::stoi(level.substr(dot + 1));
+        return major * 10 + minor;
+    } catch (const std::exception&) {
+        return -1;
+    }
+}
+
+// Streams a browser decodes under that offer: (constrained) baseline, at a
+// level no higher than the offered one.
+static bool is_browser_compatible_h264(const GstCaps *caps) {
+    const GstStructure *structure = gst_caps_get_structure(caps, 0);
+    if (!structure || !gst_structure_has_name(structure, "video/x-h264")) {
+        return false;
+    }
+    const gchar *profile = gst_structure_get_string(structure, "profile");
+    const gchar *level = gst_structure_get_string(structure, "level");
+    if (!profile || !level) {
+        return false;
+    }
+    std::string name = profile;
+    int levelIdc = h264_level_idc(level);
+    return (name == "constrained-baseline" || name == "baseline") && levelIdc > 0 && levelIdc <= kOfferedH264Level;
+}
+
+// Inspects the first video stream of `video_path` with GstDiscoverer.
+static bool can_passthrough(const std::string& video_path) {
+    GError *error = nullptr;
+    gchar *uri = gst_filename_to_uri(video_path.c_str(), &error);
+    if (!uri) {
+        log_error(pipelineLog, {{"video", video_path}}, "Cannot build URI: ", (error ? error->message : "unknown"));
+        g_clear_error(&error);
+        return false;
+    }
+
+    bool compatible = false;
+    GstDiscoverer *discoverer = gst_discoverer_new(5 * GST_SECOND, &error);
+    if (discoverer) {
+        GstDiscovererInfo *info = gst_discoverer_discover_uri(discoverer, uri, &error);
+        if (info) {
+            GList *streams = gst_discoverer_info_get_video_streams(info);
+            if (streams) {
+                GstCaps *caps = gst_discoverer_stream_info_get_caps(GST_DISCOVERER_STREAM_INFO(streams->data));
+                if (caps) {
+                    gchar *description = gst_caps_to_string(caps);
+                    log_info(pipelineLog, {{"video", video_path}}, "Source video caps: ", description);
+                    g_free(description);
+                    compatible = is_browser_compatible_h264(caps);
+                    gst_caps_unref(caps);
+                }
+                gst_discoverer_stream_info_list_free(streams);
+            }
+            gst_discoverer_info_unref(info);
+        }
+        g_object_unref(discoverer);
+    }
+    if (error) {
+        log_error(pipelineLog, {{"video", video_path}}, "Source discovery failed: ", error->message);
+        g_clear_error(&error);
+    }
+    g_free(uri);
+    return compatible;
+}
+
+// One simulcast layer: output height (width follows the aspect ratio).
+struct LadderRung {
+    guint height;
+    guint bitrateKbps;
+};
+
+// x264enc settings for the transcode pipeline.
+struct EncoderSettings {
+    guint bitrateKbps = 1000;
+    guint keyframeInterval = 0;  // frames between periodic IDRs, 0 = x264 default
+    std::vector<LadderRung> ladder;  // lowest bitrate first; empty for a single stream
+};
+
+static std::string x264enc_description(const std::string& name, guint bitrate_kbps, const EncoderSettings& encoder) {
+    std::string x264enc = "x264enc name=" + name + " tune=zerolatency bitrate=" + std::to_string(bitrate_kbps);
+    if (encoder.keyframeInterval > 0) {
+        x264enc += " key-int-max=" + std::to_string(encoder.keyframeInterval);
+    }
+    return x264enc;
+}
+
+// Decode once, then scale and encode each rung on its own branch. All
+// payloaders share an SSRC and timestamp offset, so a viewer can switch
+// layers without renegotiating; the fan-out renumbers sequence numbers.
+static std::string ladder_pipeline_description(const std::string& video_path, const EncoderSettings& encoder) {
+    std::string ssrc = std::to_string(g_random_int());
+    std::string timestamp_offset = std::to_string(g_random_int());
+    std::string description =
+        "filesrc location=" + video_path + " ! "
+        "qtdemux ! avdec_h264 ! videoconvert ! tee name=split";
+    for (size_t i = 0; i < encoder.ladder.size(); ++i) {
+        const LadderRung& rung = encoder.ladder[i];
+        std::string index = std::to_string(i);
+        description +=
+            " split. ! queue name=encqueue" + index + " ! videoscale ! video/x-raw,height=" + std::to_string(rung.height) + " ! " +
+            x264enc_description("encoder" + index, rung.bitrateKbps, encoder) + " ! "
+            "video/x-h264,profile=baseline,stream-format=byte-stream ! "
+            "rtph264pay pt=96 config-interval=-1 ssrc=" + ssrc + " timestamp-offset=" + timestamp_offset + " ! "
+            "appsink name=appsink" + index;
+    }
+    return description;
+}
+
+// `name` in a single-stream pipeline, `name`0..`name`N-1 with a ladder, in
+// layer order. Returns new references.
+static std::vector<GstElement*> find_layer_elements(GstElement *pipeline, const std::string& name) {
+    std::vector<GstElement*> elements;
+    if (GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name.c_str())) {
+        elements.push_back(element);
+    }
+    for (size_t i = 0;; ++i) {
+        GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), (name + std::to_string(i)).c_str());
+        if (!element) {
+            break;
+        }
+        elements.push_back(element);
+    }
+    return elements;
+}
+
+static std::vector<GstElement*> find_appsinks(GstElement *pipeline) {
+    return find_layer_elements(pipeline, "appsink");
+}
+
+static std::vector<GstElement*> find_encoders(GstElement *pipeline) {
+    return find_layer_elements(pipeline, "encoder");
+}
+
+GstElement* setup_gstreamer_pipeline(const std::string& video_path, PipelineMode mode,
+                                     const EncoderSettings& encoder) {
+    if (mode == PipelineMode::Auto) {
+        mode = can_passthrough(video_path) ? PipelineMode::Passthrough : PipelineMode::Transcode;
+    }
+
+    std::string pipeline_str;
+    if (!encoder.ladder.empty()) {
+        mode = PipelineMode::Transcode;
+        pipeline_str = ladder_pipeline_description(video_path, encoder);
+    } else if (mode == PipelineMode::Passthrough) {
+        pipeline_str =
+        "filesrc location=" + video_path + " ! "
+        "qtdemux ! h264parse ! "
+        "video/x-h264,stream-format=byte-stream,alignment=au ! "
+        "rtph264pay pt=96 config-interval=-1 ! "
+        "appsink name=appsink";
+    } else {
+        pipeline_str =
+        "filesrc location=" + video_path + " ! "
+        "qtdemux ! avdec_h264 ! videoconvert ! queue name=encqueue ! " +
+        x264enc_description("encoder", encoder.bitrateKbps, encoder) + " ! "
+        "video/x-h264,profile=baseline,stream-format=byte-stream ! "
+        "rtph264pay pt=96 config-interval=-1 ! "
+        "appsink name=appsink";
+    }
     
-    std::cout << "Using GStreamer pipeline: " << pipeline_str << std::endl;
+    log_info(pipelineLog, {{"mode", mode == PipelineMode::Passthrough ? "passthrough" : "transcode"}},
+             "GStreamer pipeline: ", pipeline_str);
     
     GError *error = nullptr;
     GstElement *pipeline = gst_parse_launch(pipeline_str.c_str(), &error);
@@ -451,80 +835,1236 @@ GstElement* setup_gstreamer_pipeline(const std::string& video_path) {
         throw std::runtime_error("Failed to create GStreamer pipeline: " + error_msg);
     }
     
+    return pipeline;
+}
+
+// Runs the packetizing pipeline once, as fast as possible, and stores its
+// RTP output in `cache_path` for looping playback.
+void build_rtp_file_cache(const std::string& video_path, PipelineMode mode, const EncoderSettings& encoder,
+                          const std::string& cache_path) {
+    log_info(pipelineLog, {{"cache", cache_path}, {"video", video_path}}, "Building RTP file cache");
+
+    GstElement *pipeline = setup_gstreamer_pipeline(video_path, mode, encoder);
     GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "appsink");
-    if (!appsink) {
+    g_object_set(appsink, "emit-signals", FALSE, "sync", FALSE, "drop", FALSE, "max-buffers", 0, NULL);
+
+    RtpFileCacheWriter writer(cache_path, video_path);
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        gst_object_unref(appsink);
         gst_object_unref(pipeline);
-        throw std::runtime_error("Failed to find appsink element in pipeline");
+        throw std::runtime_error("Failed to start GStreamer pipeline for RTP file cache");
     }
-    
-    g_object_set(appsink, "emit-signals", TRUE, "drop", TRUE, "max-buffers", 1, NULL);
-    g_signal_connect(appsink, "new-sample", G_CALLBACK(on_new_sample), nullptr);
-    
+
+    while (GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        GstMapInfo map;
+        if (buffer && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            writer.append(reinterpret_cast<const std::byte*>(map.data), map.size);
+            gst_buffer_unmap(buffer, &map);
+        }
+        gst_sample_unref(sample);
+    }
+    bool eos = gst_app_sink_is_eos(GST_APP_SINK(appsink));
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(appsink);
-    return pipeline;
+    gst_object_unref(pipeline);
+
+    if (!eos) {
+        throw std::runtime_error("Pipeline stopped before EOS while building RTP file cache");
+    }
+    writer.finish();
+    log_info(pipelineLog, {{"cache", cache_path}}, "RTP file cache ready: ", writer.packetCount(), " packets");
+}
+
+// Runs on the main loop; `data` is the Channel.
+static gboolean update_bitrate(gpointer data) {
+    Channel& channel = *static_cast<Channel*>(data);
+    std::vector<uint32_t> estimates;
+    for (const ViewerBandwidthStats& viewer : channel.peers.getBandwidthStats()) {
+        estimates.push_back(viewer.estimateKbps);
+    }
+    AdaptiveBitrate& abr = *channel.adaptiveBitrate;
+    if (abr.controller.update(std::move(estimates))) {
+        // x264enc applies a new bitrate while playing; FEC takes its share first
+        unsigned protection = channel.fec.empty() ? 0 : channel.fec.front()->getProtection();
+        g_object_set(abr.encoder, "bitrate", static_cast<guint>(abr.controller.target() * 100 / (100 + protection)),
+                     NULL);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Runs on the main loop; `data` is the Channel. Four FEC packets per 100
+// media packets for each percent of loss the 90th percentile viewer
+// reports, in steps of 5 and at most 50. Receiver reports count loss before
+// FEC recovery, so the ratio does not chase its own effect.
+static gboolean update_fec(gpointer data) {
+    Channel& channel = *static_cast<Channel*>(data);
+    std::vector<double> losses;
+    for (const ViewerBandwidthStats& viewer : channel.peers.getBandwidthStats()) {
+        if (viewer.reports > 0) {
+            losses.push_back(viewer.lossPercent);
+        }
+    }
+    if (losses.empty()) {
+        return G_SOURCE_CONTINUE;
+    }
+    std::sort(losses.begin(), losses.end());
+    double loss = losses[std::min(losses.size() - 1, losses.size() * 9 / 10)];
+    unsigned percent = std::min(50u, (static_cast<unsigned>(loss * 4) + 4) / 5 * 5);
+    if (percent != channel.fec.front()->getProtection()) {
+        for (const auto& encoder : channel.fec) {
+            encoder->setProtection(percent);
+        }
+        log_info(pipelineLog, {{"channel", channel.name}}, "FEC protection ", percent, "% for ", loss,
+                 "% viewer loss");
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// --pc-pool is one budget for the whole process. Each channel's pool gets a
+// share in proportion to its recent joins, remembered with a half-life of
+// about 15 s, so idle channels hold no connections. With no joins anywhere
+// the budget is split evenly.
+static void rebalance_pools(size_t budget) {
+    std::vector<double> demand;
+    double total = 0;
+    for (const auto& channel : channels) {
+        PeerConnectionManager::PoolStats pool = channel->peers.getPoolStats();
+        uint64_t joins = pool.hits + pool.misses;
+        channel->poolDemand = channel->poolDemand * 0.8 + double(joins - channel->poolJoins);
+        channel->poolJoins = joins;
+        if (channel->poolDemand < 0.01) {
+            channel->poolDemand = 0;
+        }
+        demand.push_back(channel->poolDemand);
+        total += channel->poolDemand;
+    }
+    if (total == 0) {
+        std::fill(demand.begin(), demand.end(), 1.0);
+        total = double(demand.size());
+    }
+
+    // Largest remainder, so the shares add up to the budget
+    std::vector<size_t> shares(channels.size());
+    std::vector<std::pair<double, size_t>> remainders;
+    size_t assigned = 0;
+    for (size_t i = 0; i < channels.size(); ++i) {
+        double exact = budget * demand[i] / total;
+        shares[i] = static_cast<size_t>(exact);
+        assigned += shares[i];
+        remainders.push_back({exact - shares[i], i});
+    }
+    std::stable_sort(remainders.begin(), remainders.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (size_t i = 0; assigned < budget && i < remainders.size(); ++i, ++assigned) {
+        ++shares[remainders[i].second];
+    }
+    for (size_t i = 0; i < channels.size(); ++i) {
+        channels[i]->peers.resizePool(shares[i]);
+    }
+}
+
+static gboolean rebalance_pools_tick(gpointer budget) {
+    rebalance_pools(*static_cast<size_t*>(budget));
+    return G_SOURCE_CONTINUE;
+}
+
+static void enable_adaptive_bitrate(Channel& channel, const BitrateLimits& limits, double percentile) {
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(channel.pipeline), "encoder");
+    if (!encoder) {
+        log_info(pipelineLog, {{"channel", channel.name}},
+                 "Adaptive bitrate needs the single-stream transcode pipeline, not changing encoder bitrates");
+        return;
+    }
+    channel.adaptiveBitrate.reset(new AdaptiveBitrate{BitrateController(limits, percentile), encoder});
+    g_timeout_add_seconds(1, update_bitrate, &channel);
+    log_info(pipelineLog, {{"channel", channel.name}}, "Adaptive bitrate between ", limits.minKbps, " and ",
+             limits.maxKbps, " kbit/s, following the p", percentile, " viewer");
+}
+
+// One reader thread per appsink, each feeding its layer. `max_buffers`
+// samples may queue in the appsink before it blocks the pipeline.
+static void start_ingest(Channel& channel, guint max_buffers) {
+    std::vector<GstElement*> appsinks = find_appsinks(channel.pipeline);
+    if (appsinks.empty()) {
+        throw std::runtime_error("Failed to find appsink element in pipeline");
+    }
+    for (size_t layer = 0; layer < appsinks.size(); ++layer) {
+        g_object_set(appsinks[layer], "emit-signals", FALSE, "drop", FALSE, "max-buffers", max_buffers,
+                     "buffer-list", TRUE, NULL);
+        channel.ingestReaders.emplace_back(run_appsink_reader, &channel, appsinks[layer], layer);
+    }
+}
+
+// Runs on the main loop; `data` is the Channel.
+static gboolean select_layers(gpointer data) {
+    static_cast<Channel*>(data)->peers.selectLayers();
+    return G_SOURCE_CONTINUE;
+}
+
+static double process_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Routes viewer PLI/FIR to x264enc as an upstream force-key-unit event.
+// Passthrough pipelines have no encoder; their viewers recover at the next
+// keyframe in the source, and the requests are counted as unanswered.
+static void enable_keyframe_requests(Channel& channel, std::chrono::milliseconds min_interval) {
+    // Held by the handler, which may still be running on an RTCP thread
+    // while the pipeline shuts down.
+    std::vector<std::shared_ptr<GstPad>> pads;
+    for (GstElement *encoder : find_encoders(channel.pipeline)) {
+        pads.emplace_back(gst_element_get_static_pad(encoder, "src"), gst_object_unref);
+        gst_object_unref(encoder);
+    }
+    if (pads.empty()) {
+        log_warn(pipelineLog, {{"channel", channel.name}},
+                 "No encoder to answer keyframe requests; viewers wait for the source's next keyframe");
+        return;
+    }
+    // Every layer gets a keyframe, which also lets viewers switch layers.
+    channel.peers.setKeyframeRequestHandler([pads]() {
+        for (const auto& pad : pads) {
+            GstEvent *event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0);
+            gst_pad_send_event(pad.get(), event);
+        }
+    }, min_interval);
+    log_info(pipelineLog, {{"channel", channel.name}}, "Keyframe requests from viewers enabled, at most one per ", min_interval.count(), " ms");
+}
+
+// Periodic report of ingest throughput, process CPU, and viewers whose send
+// queue is backing up or dropping.
+static gboolean report_stats(gpointer) {
+    static auto lastTime = std::chrono::steady_clock::now();
+    static double lastCpu = process_cpu_seconds();
+    static uint64_t lastPackets = 0;
+    static uint64_t lastBytes = 0;
+    static uint64_t lastFrames = 0;
+    static uint64_t lastSignalingIn = 0;
+    static uint64_t lastSignalingOut = 0;
+    static std::map<std::string, uint64_t> lastDropped;
+    std::map<std::string, uint64_t> dropped;
+
+    auto now = std::chrono::steady_clock::now();
+    double cpu = process_cpu_seconds();
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+    size_t viewers = 0;
+    PeerConnectionManager::PoolStats pool{0, 0, 0, 0};
+    PeerConnectionManager::LifecycleStats lifecycle{0, 0, 0, 0, 0, 0};
+    PeerConnectionManager::FeedbackStats feedback{0, 0, 0, 0, 0};
+    for (const auto& channel : channels) {
+        packets += channel->ingestPackets.value();
+        bytes += channel->ingestBytes.value();
+        frames += channel->ingestFrames.value();
+        viewers += channel->peers.getSendableCount();
+        PeerConnectionManager::PoolStats channelPool = channel->peers.getPoolStats();
+        pool.target += channelPool.target;
+        pool.ready += channelPool.ready;
+        pool.hits += channelPool.hits;
+        pool.misses += channelPool.misses;
+        PeerConnectionManager::LifecycleStats channelLifecycle = channel->peers.getLifecycleStats();
+        lifecycle.live += channelLifecycle.live;
+        lifecycle.negotiating += channelLifecycle.negotiating;
+        lifecycle.zombies += channelLifecycle.zombies;
+        lifecycle.evicted += channelLifecycle.evicted;
+        lifecycle.timedOut += channelLifecycle.timedOut;
+        lifecycle.rejected += channelLifecycle.rejected;
+        PeerConnectionManager::FeedbackStats channelFeedback = channel->peers.getFeedbackStats();
+        feedback.nacked += channelFeedback.nacked;
+        feedback.retransmitted += channelFeedback.retransmitted;
+        feedback.keyframeRequests += channelFeedback.keyframeRequests;
+        feedback.keyframesForced += channelFeedback.keyframesForced;
+        feedback.keyframesUnanswered += channelFeedback.keyframesUnanswered;
+    }
+    uint64_t maxFramePackets = ingestMaxFramePackets.exchange(0, std::memory_order_relaxed);
+    uint64_t signalingIn = signalingMessagesIn.load(std::memory_order_relaxed);
+    uint64_t signalingOut = signalingMessagesOut.load(std::memory_order_relaxed);
+    double elapsed = std::chrono::duration<double>(now - lastTime).count();
+    if (elapsed > 0) {
+        log_info(statsLog, {}, "Pipeline: ", static_cast<uint64_t>((packets - lastPackets) / elapsed), " pkt/s, ",
+                 static_cast<uint64_t>((bytes - lastBytes) * 8 / elapsed / 1000), " kbit/s, ",
+                 static_cast<uint64_t>((frames - lastFrames) / elapsed), " frames/s, CPU ",
+                 static_cast<int>(100 * (cpu - lastCpu) / elapsed), "%, viewers ", viewers,
+                 channels.size() > 1 ? ", channels " + std::to_string(channels.size()) : std::string());
+        if (frames > lastFrames) {
+            log_info(statsLog, {}, "Packets per frame: avg ", (packets - lastPackets) / (frames - lastFrames),
+                     ", max ", maxFramePackets);
+        }
+        if (signalingIn > lastSignalingIn || signalingOut > lastSignalingOut) {
+            log_info(statsLog, {}, "Signaling: ", static_cast<uint64_t>((signalingIn - lastSignalingIn) / elapsed),
+                     " msg/s in, ", static_cast<uint64_t>((signalingOut - lastSignalingOut) / elapsed),
+                     " msg/s out, ", signalingDispatcher.pendingTasks(), " queued");
+        }
+    }
+    LatencyStats::Summary offers = offerLatency.summary();
+    if (offers.count > 0) {
+        log_info(statsLog, {}, "Offer latency over ", offers.count, " joins: p50 ", offers.p50Ms, " ms, p99 ",
+                 offers.p99Ms, " ms, max ", offers.maxMs, " ms; pool ", pool.ready, " of ", pool.target, " ready, ",
+                 pool.hits, " hits, ", pool.misses, " misses");
+    }
+    if (lifecycle.negotiating + lifecycle.zombies + lifecycle.evicted + lifecycle.timedOut + lifecycle.rejected > 0) {
+        log_info(statsLog, {}, "Peers: ", lifecycle.live, " live, ", lifecycle.negotiating, " negotiating, ",
+                 lifecycle.zombies, " zombie; ", lifecycle.evicted, " evicted, ", lifecycle.timedOut,
+                 " timed out, ", lifecycle.rejected, " rejected");
+    }
+    LatencyStats::Summary negotiation = negotiationLatency.summary();
+    if (negotiation.count > 0) {
+        log_info(statsLog, {}, "Negotiation latency over ", negotiation.count, " joins: p50 ", negotiation.p50Ms,
+                 " ms, p99 ", negotiation.p99Ms, " ms, max ", negotiation.maxMs, " ms");
+    }
+    LatencyStats::Summary join = fanoutEngine->timeToFirstFrame();
+    if (join.count > 0) {
+        log_info(statsLog, {}, "Time to first frame over ", join.count, " joins: p50 ", join.p50Ms,
+                 " ms, p99 ", join.p99Ms, " ms, max ", join.maxMs, " ms");
+    }
+    if (feedback.nacked > 0 || feedback.keyframeRequests > 0) {
+        log_info(statsLog, {}, "RTCP feedback: ", feedback.retransmitted, "/", feedback.nacked,
+                 " NACKed packets retransmitted, ", feedback.keyframesForced, "/",
+                 feedback.keyframeRequests, " keyframe requests forced, ", feedback.keyframesUnanswered,
+                 " with no encoder to ask");
+    }
+    for (const auto& channel : channels) {
+        if (channel->peers.getLayerCount() > 1) {
+            PeerConnectionManager::LayerStats layers = channel->peers.getLayerStats();
+            std::string perLayer;
+            for (size_t count : layers.viewers) {
+                perLayer += " " + std::to_string(count);
+            }
+            log_info(statsLog, {{"channel", channel->name}}, "Simulcast viewers per layer:", perLayer, ", ",
+                     layers.switches, " switches");
+        }
+        if (channel->relay) {
+            RelaySource::Stats relay = channel->relay->stats();
+            log_info(statsLog, {{"channel", channel->name}}, "Relay upstream ",
+                     relay.connected ? "connected" : "not connected", ": ", relay.packets, " packets over ",
+                     relay.sessions, " sessions, ", relay.keyframeRequests, " keyframe requests forwarded");
+        }
+        if (!channel->fec.empty()) {
+            uint64_t fecPackets = 0;
+            uint64_t fecBytes = 0;
+            uint64_t mediaBytes = 0;
+            for (const auto& encoder : channel->fec) {
+                FecEncoder::Stats fec = encoder->stats();
+                fecPackets += fec.fecPackets;
+                fecBytes += fec.fecBytes;
+                mediaBytes += fec.mediaBytes;
+            }
+            log_info(statsLog, {{"channel", channel->name}}, "FEC ", channel->fec.front()->getProtection(),
+                     "% protection: ", fecPackets, " packets, ",
+                     mediaBytes > 0 ? static_cast<int>(100 * fecBytes / mediaBytes) : 0, "% of media bytes");
+        }
+        if (channel->peers.hasDvr()) {
+            DvrPlayer::Stats dvr = channel->peers.getDvrStats();
+            log_info(statsLog, {{"channel", channel->name}}, "DVR ", static_cast<int>(dvr.bufferedSeconds),
+                     " s buffered in ", dvr.bytesUsed >> 20, "/", dvr.capacityBytes >> 20, " MB, ", dvr.viewers,
+                     " viewers behind live, ", dvr.caughtUp, " caught up");
+        }
+        if (channel->adaptiveBitrate) {
+            BitrateController::Metrics abr = channel->adaptiveBitrate->controller.metrics();
+            log_info(statsLog, {{"channel", channel->name}}, "Encoder bitrate ", abr.targetKbps,
+                     " kbit/s (chosen estimate ", abr.chosenEstimateKbps, " kbit/s over ", abr.viewers,
+                     " viewers, ", abr.increases, " increases, ", abr.decreases, " decreases)");
+        }
+        for (const ViewerBandwidthStats& viewer : channel->peers.getBandwidthStats()) {
+            if (viewer.lossPercent < 2.0) {
+                continue;
+            }
+            std::string extra;
+            if (viewer.rembKbps > 0) {
+                extra += ", REMB " + std::to_string(viewer.rembKbps) + " kbit/s";
+            }
+            if (viewer.rttMs >= 0) {
+                extra += ", RTT " + std::to_string(viewer.rttMs) + " ms";
+            }
+            log_info(statsLog, {{"viewer", viewer.viewerId}, {"channel", channel->name}}, "Estimate ",
+                     viewer.estimateKbps, " kbit/s, sending ", viewer.sendKbps, " kbit/s, loss ", viewer.lossPercent, "%, jitter ", viewer.jitterMs,
+                     " ms", extra);
+        }
+    }
+    lastTime = now;
+    lastCpu = cpu;
+    lastPackets = packets;
+    lastBytes = bytes;
+    lastFrames = frames;
+    lastSignalingIn = signalingIn;
+    lastSignalingOut = signalingOut;
+
+    uint64_t droppedSinceLast = 0;
+    for (const auto& channel : channels) {
+        for (const ViewerQueueStats& stats : channel->peers.getQueueStats()) {
+            dropped[stats.viewerId] = stats.dropped;
+            uint64_t previous = lastDropped.count(stats.viewerId) ? lastDropped[stats.viewerId] : 0;
+            droppedSinceLast += stats.dropped > previous ? stats.dropped - previous : 0;
+            if (stats.dropped > previous || stats.waitingForKeyframe) {
+                log_warn(statsLog, {{"viewer", stats.viewerId}, {"channel", channel->name}}, "Lagging: queue depth ",
+                         stats.depth, ", sent ", stats.sent, ", dropped ", stats.dropped, ", send errors ",
+                         stats.sendErrors, (stats.waitingForKeyframe ? ", waiting for keyframe" : ""));
+            }
+        }
+    }
+    if (droppedSinceLast > 0) {
+        log_warn(statsLog, {}, "Viewer queues dropped ", droppedSinceLast, " packets");
+    }
+    lastDropped.swap(dropped);
+    return G_SOURCE_CONTINUE;
+}
+
+// Prometheus exposition of everything report_stats logs, labelled by
+// channel, plus per-viewer series. Runs on the metrics server thread at each
+// scrape.
+static std::string render_metrics() {
+    using metrics::PrometheusText;
+    PrometheusText text;
+    auto perChannel = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        text.family(name, type, help);
+        for (const auto& channel : channels) {
+            text.sample(name, value(*channel), PrometheusText::label("channel", channel->name));
+        }
+    };
+    perChannel("sender_ingest_packets_total", "counter", "RTP packets read from the pipeline or file cache",
+               [](Channel& channel) { return double(channel.ingestPackets.value()); });
+    perChannel("sender_ingest_bytes_total", "counter", "RTP bytes read from the pipeline or file cache",
+               [](Channel& channel) { return double(channel.ingestBytes.value()); });
+    perChannel("sender_ingest_frames_total", "counter", "Access units read from the pipeline or file cache",
+               [](Channel& channel) { return double(channel.ingestFrames.value()); });
+    text.counter("sender_process_cpu_seconds_total", "User and system CPU time of the process", process_cpu_seconds());
+    text.counter("sender_signaling_messages_received_total", "Signaling messages received",
+                 signalingMessagesIn.load(std::memory_order_relaxed));
+    text.counter("sender_signaling_messages_sent_total", "Signaling messages sent",
+                 signalingMessagesOut.load(std::memory_order_relaxed));
+    text.gauge("sender_signaling_pending_messages", "Signaling messages waiting for their viewer's strand",
+               signalingDispatcher.pendingTasks());
+
+    text.latency("sender_offer_latency_seconds", "Join request until the offer is sent", offerLatency.summary());
+    text.latency("sender_negotiation_latency_seconds", "Join request until the peer connection is connected",
+                 negotiationLatency.summary());
+    text.latency("sender_time_to_first_frame_seconds", "Peer creation until the first keyframe packet is sent",
+                 fanoutEngine->timeToFirstFrame());
+    text.histogram("sender_track_send_seconds", "Time per packet in Track::send", fanoutEngine->sendTime());
+    text.histogram("sender_frame_handoff_seconds", "Frame's first packet entering the sender until queued for every viewer",
+                   frameHandoffTime);
+    text.histogram("sender_queue_wait_seconds", "Live packet queued for a viewer until Track::send returned",
+                   fanoutEngine->queueTime());
+    text.histogram("sender_ingest_to_send_seconds", "Live packet entering the sender until Track::send returned",
+                   fanoutEngine->ingestToSendTime());
+
+    text.family("sender_peers", "gauge", "Peers in the registry by state");
+    for (const auto& channel : channels) {
+        PeerConnectionManager::LifecycleStats lifecycle = channel->peers.getLifecycleStats();
+        std::string labels = PrometheusText::label("channel", channel->name) + ",";
+        text.sample("sender_peers", lifecycle.live, labels + PrometheusText::label("state", "live"));
+        text.sample("sender_peers", lifecycle.negotiating, labels + PrometheusText::label("state", "negotiating"));
+        text.sample("sender_peers", lifecycle.zombies, labels + PrometheusText::label("state", "zombie"));
+    }
+    perChannel("sender_peers_evicted_total", "counter", "Peers removed after failing, closing or staying disconnected",
+               [](Channel& channel) { return double(channel.peers.getLifecycleStats().evicted); });
+    perChannel("sender_peers_timed_out_total", "counter", "Peers removed for not connecting in time",
+               [](Channel& channel) { return double(channel.peers.getLifecycleStats().timedOut); });
+    perChannel("sender_peers_rejected_total", "counter", "Viewers turned away by --max-peers",
+               [](Channel& channel) { return double(channel.peers.getLifecycleStats().rejected); });
+
+    perChannel("sender_pool_target", "gauge", "This channel's share of --pc-pool",
+               [](Channel& channel) { return double(channel.peers.getPoolStats().target); });
+    perChannel("sender_pool_ready", "gauge", "Pre-created peer connections ready to take",
+               [](Channel& channel) { return double(channel.peers.getPoolStats().ready); });
+    perChannel("sender_pool_hits_total", "counter", "Joins served from the pool",
+               [](Channel& channel) { return double(channel.peers.getPoolStats().hits); });
+    perChannel("sender_pool_misses_total", "counter", "Joins that built a connection on the spot",
+               [](Channel& channel) { return double(channel.peers.getPoolStats().misses); });
+
+    perChannel("sender_nacked_packets_total", "counter", "Packets requested by viewer NACKs",
+               [](Channel& channel) { return double(channel.peers.getFeedbackStats().nacked); });
+    perChannel("sender_retransmitted_packets_total", "counter", "NACKed packets resent",
+               [](Channel& channel) { return double(channel.peers.getFeedbackStats().retransmitted); });
+    perChannel("sender_keyframe_requests_total", "counter", "PLI/FIR received from viewers",
+               [](Channel& channel) { return double(channel.peers.getFeedbackStats().keyframeRequests); });
+    perChannel("sender_keyframes_forced_total", "counter", "Keyframes forced on the encoder",
+               [](Channel& channel) { return double(channel.peers.getFeedbackStats().keyframesForced); });
+    perChannel("sender_keyframe_requests_unanswered_total", "counter", "PLI/FIR with no encoder to force a keyframe",
+               [](Channel& channel) { return double(channel.peers.getFeedbackStats().keyframesUnanswered); });
+
+    // Relay channels only.
+    auto perRelay = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        bool started = false;
+        for (const auto& channel : channels) {
+            if (!channel->relay) {
+                continue;
+            }
+            if (!started) {
+                text.family(name, type, help);
+                started = true;
+            }
+            text.sample(name, value(channel->relay->stats()), PrometheusText::label("channel", channel->name));
+        }
+    };
+    perRelay("sender_relay_upstream_connected", "gauge", "Whether the upstream peer connection is up",
+             [](const RelaySource::Stats& relay) { return relay.connected ? 1.0 : 0.0; });
+    perRelay("sender_relay_packets_total", "counter", "RTP packets received from upstream",
+             [](const RelaySource::Stats& relay) { return double(relay.packets); });
+    perRelay("sender_relay_sessions_total", "counter", "Upstream offers accepted",
+             [](const RelaySource::Stats& relay) { return double(relay.sessions); });
+    perRelay("sender_relay_keyframe_requests_total", "counter", "Keyframe requests forwarded upstream",
+             [](const RelaySource::Stats& relay) { return double(relay.keyframeRequests); });
+
+    // FEC channels only, per layer.
+    auto perFec = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        bool started = false;
+        for (const auto& channel : channels) {
+            for (size_t layer = 0; layer < channel->fec.size(); ++layer) {
+                if (!started) {
+                    text.family(name, type, help);
+                    started = true;
+                }
+                text.sample(name, value(channel->fec[layer]->stats()),
+                            PrometheusText::label("channel", channel->name) + "," +
+                            PrometheusText::label("layer", std::to_string(layer)));
+            }
+        }
+    };
+    perFec("sender_fec_protection_percent", "gauge", "FEC packets per 100 media packets",
+           [](const FecEncoder::Stats& fec) { return double(fec.protectionPercent); });
+    perFec("sender_fec_packets_total", "counter", "ULPFEC packets generated",
+           [](const FecEncoder::Stats& fec) { return double(fec.fecPackets); });
+    perFec("sender_fec_bytes_total", "counter", "ULPFEC bytes generated, RED header included",
+           [](const FecEncoder::Stats& fec) { return double(fec.fecBytes); });
+    perFec("sender_fec_media_bytes_total", "counter", "Media bytes sent inside RED",
+           [](const FecEncoder::Stats& fec) { return double(fec.mediaBytes); });
+    perFec("sender_fec_unprotected_packets_total", "counter", "Media packets too large for RED, sent plain",
+           [](const FecEncoder::Stats& fec) { return double(fec.unprotectedPackets); });
+
+    auto perDvr = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        bool started = false;
+        for (const auto& channel : channels) {
+            if (!channel->peers.hasDvr()) {
+                continue;
+            }
+            if (!started) {
+                text.family(name, type, help);
+                started = true;
+            }
+            text.sample(name, value(channel->peers.getDvrStats()), PrometheusText::label("channel", channel->name));
+        }
+    };
+    perDvr("sender_dvr_buffered_seconds", "gauge", "Time span held by the DVR",
+           [](const DvrPlayer::Stats& dvr) { return dvr.bufferedSeconds; });
+    perDvr("sender_dvr_bytes", "gauge", "Bytes held by the DVR ring",
+           [](const DvrPlayer::Stats& dvr) { return double(dvr.bytesUsed); });
+    perDvr("sender_dvr_viewers", "gauge", "Viewers served from the DVR",
+           [](const DvrPlayer::Stats& dvr) { return double(dvr.viewers); });
+    perDvr("sender_dvr_caught_up_total", "counter", "Time-shifted viewers handed back to live",
+           [](const DvrPlayer::Stats& dvr) { return double(dvr.caughtUp); });
+
+    // Per channel and layer; each family is written once with all its samples.
+    auto perLayer = [&](const std::string& name, const std::string& help, const std::string& element,
+                        const char *property) {
+        bool started = false;
+        for (const auto& channel : channels) {
+            if (!channel->pipeline) {
+                continue;
+            }
+            std::vector<GstElement*> elements = find_layer_elements(channel->pipeline, element);
+            for (size_t layer = 0; layer < elements.size(); ++layer) {
+                if (!started) {
+                    text.family(name, "gauge", help);
+                    started = true;
+                }
+                guint value = 0;
+                g_object_get(elements[layer], property, &value, NULL);
+                text.sample(name, value, PrometheusText::label("channel", channel->name) + "," +
+                                         PrometheusText::label("layer", std::to_string(layer)));
+                gst_object_unref(elements[layer]);
+            }
+        }
+    };
+    perLayer("sender_encoder_bitrate_kbps", "Current x264enc bitrate", "encoder", "bitrate");
+    perLayer("sender_encoder_queue_buffers", "Raw frames queued in front of x264enc", "encqueue",
+             "current-level-buffers");
+
+    std::vector<std::pair<std::string, std::vector<ViewerQueueStats>>> queueStats;
+    std::vector<std::pair<std::string, std::vector<ViewerBandwidthStats>>> bandwidth;
+    for (const auto& channel : channels) {
+        std::string label = PrometheusText::label("channel", channel->name) + ",";
+        queueStats.emplace_back(label, channel->peers.getQueueStats());
+        bandwidth.emplace_back(label, channel->peers.getBandwidthStats());
+    }
+    auto perViewer = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        text.family(name, type, help);
+        for (const auto& [channelLabel, viewers] : queueStats) {
+            for (const ViewerQueueStats& stats : viewers) {
+                text.sample(name, value(stats), channelLabel + PrometheusText::label("viewer", stats.viewerId));
+            }
+        }
+    };
+    perViewer("sender_viewer_queue_depth", "gauge", "Packets waiting in the viewer's send queue",
+              [](const ViewerQueueStats& stats) { return double(stats.depth); });
+    perViewer("sender_viewer_sent_packets_total", "counter", "Packets sent to the viewer",
+              [](const ViewerQueueStats& stats) { return double(stats.sent); });
+    perViewer("sender_viewer_dropped_packets_total", "counter", "Packets dropped from the viewer's queue",
+              [](const ViewerQueueStats& stats) { return double(stats.dropped); });
+    perViewer("sender_viewer_send_errors_total", "counter", "Track::send failures for the viewer",
+              [](const ViewerQueueStats& stats) { return double(stats.sendErrors); });
+    perViewer("sender_viewer_send_seconds_total", "counter", "Time spent in Track::send for the viewer",
+              [](const ViewerQueueStats& stats) { return stats.sendSeconds; });
+
+    auto perEstimate = [&](const std::string& name, const char *type, const std::string& help, auto value) {
+        text.family(name, type, help);
+        for (const auto& [channelLabel, viewers] : bandwidth) {
+            for (const ViewerBandwidthStats& viewer : viewers) {
+                if (std::optional<double> sample = value(viewer)) {
+                    text.sample(name, *sample, channelLabel + PrometheusText::label("viewer", viewer.viewerId));
+                }
+            }
+        }
+    };
+    perEstimate("sender_viewer_estimate_kbps", "gauge", "Viewer bandwidth estimate",
+                [](const ViewerBandwidthStats& viewer) { return std::optional<double>(viewer.estimateKbps); });
+    perEstimate("sender_viewer_loss_ratio", "gauge", "Fraction lost in the viewer's latest receiver report",
+                [](const ViewerBandwidthStats& viewer) { return std::optional<double>(viewer.lossPercent / 100); });
+    perEstimate("sender_viewer_rtt_seconds", "gauge", "Round-trip time reported by the peer connection",
+                [](const ViewerBandwidthStats& viewer) {
+                    return viewer.rttMs >= 0 ? std::optional<double>(viewer.rttMs / 1000.0) : std::nullopt;
+                });
+    perEstimate("sender_viewer_bytes_sent_total", "counter", "Bytes sent by the viewer's peer connection",
+                [](const ViewerBandwidthStats& viewer) { return std::optional<double>(viewer.bytesSent); });
+    return text.str();
+}
+
+// ULPFEC in RED for a channel; see FecEncoder.
+struct FecSettings {
+    bool enabled = false;
+    unsigned percent = 0;   // fixed protection, or the starting point when adaptive
+    bool adaptive = false;  // follow the loss viewers report
+};
+
+// Source and encoding of one channel. The command line fills in one, which
+// is either the only channel or the defaults for a --channels file.
+struct ChannelConfig {
+    std::string name = "default";
+    std::string videoPath;
+    PipelineMode pipelineMode = PipelineMode::Auto;
+    std::string fileCachePath;
+    // Upstream signaling URL and channel when relaying another sender.
+    std::string relayUrl;
+    std::string relayChannel;
+    EncoderSettings encoder;
+    BitrateLimits bitrateLimits;
+    LifecycleConfig lifecycle;
+    FecSettings fec;
+    DvrConfig dvr;
+};
+
+struct SenderOptions {
+    std::string signalingUrl = "ws://localhost:8765";
+    ChannelConfig channel;
+    std::string channelsPath;
+    std::vector<ChannelConfig> channels;  // what to serve, filled in by parse_options
+    guint ingestBuffers = 64;
+    std::vector<std::string> iceServers{"stun:stun.l.google.com:19302"};
+    size_t poolSize = 8;
+    size_t signalingThreads = 4;
+    std::string metricsHost = "127.0.0.1";
+    uint16_t metricsPort = 0;  // 0 disables the endpoint
+    LogLevel logLevel = LogLevel::Info;
+    uint32_t logRate = 100;  // messages per second per category, 0 = unlimited
+    bool captureTime = true;
+    double abrPercentile = 0;  // negative disables adaptive bitrate
+    std::chrono::milliseconds keyframeRequestInterval{500};
+    FanoutConfig fanout;
+};
+
+static void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " <video_file_path> [signaling_url] [options]" << std::endl;
+    std::cerr << "       " << program << " --channels=FILE [signaling_url] [options]" << std::endl;
+    std::cerr << "       " << program << " --relay=UPSTREAM_URL [signaling_url] [options]" << std::endl;
+    std::cerr << "Example: " << program << " ../video.mp4 ws://localhost:8765" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --channels=FILE            serve every channel listed in a JSON file; the options below are" << std::endl;
+    std::cerr << "                             their defaults; --max-peers applies per channel" << std::endl;
+    std::cerr << "  --relay=WS_URL             re-serve the stream of another sender, joining its signaling" << std::endl;
+    std::cerr << "                             server as a viewer; nothing is decoded or encoded" << std::endl;
+    std::cerr << "  --relay-channel=NAME       upstream channel to relay (default: the upstream's default)" << std::endl;
+    std::cerr << "  --pin-workers=on|off       pin send workers to cores (default: on with --channels)" << std::endl;
+    std::cerr << "  --fanout-workers=N         send worker threads (default: CPU count)" << std::endl;
+    std::cerr << "  --queue-capacity=N         per-viewer send queue, in packets, 1-65536 (default: 4096)" << std::endl;
+    std::cerr << "  --overflow=drop|disconnect what to do with a viewer whose queue is full" << std::endl;
+    std::cerr << "  --gop-cache=N              packets of the last GOP burst to new viewers, 0 disables (default: 2048)" << std::endl;
+    std::cerr << "  --burst-rate=N             join burst pacing, in packets per ms (default: 2)" << std::endl;
+    std::cerr << "  --pipeline=auto|passthrough|transcode" << std::endl;
+    std::cerr << "                             skip decode/re-encode for browser-ready H.264 (default: auto)" << std::endl;
+    std::cerr << "  --file-cache=PATH          packetize the file once into PATH and loop it from an mmap" << std::endl;
+    std::cerr << "  --bitrate=KBPS             starting encoder bitrate when transcoding (default: 1000)" << std::endl;
+    std::cerr << "  --min-bitrate=KBPS         lower bound for adaptive bitrate (default: 150)" << std::endl;
+    std::cerr << "  --max-bitrate=KBPS         upper bound for adaptive bitrate (default: 2500)" << std::endl;
+    std::cerr << "  --abr=off|min|pN           follow the weakest viewer or the Nth percentile (default: min)" << std::endl;
+    std::cerr << "  --fec=off|auto|PERCENT     ULPFEC/RED once per stream: fixed FEC packets per 100 media packets," << std::endl;
+    std::cerr << "                             or auto to follow viewer loss; relays only forward it (default: off)" << std::endl;
+    std::cerr << "  --dvr=SECONDS              keep this much of the stream so viewers can join behind live (default: 0, off)" << std::endl;
+    std::cerr << "  --dvr-size=MB              DVR ring size per channel (default: 256)" << std::endl;
+    std::cerr << "  --dvr-spill=DIR            back the DVR ring with a file in DIR instead of anonymous memory" << std::endl;
+    std::cerr << "  --dvr-catchup=SPEED        playback speed of time-shifted viewers until they reach live," << std::endl;
+    std::cerr << "                             1 to stay behind, up to 4; viewers may ask for their own (default: 1)" << std::endl;
+    std::cerr << "  --ice-server=URL           STUN/TURN server, repeatable; 'none' for host candidates only" << std::endl;
+    std::cerr << "                             (default: stun:stun.l.google.com:19302)" << std::endl;
+    std::cerr << "  --pc-pool=N                peer connections kept pre-created with a gathered offer, shared by" << std::endl;
+    std::cerr << "                             the channels by recent joins (default: 8)" << std::endl;
+    std::cerr << "  --signaling-threads=N      threads handling signaling messages, serially per viewer (default: 4)" << std::endl;
+    std::cerr << "  --max-peers=N              viewers admitted at once, 0 for no limit (default: 0)" << std::endl;
+    std::cerr << "  --negotiation-timeout=S    drop viewers not connected after S seconds (default: 30)" << std::endl;
+    std::cerr << "  --disconnect-grace=S       drop disconnected viewers after S seconds (default: 10)" << std::endl;
+    std::cerr << "  --metrics=[HOST:]PORT      serve Prometheus metrics over HTTP (default host: 127.0.0.1)" << std::endl;
+    std::cerr << "  --log-level=debug|info|warn|error" << std::endl;
+    std::cerr << "                             least severe messages logged; debug adds signaling payloads (default: info)" << std::endl;
+    std::cerr << "  --capture-time=on|off      stamp abs-capture-time on live frames (default: on)" << std::endl;
+    std::cerr << "  --log-rate=N               messages per second per log category, 0 for no limit (default: 100)" << std::endl;
+    std::cerr << "  --ingest-buffers=N         appsink samples queued before the pipeline blocks (default: 64)" << std::endl;
+    std::cerr << "  --ladder=H:KBPS,...        simulcast ladder of output heights and bitrates, e.g. 360:400,720:1200" << std::endl;
+    std::cerr << "  --keyint=N                 frames between periodic keyframes when transcoding (default: x264's)" << std::endl;
+    std::cerr << "  --keyframe-request-interval=MS" << std::endl;
+    std::cerr << "                             minimum gap between keyframes forced by viewer PLI/FIR (default: 500)" << std::endl;
+}
+
+// "360:400,720:1200" -> rungs sorted by bitrate.
+static std::vector<LadderRung> parse_ladder(const std::string& value) {
+    std::vector<LadderRung> ladder;
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(',', start);
+        std::string rung = value.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        size_t colon = rung.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("Invalid --ladder rung, expected HEIGHT:KBPS: " + rung);
+        }
+        ladder.push_back({static_cast<guint>(std::stoul(rung.substr(0, colon))),
+                          static_cast<guint>(std::stoul(rung.substr(colon + 1)))});
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    std::sort(ladder.begin(), ladder.end(), [](const LadderRung& a, const LadderRung& b) {
+        return a.bitrateKbps < b.bitrateKbps;
+    });
+    return ladder;
+}
+
+static FecSettings parse_fec(const std::string& value) {
+    FecSettings fec;
+    if (value == "off") {
+        return fec;
+    }
+    fec.enabled = true;
+    if (value == "auto") {
+        fec.adaptive = true;
+        return fec;
+    }
+    size_t used = 0;
+    unsigned long percent = std::stoul(value, &used);
+    if (used != value.size() || percent > 100) {
+        throw std::runtime_error("Invalid --fec value, expected off, auto or 0-100: " + value);
+    }
+    fec.percent = static_cast<unsigned>(percent);
+    return fec;
+}
+
+static PipelineMode parse_pipeline_mode(const std::string& value) {
+    if (value == "auto") {
+        return PipelineMode::Auto;
+    } else if (value == "passthrough") {
+        return PipelineMode::Passthrough;
+    } else if (value == "transcode") {
+        return PipelineMode::Transcode;
+    }
+    throw std::runtime_error("Invalid --pipeline value: " + value);
+}
+
+// Checks a channel's settings and derives the encoder's.
+static void finish_channel(ChannelConfig& channel) {
+    const BitrateLimits& limits = channel.bitrateLimits;
+    if (limits.minKbps > limits.startKbps || limits.startKbps > limits.maxKbps) {
+        throw std::runtime_error("Bitrates must satisfy --min-bitrate <= --bitrate <= --max-bitrate");
+    }
+    channel.encoder.bitrateKbps = limits.startKbps;
+    if (!channel.relayUrl.empty() && (!channel.encoder.ladder.empty() || !channel.fileCachePath.empty())) {
+        throw std::runtime_error("--relay cannot be combined with --ladder or --file-cache");
+    }
+    if (!channel.encoder.ladder.empty()) {
+        if (!channel.fileCachePath.empty()) {
+            throw std::runtime_error("--ladder cannot be combined with --file-cache");
+        }
+        // Viewer estimates must be able to reach the top rung, with headroom.
+        guint top = channel.encoder.ladder.back().bitrateKbps;
+        channel.bitrateLimits.maxKbps = std::max<uint32_t>(channel.bitrateLimits.maxKbps, top * 115 / 100 + 1);
+    }
+    if (channel.dvr.window.count() > 0 && channel.dvr.bytes < (size_t(8) << 20)) {
+        throw std::runtime_error("--dvr-size must be at least 8 MB");
+    }
+    if (channel.dvr.catchUpSpeed < 1.0 || channel.dvr.catchUpSpeed > DvrPlayer::kMaxCatchUpSpeed) {
+        throw std::runtime_error("--dvr-catchup must be between 1 and 4");
+    }
+}
+
+// A --channels file:
+//   {"channels": [{"name": "news", "video": "news.mp4"},
+//                 {"name": "sports", "video": "sports.mp4", "ladder": "360:400,720:1200"}]}
+// Besides "name" and "video", an entry may set "pipeline", "file_cache",
+// "bitrate", "ladder", "keyint", "max_peers", "fec", "dvr" (seconds),
+// "dvr_size" (MB), "dvr_spill" and "dvr_catchup" (speed); anything it leaves
+// out comes from the command line. A relayed channel gives "relay" (and
+// optionally "relay_channel") instead of "video".
+static std::vector<ChannelConfig> load_channels(const std::string& path, const ChannelConfig& defaults) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Cannot open channel file: " + path);
+    }
+    json config = json::parse(file);
+    if (!config.contains("channels") || !config["channels"].is_array() || config["channels"].empty()) {
+        throw std::runtime_error("Channel file needs a non-empty \"channels\" array: " + path);
+    }
+    std::vector<ChannelConfig> channels;
+    std::set<std::string> names;
+    for (const json& entry : config["channels"]) {
+        ChannelConfig channel = defaults;
+        channel.name.clear();
+        try {
+            channel.name = entry.at("name").get<std::string>();
+            if (entry.contains("relay")) {
+                channel.relayUrl = entry["relay"].get<std::string>();
+                channel.relayChannel = entry.contains("relay_channel") ? entry["relay_channel"].get<std::string>()
+                                                                       : std::string();
+            } else {
+                channel.videoPath = entry.at("video").get<std::string>();
+            }
+            if (channel.name.empty() || !names.insert(channel.name).second) {
+                throw std::runtime_error("channel names must be unique and not empty");
+            }
+            if (entry.contains("pipeline")) {
+                channel.pipelineMode = parse_pipeline_mode(entry["pipeline"].get<std::string>());
+            }
+            if (entry.contains("file_cache")) {
+                channel.fileCachePath = entry["file_cache"].get<std::string>();
+            }
+            if (entry.contains("bitrate")) {
+                channel.bitrateLimits.startKbps = entry["bitrate"].get<uint32_t>();
+            }
+            if (entry.contains("ladder")) {
+                channel.encoder.ladder = parse_ladder(entry["ladder"].get<std::string>());
+            }
+            if (entry.contains("keyint")) {
+                channel.encoder.keyframeInterval = entry["keyint"].get<guint>();
+            }
+            if (entry.contains("max_peers")) {
+                channel.lifecycle.maxPeers = entry["max_peers"].get<size_t>();
+            }
+            if (entry.contains("fec")) {
+                const json& fec = entry["fec"];
+                channel.fec = parse_fec(fec.is_string() ? fec.get<std::string>() : std::to_string(fec.get<unsigned>()));
+            }
+            if (entry.contains("dvr")) {
+                channel.dvr.window = std::chrono::seconds(entry["dvr"].get<unsigned>());
+            }
+            if (entry.contains("dvr_size")) {
+                channel.dvr.bytes = entry["dvr_size"].get<size_t>() << 20;
+            }
+            if (entry.contains("dvr_spill")) {
+                channel.dvr.spillDir = entry["dvr_spill"].get<std::string>();
+            }
+            if (entry.contains("dvr_catchup")) {
+                channel.dvr.catchUpSpeed = entry["dvr_catchup"].get<double>();
+            }
+            finish_channel(channel);
+        } catch (const std::exception& e) {
+            std::string which = channel.name.empty() ? std::to_string(channels.size() + 1) : channel.name;
+            throw std::runtime_error("Channel " + which + " in " + path + ": " + e.what());
+        }
+        channels.push_back(std::move(channel));
+    }
+    return channels;
+}
+
+// Positional arguments keep their original meaning; everything else is
+// --name=value. Throws on unknown options or bad values.
+static SenderOptions parse_options(int argc, char *argv[]) {
+    SenderOptions options;
+    std::vector<std::string> positional;
+    bool iceServersGiven = false;
+    std::optional<bool> pinWorkers;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "fanout-workers") {
+            options.fanout.workerCount = std::stoul(value);
+        } else if (name == "queue-capacity") {
+            options.fanout.queueCapacity = std::stoul(value);
+            if (options.fanout.queueCapacity < 1 || options.fanout.queueCapacity > ViewerQueue::kMaxCapacity) {
+                throw std::runtime_error("--queue-capacity must be between 1 and " +
+                                         std::to_string(ViewerQueue::kMaxCapacity) + ": " + value);
+            }
+        } else if (name == "overflow") {
+            if (value == "drop") {
+                options.fanout.overflowPolicy = OverflowPolicy::DropToKeyframe;
+            } else if (value == "disconnect") {
+                options.fanout.overflowPolicy = OverflowPolicy::Disconnect;
+            } else {
+                throw std::runtime_error("Invalid --overflow value: " + value);
+            }
+        } else if (name == "gop-cache") {
+            options.fanout.gopCachePackets = std::stoul(value);
+        } else if (name == "burst-rate") {
+            options.fanout.burstPacketsPerMs = std::stod(value);
+        } else if (name == "pipeline") {
+            options.channel.pipelineMode = parse_pipeline_mode(value);
+        } else if (name == "channels") {
+            options.channelsPath = value;
+        } else if (name == "relay") {
+            options.channel.relayUrl = value;
+        } else if (name == "relay-channel") {
+            options.channel.relayChannel = value;
+        } else if (name == "pin-workers") {
+            if (value != "on" && value != "off") {
+                throw std::runtime_error("Invalid --pin-workers value: " + value);
+            }
+            pinWorkers = value == "on";
+        } else if (name == "file-cache") {
+            options.channel.fileCachePath = value;
+        } else if (name == "bitrate") {
+            options.channel.bitrateLimits.startKbps = std::stoul(value);
+        } else if (name == "min-bitrate") {
+            options.channel.bitrateLimits.minKbps = std::stoul(value);
+        } else if (name == "max-bitrate") {
+            options.channel.bitrateLimits.maxKbps = std::stoul(value);
+        } else if (name == "abr") {
+            if (value == "off") {
+                options.abrPercentile = -1;
+            } else if (value == "min") {
+                options.abrPercentile = 0;
+            } else if (value.size() > 1 && value[0] == 'p') {
+                options.abrPercentile = std::stod(value.substr(1));
+                if (options.abrPercentile < 0 || options.abrPercentile > 100) {
+                    throw std::runtime_error("Invalid --abr percentile: " + value);
+                }
+            } else {
+                throw std::runtime_error("Invalid --abr value: " + value);
+            }
+        } else if (name == "fec") {
+            options.channel.fec = parse_fec(value);
+        } else if (name == "dvr") {
+            options.channel.dvr.window = std::chrono::seconds(std::stoul(value));
+        } else if (name == "dvr-size") {
+            options.channel.dvr.bytes = std::stoul(value) << 20;
+        } else if (name == "dvr-spill") {
+            options.channel.dvr.spillDir = value;
+        } else if (name == "dvr-catchup") {
+            options.channel.dvr.catchUpSpeed = std::stod(value);
+        } else if (name == "ice-server") {
+            if (!iceServersGiven) {
+                options.iceServers.clear();
+                iceServersGiven = true;
+            }
+            if (value != "none") {
+                options.iceServers.push_back(value);
+            }
+        } else if (name == "pc-pool") {
+            options.poolSize = std::stoul(value);
+        } else if (name == "signaling-threads") {
+            options.signalingThreads = std::stoul(value);
+        } else if (name == "max-peers") {
+            options.channel.lifecycle.maxPeers = std::stoul(value);
+        } else if (name == "negotiation-timeout") {
+            options.channel.lifecycle.negotiationTimeout = std::chrono::seconds(std::stoul(value));
+        } else if (name == "disconnect-grace") {
+            options.channel.lifecycle.disconnectGrace = std::chrono::seconds(std::stoul(value));
+        } else if (name == "metrics") {
+            size_t colon = value.rfind(':');
+            if (colon != std::string::npos) {
+                options.metricsHost = value.substr(0, colon);
+            }
+            options.metricsPort = static_cast<uint16_t>(std::stoul(value.substr(colon == std::string::npos ? 0 : colon + 1)));
+        } else if (name == "log-level") {
+            if (value == "debug") {
+                options.logLevel = LogLevel::Debug;
+            } else if (value == "info") {
+                options.logLevel = LogLevel::Info;
+            } else if (value == "warn") {
+                options.logLevel = LogLevel::Warn;
+            } else if (value == "error") {
+                options.logLevel = LogLevel::Error;
+            } else {
+                throw std::runtime_error("Invalid --log-level value: " + value);
+            }
+        } else if (name == "capture-time") {
+            if (value != "on" && value != "off") {
+                throw std::runtime_error("Invalid --capture-time value: " + value);
+            }
+            options.captureTime = value == "on";
+        } else if (name == "log-rate") {
+            options.logRate = std::stoul(value);
+        } else if (name == "ingest-buffers") {
+            options.ingestBuffers = std::stoul(value);
+        } else if (name == "ladder") {
+            options.channel.encoder.ladder = parse_ladder(value);
+        } else if (name == "keyint") {
+            options.channel.encoder.keyframeInterval = std::stoul(value);
+        } else if (name == "keyframe-request-interval") {
+            options.keyframeRequestInterval = std::chrono::milliseconds(std::stoul(value));
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+
+    // Many channels share the send workers; keep each on its own core.
+    options.fanout.pinWorkers = pinWorkers.value_or(!options.channelsPath.empty());
+    if (!options.channelsPath.empty()) {
+        if (positional.size() > 1) {
+            throw std::runtime_error("With --channels the only positional argument is the signaling URL");
+        }
+        if (!positional.empty()) {
+            options.signalingUrl = positional[0];
+        }
+        options.channels = load_channels(options.channelsPath, options.channel);
+        return options;
+    }
+
+    if (!options.channel.relayUrl.empty()) {
+        if (positional.size() > 1) {
+            throw std::runtime_error("With --relay the only positional argument is the signaling URL");
+        }
+        if (!positional.empty()) {
+            options.signalingUrl = positional[0];
+        }
+    } else {
+        if (positional.empty()) {
+            throw std::runtime_error("Missing video file path");
+        }
+        options.channel.videoPath = positional[0];
+        if (positional.size() > 1) {
+            options.signalingUrl = positional[1];
+        }
+    }
+    finish_channel(options.channel);
+    options.channels.push_back(options.channel);
+    return options;
+}
+
+// Starts the channel's source: an upstream sender, the looping file cache,
+// or the GStreamer pipeline with its ingest threads and encoder control.
+static void start_channel(Channel& channel, const ChannelConfig& config, const SenderOptions& options) {
+    const std::string& video_path = config.videoPath;
+    Channel *target = &channel;
+    if (!config.relayUrl.empty()) {
+        // Packets go out as received; keyframes come from the origin's encoder
+        channel.relay = std::make_shared<RelaySource>(
+            RelaySource::Config{config.relayUrl, config.relayChannel, options.iceServers},
+            [target](const std::vector<RtpPacketRef>& frame) {
+                ingest_frame(*target, frame, 0);
+            });
+        std::weak_ptr<RelaySource> relay = channel.relay;
+        channel.peers.setKeyframeRequestHandler([relay]() {
+            if (auto source = relay.lock()) {
+                source->requestKeyframe();
+            }
+        }, options.keyframeRequestInterval);
+        log_info(pipelineLog, {{"channel", channel.name}, {"upstream", config.relayUrl}}, "Relaying upstream sender");
+        channel.relay->start();
+        return;
+    }
+    if (config.fec.adaptive) {
+        g_timeout_add_seconds(1, update_fec, &channel);
+    }
+    if (!config.fileCachePath.empty()) {
+        // Looping VOD straight from the pre-packetized cache, no encoder
+        if (!RtpFileCache::isFresh(config.fileCachePath, video_path)) {
+            build_rtp_file_cache(video_path, config.pipelineMode, config.encoder, config.fileCachePath);
+        }
+        channel.fileCache.open(config.fileCachePath);
+        log_info(pipelineLog, {{"channel", channel.name}, {"cache", config.fileCachePath}}, "Playing RTP file cache: ",
+                 channel.fileCache.info().packetCount, " packets, ", channel.fileCache.info().frameCount, " frames");
+        channel.cachePlayer = std::make_unique<RtpCachePlayer>(channel.fileCache,
+                                                               [target](const std::vector<RtpPacketRef>& frame) {
+            ingest_frame(*target, frame, 0);
+        });
+        channel.cachePlayer->start();
+        return;
+    }
+
+    // Setup GStreamer pipeline
+    channel.pipeline = setup_gstreamer_pipeline(video_path, config.pipelineMode, config.encoder);
+    enable_keyframe_requests(channel, options.keyframeRequestInterval);
+    if (!config.encoder.ladder.empty()) {
+        g_timeout_add_seconds(1, select_layers, &channel);
+    } else if (options.abrPercentile >= 0) {
+        enable_adaptive_bitrate(channel, config.bitrateLimits, options.abrPercentile);
+    }
+
+    // Start GStreamer pipeline
+    GstStateChangeReturn ret = gst_element_set_state(channel.pipeline, GST_STATE_PLAYING);
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+        throw std::runtime_error("Failed to start GStreamer pipeline for channel " + channel.name);
+    }
+    // Appsinks only hand out samples once started
+    start_ingest(channel, options.ingestBuffers);
+}
+
+static void stop_channel(Channel& channel, std::chrono::milliseconds keyframe_request_interval) {
+    if (channel.relay) {
+        channel.peers.setKeyframeRequestHandler(nullptr, keyframe_request_interval);
+        channel.relay->stop();
+    }
+    if (channel.cachePlayer) {
+        channel.cachePlayer->stop();
+    }
+    if (channel.pipeline) {
+        channel.peers.setKeyframeRequestHandler(nullptr, keyframe_request_interval);
+        if (channel.adaptiveBitrate) {
+            gst_object_unref(channel.adaptiveBitrate->encoder);
+            channel.adaptiveBitrate.reset();
+        }
+        // Flushing the appsinks ends the reader threads
+        gst_element_set_state(channel.pipeline, GST_STATE_NULL);
+        for (std::thread& reader : channel.ingestReaders) {
+            reader.join();
+        }
+        channel.ingestReaders.clear();
+        gst_object_unref(channel.pipeline);
+        channel.pipeline = nullptr;
+    }
 }
 
 int main(int argc, char *argv[]) {
     try {
-        if (argc < 2) {
-            std::cerr << "Usage: " << argv[0] << " <video_file_path> [signaling_url]" << std::endl;
-            std::cerr << "Example: " << argv[0] << " ../video.mp4 ws://localhost:8765" << std::endl;
+        // Initialize libraries; gst_init strips its own --gst-* options
+        gst_init(&argc, &argv);
+
+        SenderOptions options;
+        try {
+            options = parse_options(argc, argv);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            print_usage(argv[0]);
             return 1;
         }
+        Logger::instance().setLevel(options.logLevel);
+        Logger::instance().setRateLimit(options.logRate);
+        // libdatachannel's own messages go through the same writer
+        rtc::InitLogger(options.logLevel == LogLevel::Debug ? rtc::LogLevel::Debug : rtc::LogLevel::Info,
+                        [](rtc::LogLevel level, std::string message) {
+            static LogCategory rtcLog("rtc");
+            LogLevel mapped = level <= rtc::LogLevel::Error ? LogLevel::Error
+                            : level == rtc::LogLevel::Warning ? LogLevel::Warn
+                            : level == rtc::LogLevel::Info ? LogLevel::Info : LogLevel::Debug;
+            Logger::instance().log(mapped, rtcLog, {}, message);
+        });
         
-        std::string video_path = argv[1];
-        std::string signaling_url = (argc > 2) ? argv[2] : "ws://localhost:8765";
-        
-        // Initialize libraries
-        gst_init(&argc, &argv);
-        rtc::InitLogger(rtc::LogLevel::Info);
+        const std::string& signaling_url = options.signalingUrl;
+
+        stampCaptureTime = options.captureTime;
+        fanoutEngine = std::make_shared<FanoutEngine>();
+        fanoutEngine->start(options.fanout);
+        for (const ChannelConfig& config : options.channels) {
+            auto channel = std::make_unique<Channel>();
+            channel->name = config.name;
+            channel->peers.setBitrateLimits(config.bitrateLimits);
+            std::vector<uint32_t> layerBitrates;
+            for (const LadderRung& rung : config.encoder.ladder) {
+                layerBitrates.push_back(rung.bitrateKbps);
+            }
+            channel->peers.setLayers(layerBitrates);
+            channel->peers.useFanout(fanoutEngine);
+            channel->peers.startLifecycle(config.lifecycle);
+            channel->peers.setIceServers(options.iceServers);
+            channel->peers.offerCaptureTime(options.captureTime);
+            channel->peers.offerFec(config.fec.enabled);
+            if (config.fec.enabled && config.relayUrl.empty()) {
+                for (size_t layer = 0; layer < channel->peers.getLayerCount(); ++layer) {
+                    channel->fec.push_back(std::make_unique<FecEncoder>());
+                    channel->fec.back()->setProtection(config.fec.percent);
+                }
+            }
+            if (config.dvr.window.count() > 0) {
+                channel->peers.enableDvr(config.dvr);
+                log_info(pipelineLog, {{"channel", channel->name}}, "DVR keeps up to ", config.dvr.window.count(),
+                         " s in ", config.dvr.bytes >> 20, " MB",
+                         config.dvr.spillDir.empty() ? "" : " spilled to " + config.dvr.spillDir);
+            }
+            if (options.poolSize > 0) {
+                channel->peers.startPool(0);  // sized by rebalance_pools
+            }
+            channels.push_back(std::move(channel));
+        }
+        rebalance_pools(options.poolSize);
         
         // Start signaling
-        std::cout << "Connecting to signaling server at " << signaling_url << std::endl;
-        start_signaling(signaling_url);
+        log_info(signalingLog, {{"url", signaling_url}}, "Connecting to signaling server");
+        start_signaling(signaling_url, options.signalingThreads);
         
         // Give some time for WebSocket connection to establish
         std::this_thread::sleep_for(std::chrono::seconds(1));
         
         if (!ws_connected) {
-            std::cerr << "Warning: WebSocket connection not established yet. Continuing anyway..." << std::endl;
+            log_warn(signalingLog, {}, "WebSocket connection not established yet. Continuing anyway...");
         }
         
-        // Setup GStreamer pipeline
-        GstElement *pipeline = setup_gstreamer_pipeline(video_path);
+        for (size_t i = 0; i < channels.size(); ++i) {
+            start_channel(*channels[i], options.channels[i], options);
+        }
         
-        // Start GStreamer pipeline
-        GstStateChangeReturn ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
-        if (ret == GST_STATE_CHANGE_FAILURE) {
-            throw std::runtime_error("Failed to start GStreamer pipeline");
+        metrics::MetricsServer metricsServer;
+        if (options.metricsPort != 0) {
+            metricsServer.start(options.metricsHost, options.metricsPort, render_metrics);
+            log_info(senderLog, {}, "Serving metrics on http://", options.metricsHost, ":", options.metricsPort,
+                     "/metrics");
         }
         
-        std::cout << "Streaming started. Press Ctrl+C to stop." << std::endl;
+        log_info(senderLog, {}, "Streaming ", channels.size(), channels.size() == 1 ? " channel" : " channels",
+                 ". Press Ctrl+C to stop.");
         
         // Run main loop
         GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+        g_timeout_add_seconds(5, report_stats, nullptr);
+        if (channels.size() > 1 && options.poolSize > 0) {
+            g_timeout_add_seconds(5, rebalance_pools_tick, &options.poolSize);
+        }
         
         g_main_loop_run(loop);
         
         // Cleanup
-        std::cout << "Cleaning up resources..." << std::endl;
-        gst_element_set_state(pipeline, GST_STATE_NULL);
-        gst_object_unref(pipeline);
+        log_info(senderLog, {}, "Cleaning up resources...");
+        metricsServer.stop();
+        for (const auto& channel : channels) {
+            stop_channel(*channel, options.keyframeRequestInterval);
+        }
         g_main_loop_unref(loop);
         
         // Close all peer connections
-        peerConnectionManager.closeAll();
-        
-        if (ws_connected) {
-            websocketpp::lib::error_code ec;
-            client.close(ws_hdl, websocketpp::close::status::normal, "Finished streaming", ec);
+        stop_signaling();
+        for (const auto& channel : channels) {
+            channel->peers.stopDvr();
+            channel->peers.stopLifecycle();
+            channel->peers.stopPool();
+            channel->peers.closeAll();
         }
+        fanoutEngine->stop();
         
     } catch (const std::exception &e) {
-        std::cerr << "Fatal error: " << e.what() << std::endl;
+        log_error(senderLog, {}, "Fatal error: ", e.what());
+        Logger::instance().stop();
         return 1;
     }
     
-    std::cout << "Clean shutdown completed" << std::endl;
+    log_info(senderLog, {}, "Clean shutdown completed");
+    Logger::instance().stop();
     return 0;
 }
\ No newline at end of file
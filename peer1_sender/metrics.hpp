@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "latency_stats.hpp"
+#include "logger.hpp"
+
+inline LogCategory metricsLog("metrics");
+
+namespace metrics {
+
+// Each thread writes to its own shard, on its own cache line; readers sum
+// all shards. Threads beyond kShards share, which only costs contention.
+constexpr size_t kShards = 32;
+
+inline size_t shardIndex() {
+    static std::atomic<size_t> nextShard{0};
+    thread_local size_t index = nextShard.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return index;
+}
+
+// Monotonic counter, cheap enough for per-packet use.
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Shard& shard : shards) {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Shard, kShards> shards;
+};
+
+// Fixed-bucket histogram, sharded like Counter. `upperBounds` ascending;
+// values above the last bound land in +Inf.
+class Histogram {
+public:
+    struct Snapshot {
+        std::vector<double> upperBounds;
+        std::vector<uint64_t> cumulative;  // one per bound, then +Inf
+        double sum;
+    };
+
+    explicit Histogram(std::vector<double> upperBounds) : bounds(std::move(upperBounds)) {
+        for (Shard& shard : shards) {
+            shard.buckets.reset(new std::atomic<uint64_t>[bounds.size() + 1]());
+        }
+    }
+
+    // Records `count` observations of `value`.
+    void observe(double value, uint64_t count = 1) {
+        size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        Shard& shard = shards[shardIndex()];
+        shard.buckets[bucket].fetch_add(count, std::memory_order_relaxed);
+        double sum = shard.sum.load(std::memory_order_relaxed);
+        while (!shard.sum.compare_exchange_weak(sum, sum + value * count, std::memory_order_relaxed)) {
+        }
+    }
+
+    Snapshot snapshot() const {
+        Snapshot snapshot{bounds, std::vector<uint64_t>(bounds.size() + 1, 0), 0};
+        for (const Shard& shard : shards) {
+            for (size_t i = 0; i <= bounds.size(); ++i) {
+                snapshot.cumulative[i] += shard.buckets[i].load(std::memory_order_relaxed);
+            }
+            snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 1; i < snapshot.cumulative.size(); ++i) {
+            snapshot.cumulative[i] += snapshot.cumulative[i - 1];
+        }
+        return snapshot;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+        std::atomic<double> sum{0};
+    };
+    std::vector<double> bounds;
+    std::array<Shard, kShards> shards;
+};
+
+// Builds a Prometheus text exposition (format 0.0.4).
+class PrometheusText {
+public:
+    // Starts a family; its samples follow with sample().
+    void family(const std::string& name, const char *type, const std::string& help) {
+        out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    }
+
+    void sample(const std::string& name, double value, const std::string& labels = std::string()) {
+        char number[32];
+        std::snprintf(number, sizeof(number), "%.17g", value);
+        out += name;
+        if (!labels.empty()) {
+            out += "{" + labels + "}";
+        }
+        out += " ";
+        out += number;
+        out += "\n";
+    }
+
+    void counter(const std::string& name, const std::string& help, double value) {
+        family(name, "counter", help);
+        sample(name, value);
+    }
+
+    void gauge(const std::string& name, const std::string& help, double value) {
+        family(name, "gauge", help);
+        sample(name, value);
+    }
+
+    void histogram(const std::string& name, const std::string& help, const Histogram& histogram) {
+        Histogram::Snapshot snapshot = histogram.snapshot();
+        family(name, "histogram", help);
+        for (size_t i = 0; i < snapshot.upperBounds.size(); ++i) {
+            char bound[32];
+            std::snprintf(bound, sizeof(bound), "%g", snapshot.upperBounds[i]);
+            sample(name + "_bucket", snapshot.cumulative[i], label("le", bound));
+        }
+        sample(name + "_bucket", snapshot.cumulative.back(), label("le", "+Inf"));
+        sample(name + "_sum", snapshot.sum);
+        sample(name + "_count", snapshot.cumulative.back());
+    }
+
+    // A LatencyStats summary, in seconds: quantiles over its recent window,
+    // `_sum` and `_count` over every sample since start.
+    void latency(const std::string& name, const std::string& help, const LatencyStats::Summary& summary) {
+        family(name, "summary", help);
+        sample(name, summary.p50Ms / 1000, label("quantile", "0.5"));
+        sample(name, summary.p99Ms / 1000, label("quantile", "0.99"));
+        sample(name, summary.maxMs / 1000, label("quantile", "1"));
+        sample(name + "_sum", summary.sumMs / 1000);
+        sample(name + "_count", summary.count);
+    }
+
+    static std::string label(const std::string& key, const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped += c;
+            }
+        }
+        return key + "=\"" + escaped + "\"";
+    }
+
+    const std::string& str() const { return out; }
+
+private:
+    std::string out;
+};
+
+// Minimal HTTP/1.0 server for scrapes: one connection at a time on its own
+// thread, any GET answered with `render()`.
+class MetricsServer {
+public:
+    using Render = std::function<std::string()>;
+
+    MetricsServer() {}
+    ~MetricsServer() { stop(); }
+
+    void start(const std::string& host, uint16_t port, Render renderMetrics) {
+        stop();
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+            throw std::runtime_error("Invalid metrics address: " + host);
+        }
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            throw std::runtime_error("Failed to create metrics socket");
+        }
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, 8) != 0) {
+            ::close(listenFd);
+            listenFd = -1;
+            throw std::runtime_error("Failed to listen for metrics on " + host + ":" + std::to_string(port));
+        }
+        render = std::move(renderMetrics);
+        stopping = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            listenFd = -1;
+        }
+    }
+
+private:
+    void run() {
+        while (!stopping) {
+            pollfd listening{listenFd, POLLIN, 0};
+            if (poll(&listening, 1, 200) <= 0) {
+                continue;
+            }
+            int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve(client);
+                ::close(client);
+            }
+        }
+    }
+
+    void serve(int client) {
+        // The request line is all we need; give up on slow clients.
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            pollfd readable{client, POLLIN, 0};
+            if (poll(&readable, 1, 1000) <= 0) {
+                return;
+            }
+            ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                return;
+            }
+            request.append(buffer, received);
+        }
+
+        std::string status = "200 OK";
+        std::string body;
+        if (request.compare(0, 4, "GET ") != 0) {
+            status = "405 Method Not Allowed";
+        } else {
+            try {
+                body = render();
+            } catch (const std::exception& e) {
+                status = "500 Internal Server Error";
+                log_error(metricsLog, {}, "Error rendering metrics: ", e.what());
+            }
+        }
+        std::string response = "HTTP/1.0 " + status + "\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        size_t offset = 0;
+        while (offset < response.size()) {
+            ssize_t sent = send(client, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return;
+            }
+            offset += sent;
+        }
+    }
+
+    int listenFd = -1;
+    Render render;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
+
+}  // namespace metrics
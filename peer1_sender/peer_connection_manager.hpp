@@ -0,0 +1,711 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "bandwidth_estimator.hpp"
+#include "dvr_buffer.hpp"
+#include "fanout_engine.hpp"
+#include "gop_cache.hpp"
+#include "logger.hpp"
+#include "peer_connection_pool.hpp"
+#include "peer_lifecycle.hpp"
+#include "rcu_snapshot.hpp"
+#include "rtcp_feedback.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory peerLog("peer");
+
+class PeerConnectionManager {
+public:
+    struct PeerInfo {
+        std::shared_ptr<rtc::PeerConnection> pc;
+        std::shared_ptr<rtc::Track> videoTrack;
+        std::shared_ptr<ViewerQueue> queue;
+        std::shared_ptr<RtcpFeedbackHandler> feedback;
+        std::string viewerId;
+        std::string sessionId;
+        // Taken from the pool: the offer is already in pc->localDescription()
+        // with every candidate, rather than still to be created.
+        bool prewarmed = false;
+        std::atomic<bool> trackOpen{false};
+        std::atomic<bool> connected{false};
+        PeerLifecycle lifecycle;
+        // Cleared by the streaming thread once the GOP burst is queued.
+        std::atomic<bool> joinPending{true};
+        // Simulcast: the layer being sent and the one to switch to at its
+        // next keyframe. producerMutex keeps two layers' streaming threads
+        // from pushing to `queue` at once.
+        std::atomic<size_t> layer{0};
+        std::atomic<size_t> targetLayer{0};
+        std::mutex producerMutex;
+        // Time shift: the first DVR frame this viewer gets live, kOnDvr
+        // while the DVR player is feeding it, 0 for viewers that join live.
+        std::atomic<uint64_t> liveFrom{0};
+    };
+
+    static constexpr uint64_t kOnDvr = UINT64_MAX;
+
+    // Flat list of peers that can receive media right now. Rebuilt by the
+    // signaling side on open/close/state changes and read by the streaming
+    // thread once per packet.
+    struct SendList {
+        struct Target {
+            ViewerQueue *queue;
+            PeerInfo *peer;
+        };
+        std::vector<Target> targets;
+        std::vector<std::shared_ptr<PeerInfo>> owners;
+    };
+
+    PeerConnectionManager() {}
+
+    // STUN/TURN URLs for every new connection. Empty keeps ICE to host
+    // candidates, for fully local setups. Call before the pool starts.
+    void setIceServers(const std::vector<std::string>& urls) {
+        iceServers = urls;
+    }
+
+    // Offer the abs-capture-time header extension the ingest path stamps on
+    // packets. Call before the pool starts.
+    void offerCaptureTime(bool enabled) {
+        captureTime = enabled;
+    }
+
+    // Offer RED and ULPFEC besides plain H.264, for streams that go through
+    // a FecEncoder (or relay one). Viewers that only accept H.264 get the
+    // media unwrapped and no FEC. Call before the pool starts.
+    void offerFec(bool enabled) {
+        fec = enabled;
+    }
+
+    // Keep `size` connections pre-created and gathered; 0 keeps none until
+    // resizePool() asks for some.
+    void startPool(size_t size) {
+        pool.start(size, [this]() { return makeConnection(); });
+    }
+
+    void resizePool(size_t size) {
+        pool.resize(size);
+    }
+
+    void stopPool() {
+        pool.stop();
+    }
+
+    // Simulcast ladder, lowest bitrate first; one entry (the default) means
+    // a single stream. Call before useFanout.
+    void setLayers(const std::vector<uint32_t>& bitratesKbps) {
+        layerBitrates = bitratesKbps.empty() ? std::vector<uint32_t>{bitrateLimits.startKbps} : bitratesKbps;
+        layers = std::vector<LayerState>(layerBitrates.size());
+        initialLayer = selectLayer(bitrateLimits.startKbps, 0);
+    }
+
+    size_t getLayerCount() const { return layerBitrates.size(); }
+
+    // Sends through `engine`, which other managers may share and which the
+    // caller starts and stops. Call before the first viewer joins.
+    void useFanout(std::shared_ptr<FanoutEngine> engine) {
+        fanout = std::move(engine);
+        const FanoutConfig& config = fanout->getConfig();
+        // Leave room in the viewer queue for live packets behind the burst.
+        for (LayerState& state : layers) {
+            state.gopCache.setMaxPackets(std::min(config.gopCachePackets, config.queueCapacity / 2));
+        }
+    }
+
+    // Keep the recent frames of the starting layer, so viewers can join
+    // behind live; see DvrPlayer. Call after useFanout, before the first
+    // viewer joins.
+    void enableDvr(const DvrConfig& config) {
+        dvr = std::make_unique<DvrPlayer>(config, *fanout);
+        dvr->start();
+    }
+
+    void stopDvr() {
+        if (dvr) {
+            dvr->stop();
+        }
+    }
+
+    bool hasDvr() const { return dvr != nullptr; }
+
+    // Only with hasDvr().
+    DvrPlayer::Stats getDvrStats() { return dvr->stats(); }
+
+    // Evicts dead peers and caps admissions; see LifecycleConfig.
+    void startLifecycle(const LifecycleConfig& config) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            lifecycleConfig = config;
+        }
+        reaper.start(std::chrono::seconds(1), [this]() { reapPeers(); });
+    }
+
+    void stopLifecycle() {
+        reaper.stop();
+    }
+
+    // `forceKeyUnit` is called on an RTCP thread when a viewer sends PLI or
+    // FIR, at most once per `minInterval` across all viewers.
+    void setKeyframeRequestHandler(std::function<void()> forceKeyUnit, std::chrono::milliseconds minInterval) {
+        keyframeRequester.configure(std::move(forceKeyUnit), minInterval);
+    }
+
+    // Bounds and starting point of every new viewer's bandwidth estimate.
+    // Set before the first viewer connects.
+    void setBitrateLimits(const BitrateLimits& limits) {
+        bitrateLimits = limits;
+    }
+
+    // Returns nullptr when the peer cap is reached. Replacing a viewer's own
+    // connection is always allowed. A `shift` with a delay starts the viewer
+    // from the DVR, when there is one.
+    std::shared_ptr<PeerInfo> createPeerConnection(const std::string& viewerId, const std::string& sessionId,
+                                                   const TimeShift& shift = {}) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (lifecycleConfig.maxPeers > 0 && connections.count(viewerId) == 0 &&
+                connections.size() + admitting >= lifecycleConfig.maxPeers) {
+                rejectedPeers.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            ++admitting;
+        }
+
+        auto peerInfo = std::make_shared<PeerInfo>();
+        peerInfo->viewerId = viewerId;
+        peerInfo->sessionId = sessionId;
+
+        std::optional<PeerConnectionPool::Warm> warm = pool.take();
+        peerInfo->prewarmed = warm.has_value();
+        if (!warm) {
+            try {
+                warm = makeConnection();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                --admitting;
+                throw;
+            }
+        }
+        peerInfo->pc = std::move(warm->pc);
+        peerInfo->videoTrack = std::move(warm->track);
+        // Layers are numbered independently and the DVR's copies continue
+        // into live; in either case the viewer gets its own sequence. So does
+        // one whose answer turns out to leave out RED (see onOpen); with FEC
+        // alone, the rest share the encoder's numbering and packets.
+        const bool shifted = dvr && shift.delay.count() > 0;
+        const bool renumbered = rewritesSequences() || shifted;
+        peerInfo->queue = fanout->attach(viewerId, peerInfo->videoTrack, renumbered,
+                                         [this](const std::shared_ptr<ViewerQueue>& queue) { evictPeer(queue); });
+        peerInfo->layer = initialLayer;
+        peerInfo->targetLayer = initialLayer;
+        if (shifted) {
+            peerInfo->liveFrom = kOnDvr;
+        }
+        std::weak_ptr<ViewerQueue> weakQueue = peerInfo->queue;
+        auto lookup = [this, weakQueue](uint32_t ssrc, uint16_t sequence) {
+            RtpPacketRef packet;
+            auto queue = weakQueue.lock();
+            if (queue && queue->rewritesSequences()) {
+                packet = queue->resendCopy(sequence);
+            } else {
+                packet = retransmissions.find(ssrc, sequence);
+            }
+            (packet ? nackHits : nackMisses).fetch_add(1, std::memory_order_relaxed);
+            return packet;
+        };
+        peerInfo->feedback = std::make_shared<RtcpFeedbackHandler>(lookup, keyframeRequester, bitrateLimits);
+        peerInfo->videoTrack->setMediaHandler(peerInfo->feedback);
+
+        std::weak_ptr<PeerInfo> weakInfo = peerInfo;
+
+        peerInfo->videoTrack->onOpen([this, weakInfo]() {
+            if (auto shared = weakInfo.lock()) {
+                if (fec && !acceptsRed(*shared->pc)) {
+                    shared->queue->sendWithoutRed();
+                    log_info(peerLog, {{"viewer", shared->viewerId}}, "Viewer did not accept RED, sending without FEC");
+                }
+                shared->trackOpen = true;
+                log_info(peerLog, {{"viewer", shared->viewerId}}, "Video track is now open");
+                republish();
+            }
+        });
+
+        peerInfo->videoTrack->onClosed([this, weakInfo]() {
+            if (auto shared = weakInfo.lock()) {
+                shared->trackOpen = false;
+                log_info(peerLog, {{"viewer", shared->viewerId}}, "Video track is now closed");
+                republish();
+            }
+        });
+
+        // A replaced peer is closed after the lock is released: close() can
+        // fire track callbacks, which republish under `mutex`.
+        std::shared_ptr<PeerInfo> replaced;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = connections.find(viewerId);
+            if (it != connections.end()) {
+                replaced = std::move(it->second);
+            }
+            connections[viewerId] = peerInfo;
+            --admitting;
+            publishLocked();
+        }
+        if (replaced) {
+            fanout->detach(replaced->queue);
+            if (replaced->pc) {
+                replaced->pc->close();
+            }
+        }
+
+        if (shifted) {
+            dvr->addViewer(peerInfo->queue, shift,
+                [weakInfo]() {
+                    auto shared = weakInfo.lock();
+                    return shared && shared->trackOpen && shared->connected;
+                },
+                [weakInfo](uint64_t liveFrom, bool caughtUp) {
+                    if (auto shared = weakInfo.lock()) {
+                        // Without a start in the DVR the viewer joins live
+                        // as any other, GOP burst included.
+                        if (caughtUp) {
+                            shared->joinPending.store(false, std::memory_order_relaxed);
+                        }
+                        shared->liveFrom.store(liveFrom, std::memory_order_release);
+                    }
+                });
+        }
+        return peerInfo;
+    }
+
+    std::shared_ptr<PeerInfo> getPeerInfo(const std::string& viewerId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = connections.find(viewerId);
+        if (it != connections.end()) {
+            return it->second;
+        }
+        return nullptr;
+    }
+
+    // Called from the PeerConnection state callback; the hot path only sees
+    // the result through the published SendList.
+    // Failed and closed peers are handed to the reaper rather than closed
+    // here, on libdatachannel's own thread.
+    void updatePeerState(const std::shared_ptr<PeerInfo>& peerInfo, rtc::PeerConnection::State state) {
+        peerInfo->lifecycle.onState(state);
+        bool connected = state == rtc::PeerConnection::State::Connected;
+        if (peerInfo->connected.exchange(connected) != connected) {
+            republish();
+        }
+        if (state == rtc::PeerConnection::State::Failed || state == rtc::PeerConnection::State::Closed) {
+            reaper.wake();
+        }
+    }
+
+    void removePeerConnection(const std::string& viewerId) {
+        std::shared_ptr<PeerInfo> removed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = connections.find(viewerId);
+            if (it == connections.end()) {
+                return;
+            }
+            removed = std::move(it->second);
+            connections.erase(it);
+            publishLocked();
+        }
+        fanout->detach(removed->queue);
+        if (removed->pc) {
+            removed->pc->close();
+        }
+        log_info(peerLog, {{"viewer", viewerId}}, "Removed peer connection");
+    }
+
+    // `frame` holds the packets of one access unit, shared by every viewer;
+    // each viewer's queue takes a reference and a fan-out worker does the
+    // actual Track::send. The send list is read and each worker woken once
+    // per frame. Runs on the streaming thread without taking `mutex`.
+    // A viewer seen here for the first time gets the cached GOP (which ends
+    // with `frame`) instead, so it can decode a picture immediately.
+    // With a simulcast ladder each layer has its own streaming thread; a
+    // viewer moves to its target layer at the start of that layer's next
+    // keyframe. The DVR records the starting layer, and viewers it feeds
+    // get nothing here until they catch up.
+    void sendFrameToAll(const std::vector<RtpPacketRef>& frame, size_t layer = 0) {
+        if (frame.empty()) {
+            return;
+        }
+        LayerState& state = layers[layer];
+        const bool simulcast = layers.size() > 1;
+        std::optional<uint64_t> dvrFrame;
+        if (dvr && layer == initialLayer) {
+            dvrFrame = dvr->append(frame);
+        }
+        state.keyframeStarts.clear();
+        for (const RtpPacketRef& packet : frame) {
+            bool keyframeStart = rtp::isH264KeyframeStart(packet->data(), packet->size());
+            state.keyframeStarts.push_back(keyframeStart);
+            state.gopCache.add(packet, keyframeStart);
+            if (!rewritesSequences()) {
+                retransmissions.store(packet);
+            }
+        }
+        auto sendList = sendable.read();
+        for (const SendList::Target& target : sendList->targets) {
+            PeerInfo& peer = *target.peer;
+            if (!takesLive(peer, dvrFrame)) {
+                continue;
+            }
+            if (!simulcast) {
+                deliver(peer, *target.queue, state, frame);
+                continue;
+            }
+            bool switching = state.keyframeStarts.front() &&
+                             peer.targetLayer.load(std::memory_order_relaxed) == layer;
+            if (peer.layer.load(std::memory_order_relaxed) != layer && !switching) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(peer.producerMutex);
+            if (peer.layer.load(std::memory_order_relaxed) != layer) {
+                if (!switching) {
+                    continue;
+                }
+                peer.layer.store(layer, std::memory_order_relaxed);
+                layerSwitches.fetch_add(1, std::memory_order_relaxed);
+            }
+            deliver(peer, *target.queue, state, frame);
+        }
+    }
+
+    // Points every receiving viewer at the highest layer its bandwidth
+    // estimate affords. Moving up needs 15% headroom. A keyframe is
+    // requested so the switch does not wait for the next periodic one.
+    void selectLayers() {
+        if (layerBitrates.size() <= 1) {
+            return;
+        }
+        bool switchPending = false;
+        auto sendList = sendable.read();
+        for (const SendList::Target& target : sendList->targets) {
+            PeerInfo& peer = *target.peer;
+            if (peer.liveFrom.load(std::memory_order_relaxed) == kOnDvr) {
+                continue;  // stays on the DVR's layer
+            }
+            uint32_t estimate = peer.feedback->bandwidth.stats().estimateKbps;
+            size_t current = peer.targetLayer.load(std::memory_order_relaxed);
+            size_t next = selectLayer(estimate, current);
+            if (next != current) {
+                peer.targetLayer.store(next, std::memory_order_relaxed);
+            }
+            if (next != peer.layer.load(std::memory_order_relaxed)) {
+                switchPending = true;
+            }
+        }
+        if (switchPending) {
+            keyframeRequester.request();
+        }
+    }
+
+    struct LayerStats {
+        std::vector<size_t> viewers;  // per layer, viewers currently receiving it
+        uint64_t switches;
+    };
+
+    LayerStats getLayerStats() const {
+        LayerStats stats{std::vector<size_t>(layerBitrates.size()), layerSwitches.load()};
+        auto sendList = sendable.read();
+        for (const SendList::Target& target : sendList->targets) {
+            stats.viewers[target.peer->layer.load(std::memory_order_relaxed)]++;
+        }
+        return stats;
+    }
+
+    std::vector<ViewerQueueStats> getQueueStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<ViewerQueueStats> stats;
+        stats.reserve(connections.size());
+        for (const auto& [_, peerInfo] : connections) {
+            if (peerInfo->queue) {
+                stats.push_back(peerInfo->queue->stats());
+            }
+        }
+        return stats;
+    }
+
+    // Estimates for viewers that are currently receiving media.
+    std::vector<ViewerBandwidthStats> getBandwidthStats() {
+        std::vector<std::shared_ptr<PeerInfo>> peers;
+        {
+            auto sendList = sendable.read();
+            peers = sendList->owners;
+        }
+        std::vector<ViewerBandwidthStats> stats;
+        stats.reserve(peers.size());
+        for (const auto& peerInfo : peers) {
+            ViewerBandwidthStats viewer = peerInfo->feedback->bandwidth.stats();
+            viewer.viewerId = peerInfo->viewerId;
+            if (auto rtt = peerInfo->pc->rtt()) {
+                viewer.rttMs = rtt->count();
+            }
+            viewer.bytesSent = peerInfo->pc->bytesSent();
+            stats.push_back(std::move(viewer));
+        }
+        return stats;
+    }
+
+    struct FeedbackStats {
+        uint64_t nacked;          // sequence numbers requested by viewers
+        uint64_t retransmitted;
+        uint64_t keyframeRequests;
+        uint64_t keyframesForced;
+        uint64_t keyframesUnanswered;
+    };
+
+    FeedbackStats getFeedbackStats() {
+        uint64_t retransmitted = nackHits.load();
+        return {retransmitted + nackMisses.load(), retransmitted, keyframeRequester.requests.load(),
+                keyframeRequester.forced.load(), keyframeRequester.unanswered.load()};
+    }
+
+    struct PoolStats {
+        size_t target;
+        size_t ready;
+        uint64_t hits;    // joins served from the pool
+        uint64_t misses;  // joins that built a connection on the spot
+    };
+
+    PoolStats getPoolStats() {
+        return {pool.targetSize(), pool.readyCount(), pool.hits.load(), pool.misses.load()};
+    }
+
+    struct LifecycleStats {
+        size_t live;         // connected
+        size_t negotiating;  // not connected yet
+        size_t zombies;      // down, waiting to be evicted
+        uint64_t evicted;
+        uint64_t timedOut;
+        uint64_t rejected;   // turned away by maxPeers
+    };
+
+    LifecycleStats getLifecycleStats() {
+        LifecycleStats stats{0, 0, 0, evictedPeers.load(std::memory_order_relaxed),
+                             timedOutPeers.load(std::memory_order_relaxed),
+                             rejectedPeers.load(std::memory_order_relaxed)};
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& [_, peerInfo] : connections) {
+            if (peerInfo->lifecycle.isConnected()) {
+                ++stats.live;
+            } else if (peerInfo->lifecycle.isZombie()) {
+                ++stats.zombies;
+            } else {
+                ++stats.negotiating;
+            }
+        }
+        return stats;
+    }
+
+    std::vector<std::string> getAllViewerIds() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> ids;
+        for (const auto& [viewerId, _] : connections) {
+            ids.push_back(viewerId);
+        }
+        return ids;
+    }
+
+    size_t getConnectionCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connections.size();
+    }
+
+    size_t getSendableCount() const {
+        return sendable.read()->targets.size();
+    }
+
+
+    void closeAll() {
+        std::map<std::string, std::shared_ptr<PeerInfo>> closing;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing.swap(connections);
+            publishLocked();
+        }
+        for (auto& [_, peerInfo] : closing) {
+            fanout->detach(peerInfo->queue);
+            if (peerInfo->pc) {
+                peerInfo->pc->close();
+            }
+        }
+    }
+
+private:
+    PeerConnectionPool::Warm makeConnection() {
+        rtc::Configuration config;
+        for (const std::string& url : iceServers) {
+            config.iceServers.emplace_back(url);
+        }
+        config.disableAutoNegotiation = true;
+        // libdatachannel generates one certificate per type per process and
+        // shares it between connections; ECDSA keeps that one-off cost low.
+        config.certificateType = rtc::CertificateType::Ecdsa;
+
+        PeerConnectionPool::Warm warm;
+        warm.pc = std::make_shared<rtc::PeerConnection>(config);
+
+        rtc::Description::Video media("video", rtc::Description::Direction::SendOnly);
+        media.addH264Codec(rtp::kH264PayloadType);
+        if (fec) {
+            media.addVideoCodec(rtp::kRedPayloadType, "red");
+            media.addVideoCodec(rtp::kUlpfecPayloadType, "ulpfec");
+        }
+        if (captureTime) {
+            media.addExtMap(rtc::Description::Entry::ExtMap(rtp::kAbsCaptureTimeId, rtp::kAbsCaptureTimeUri));
+        }
+        warm.track = warm.pc->addTrack(media);
+        return warm;
+    }
+
+    // Every viewer is renumbered when layers can be switched.
+    bool rewritesSequences() const { return layerBitrates.size() > 1; }
+
+    // Whether the viewer's answer kept RED.
+    static bool acceptsRed(rtc::PeerConnection& pc) {
+        auto description = pc.remoteDescription();
+        return description && std::string(*description).find(" red/90000") != std::string::npos;
+    }
+
+    struct LayerState {
+        GopCache gopCache;
+        std::vector<bool> keyframeStarts;  // of the frame being sent
+    };
+
+    // A viewer on the DVR takes nothing live; one that just left it starts
+    // with the first frame the DVR did not send.
+    static bool takesLive(const PeerInfo& peer, std::optional<uint64_t> dvrFrame) {
+        uint64_t liveFrom = peer.liveFrom.load(std::memory_order_acquire);
+        return liveFrom == 0 || (liveFrom != kOnDvr && (!dvrFrame || *dvrFrame >= liveFrom));
+    }
+
+    void deliver(PeerInfo& peer, ViewerQueue& queue, LayerState& state, const std::vector<RtpPacketRef>& frame) {
+        if (peer.joinPending.load(std::memory_order_relaxed)) {
+            peer.joinPending.store(false, std::memory_order_relaxed);
+            if (state.gopCache.valid()) {
+                fanout->enqueueBurst(queue, state.gopCache.burst());
+                return;
+            }
+        }
+        fanout->enqueueFrame(queue, frame, state.keyframeStarts);
+    }
+
+    size_t selectLayer(uint32_t estimateKbps, size_t current) const {
+        size_t layer = 0;
+        for (size_t i = 1; i < layerBitrates.size(); ++i) {
+            double needed = layerBitrates[i] * (i > current ? 1.15 : 1.0);
+            if (estimateKbps >= needed) {
+                layer = i;
+            }
+        }
+        return layer;
+    }
+
+    // Overflow under OverflowPolicy::Disconnect. Only removes the peer if it
+    // still owns `queue`; the viewer may have reconnected in the meantime.
+    void evictPeer(const std::shared_ptr<ViewerQueue>& queue) {
+        bool current = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = connections.find(queue->viewerId);
+            current = it != connections.end() && it->second->queue == queue;
+        }
+        if (current) {
+            removePeerConnection(queue->viewerId);
+        }
+    }
+
+    // Reaper thread. Removal happens under `mutex` so a viewer reconnecting
+    // meanwhile keeps its new connection; closing happens after.
+    void reapPeers() {
+        std::vector<std::shared_ptr<PeerInfo>> reaped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = connections.begin(); it != connections.end();) {
+                PeerLifecycle::Verdict verdict = it->second->lifecycle.verdict(lifecycleConfig);
+                if (verdict == PeerLifecycle::Verdict::Keep) {
+                    ++it;
+                    continue;
+                }
+                (verdict == PeerLifecycle::Verdict::TimedOut ? timedOutPeers : evictedPeers)
+                    .fetch_add(1, std::memory_order_relaxed);
+                reaped.push_back(std::move(it->second));
+                it = connections.erase(it);
+            }
+            if (!reaped.empty()) {
+                publishLocked();
+            }
+        }
+        for (auto& peerInfo : reaped) {
+            fanout->detach(peerInfo->queue);
+            if (peerInfo->pc) {
+                peerInfo->pc->close();
+            }
+            log_info(peerLog, {{"viewer", peerInfo->viewerId}}, "Evicted peer connection");
+        }
+    }
+
+    void republish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        publishLocked();
+    }
+
+    void publishLocked() {
+        auto next = std::make_unique<SendList>();
+        next->targets.reserve(connections.size());
+        next->owners.reserve(connections.size());
+        for (const auto& [_, peerInfo] : connections) {
+            if (peerInfo->queue && peerInfo->trackOpen && peerInfo->connected) {
+                next->targets.push_back({peerInfo->queue.get(), peerInfo.get()});
+                next->owners.push_back(peerInfo);
+            }
+        }
+        sendable.publish(std::move(next));
+    }
+
+    std::map<std::string, std::shared_ptr<PeerInfo>> connections;
+    std::mutex mutex;
+    RcuSnapshot<SendList> sendable;
+    std::vector<std::string> iceServers{"stun:stun.l.google.com:19302"};
+    bool captureTime = false;
+    bool fec = false;
+    BitrateLimits bitrateLimits;
+    std::vector<uint32_t> layerBitrates{bitrateLimits.startKbps};
+    size_t initialLayer = 0;
+    std::vector<LayerState> layers = std::vector<LayerState>(1);  // each used by its layer's streaming thread only
+    RetransmissionBuffer retransmissions;  // single-layer streams only
+    KeyframeRequester keyframeRequester;
+    std::atomic<uint64_t> nackHits{0};
+    std::atomic<uint64_t> nackMisses{0};
+    std::atomic<uint64_t> layerSwitches{0};
+    LifecycleConfig lifecycleConfig;
+    size_t admitting = 0;  // admitted, not yet in `connections`
+    std::atomic<uint64_t> evictedPeers{0};
+    std::atomic<uint64_t> timedOutPeers{0};
+    std::atomic<uint64_t> rejectedPeers{0};
+    PeerReaper reaper;
+    PeerConnectionPool pool;
+    // Near the end so that, when this manager holds the last reference, its
+    // workers stop before anything they call into goes away.
+    std::shared_ptr<FanoutEngine> fanout;
+    // Feeds `fanout`, so its thread stops before the engine does.
+    std::unique_ptr<DvrPlayer> dvr;
+};
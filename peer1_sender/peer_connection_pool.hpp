@@ -0,0 +1,195 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "logger.hpp"
+
+inline LogCategory poolLog("pool");
+
+// Peer connections created ahead of demand, with the video track added and
+// the offer already made and fully gathered, so a joining viewer's offer
+// can be sent at once. Kept topped up by a background thread; entries
+// older than maxAge are replaced so their ICE candidates stay fresh.
+class PeerConnectionPool {
+public:
+    struct Warm {
+        std::shared_ptr<rtc::PeerConnection> pc;
+        std::shared_ptr<rtc::Track> track;
+    };
+    // Builds a connection with its track; called on the pool thread.
+    using Factory = std::function<Warm()>;
+
+    PeerConnectionPool() {}
+    ~PeerConnectionPool() { stop(); }
+
+    // `targetSize` may be 0 and raised later with resize().
+    void start(size_t targetSize, Factory warmFactory,
+               std::chrono::seconds entryMaxAge = std::chrono::seconds(120)) {
+        stop();
+        target = targetSize;
+        factory = std::move(warmFactory);
+        maxAge = entryMaxAge;
+        stopping = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(signal->mutex);
+            stopping = true;
+        }
+        signal->cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        std::list<Entry> closing;
+        {
+            std::lock_guard<std::mutex> lock(signal->mutex);
+            closing.swap(entries);
+        }
+        for (Entry& entry : closing) {
+            entry.warm.pc->close();
+        }
+    }
+
+    // Grows or shrinks the pool; surplus entries are closed by the pool
+    // thread. Safe from any thread.
+    void resize(size_t targetSize) {
+        {
+            std::lock_guard<std::mutex> lock(signal->mutex);
+            target = targetSize;
+        }
+        signal->cv.notify_all();
+    }
+
+    size_t targetSize() {
+        std::lock_guard<std::mutex> lock(signal->mutex);
+        return target;
+    }
+
+    // A connection whose gathering has completed, or nothing if none is
+    // ready; the caller then builds one itself.
+    std::optional<Warm> take() {
+        std::optional<Warm> warm;
+        {
+            std::lock_guard<std::mutex> lock(signal->mutex);
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (*it->gathered) {
+                    warm = std::move(it->warm);
+                    entries.erase(it);
+                    break;
+                }
+            }
+        }
+        (warm ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+        signal->cv.notify_all();
+        return warm;
+    }
+
+    size_t readyCount() {
+        std::lock_guard<std::mutex> lock(signal->mutex);
+        size_t ready = 0;
+        for (const Entry& entry : entries) {
+            ready += *entry.gathered ? 1 : 0;
+        }
+        return ready;
+    }
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+private:
+    // Outlives the pool for gathering callbacks that fire late.
+    struct Signal {
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    struct Entry {
+        Warm warm;
+        std::chrono::steady_clock::time_point created;
+        std::shared_ptr<std::atomic<bool>> gathered;
+    };
+
+    void run() {
+        while (true) {
+            std::vector<std::shared_ptr<rtc::PeerConnection>> expired;
+            bool refill = false;
+            {
+                std::unique_lock<std::mutex> lock(signal->mutex);
+                signal->cv.wait_for(lock, std::chrono::seconds(1), [this]() {
+                    return stopping || entries.size() != target;
+                });
+                if (stopping) {
+                    return;
+                }
+                auto now = std::chrono::steady_clock::now();
+                for (auto it = entries.begin(); it != entries.end();) {
+                    if (now - it->created > maxAge) {
+                        expired.push_back(it->warm.pc);
+                        it = entries.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                while (entries.size() > target) {
+                    expired.push_back(entries.front().warm.pc);
+                    entries.pop_front();
+                }
+                refill = entries.size() < target;
+            }
+            for (auto& pc : expired) {
+                pc->close();
+            }
+            if (refill) {
+                addEntry();
+            }
+        }
+    }
+
+    // One at a time, so a storm of takes does not stall the pool thread on
+    // dozens of ICE agents at once.
+    void addEntry() {
+        Entry entry;
+        try {
+            entry.warm = factory();
+        } catch (const std::exception& e) {
+            log_error(poolLog, {}, "Failed to pre-create peer connection: ", e.what());
+            std::unique_lock<std::mutex> lock(signal->mutex);
+            signal->cv.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping.load(); });
+            return;
+        }
+        entry.created = std::chrono::steady_clock::now();
+        entry.gathered = std::make_shared<std::atomic<bool>>(false);
+        std::weak_ptr<Signal> weakSignal = signal;
+        auto gathered = entry.gathered;
+        entry.warm.pc->onGatheringStateChange([weakSignal, gathered](rtc::PeerConnection::GatheringState state) {
+            if (state == rtc::PeerConnection::GatheringState::Complete) {
+                *gathered = true;
+                if (auto shared = weakSignal.lock()) {
+                    shared->cv.notify_all();
+                }
+            }
+        });
+        entry.warm.pc->setLocalDescription();
+        std::lock_guard<std::mutex> lock(signal->mutex);
+        entries.push_back(std::move(entry));
+    }
+
+    std::shared_ptr<Signal> signal = std::make_shared<Signal>();
+    std::list<Entry> entries;
+    size_t target = 0;
+    Factory factory;
+    std::chrono::seconds maxAge{120};
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
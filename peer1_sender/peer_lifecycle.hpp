@@ -0,0 +1,142 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+struct LifecycleConfig {
+    // A peer that has not connected this long after its offer is dropped.
+    std::chrono::seconds negotiationTimeout{30};
+    // Disconnected can still recover; after this long it is treated as dead.
+    std::chrono::seconds disconnectGrace{10};
+    // Peers admitted at once, counting those still negotiating; 0 = no cap.
+    size_t maxPeers = 0;
+};
+
+// Connection state of one peer as the reaper sees it. Written from the
+// PeerConnection state callback, read by the reaper thread.
+class PeerLifecycle {
+public:
+    enum class Verdict {
+        Keep,
+        Evict,     // failed, closed, or disconnected past the grace period
+        TimedOut,  // never connected
+    };
+
+    PeerLifecycle() : created(now()), changed(created) {}
+
+    void onState(rtc::PeerConnection::State next) {
+        if (next == rtc::PeerConnection::State::Connected) {
+            everConnected = true;
+        }
+        state = next;
+        changed = now();
+    }
+
+    Verdict verdict(const LifecycleConfig& config) const {
+        int64_t current = now();
+        switch (state.load()) {
+            case rtc::PeerConnection::State::Failed:
+            case rtc::PeerConnection::State::Closed:
+                return Verdict::Evict;
+            case rtc::PeerConnection::State::Disconnected:
+                if (current - changed > toTicks(config.disconnectGrace)) {
+                    return Verdict::Evict;
+                }
+                break;
+            default:
+                break;
+        }
+        if (!everConnected && current - created > toTicks(config.negotiationTimeout)) {
+            return Verdict::TimedOut;
+        }
+        return Verdict::Keep;
+    }
+
+    bool isConnected() const { return state == rtc::PeerConnection::State::Connected; }
+
+    // Down, and kept only until the reaper gets to it.
+    bool isZombie() const {
+        rtc::PeerConnection::State current = state;
+        return current == rtc::PeerConnection::State::Disconnected ||
+               current == rtc::PeerConnection::State::Failed ||
+               current == rtc::PeerConnection::State::Closed;
+    }
+
+private:
+    static int64_t now() {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    static int64_t toTicks(std::chrono::seconds duration) {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration).count();
+    }
+
+    std::atomic<rtc::PeerConnection::State> state{rtc::PeerConnection::State::New};
+    std::atomic<bool> everConnected{false};
+    const int64_t created;  // steady_clock ticks
+    std::atomic<int64_t> changed;
+};
+
+// Runs `sweep` on its own thread every `interval`, or sooner when woken, so
+// peers are closed away from libdatachannel's callback threads.
+class PeerReaper {
+public:
+    PeerReaper() {}
+    ~PeerReaper() { stop(); }
+
+    void start(std::chrono::milliseconds interval, std::function<void()> sweepPeers) {
+        stop();
+        period = interval;
+        sweep = std::move(sweepPeers);
+        stopping = false;
+        woken = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void wake() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            woken = true;
+        }
+        cv.notify_all();
+    }
+
+private:
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait_for(lock, period, [this]() { return stopping || woken; });
+                if (stopping) {
+                    return;
+                }
+                woken = false;
+            }
+            sweep();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::chrono::milliseconds period{1000};
+    std::function<void()> sweep;
+    bool stopping = false;
+    bool woken = false;
+    std::thread thread;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Read-mostly, copy-on-write holder for an immutable T.
+//
+// Readers take a ReadGuard and get a stable pointer without locking or
+// allocating (two atomic increments per read side). Writers build a new T
+// and publish() it; publish swaps the pointer and then waits for a grace
+// period before deleting the previous value, so a reader never sees freed
+// memory. Writers are serialized internally and may block briefly, so
+// publish() must never be called from inside a read section.
+template <typename T>
+class RcuSnapshot {
+public:
+    class ReadGuard {
+    public:
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard() { owner.readers[slot].count.fetch_sub(1, std::memory_order_release); }
+
+        const T* get() const { return value; }
+        const T* operator->() const { return value; }
+        const T& operator*() const { return *value; }
+
+    private:
+        friend class RcuSnapshot;
+
+        explicit ReadGuard(const RcuSnapshot& snapshot) : owner(snapshot) {
+            slot = owner.epoch.load(std::memory_order_seq_cst) & 1;
+            owner.readers[slot].count.fetch_add(1, std::memory_order_seq_cst);
+            value = owner.current.load(std::memory_order_seq_cst);
+        }
+
+        const RcuSnapshot& owner;
+        uint64_t slot;
+        const T *value;
+    };
+
+    explicit RcuSnapshot(std::unique_ptr<T> initial = std::make_unique<T>())
+        : current(initial.release()) {}
+
+    ~RcuSnapshot() { delete current.load(); }
+
+    RcuSnapshot(const RcuSnapshot&) = delete;
+    RcuSnapshot& operator=(const RcuSnapshot&) = delete;
+
+    ReadGuard read() const { return ReadGuard(*this); }
+
+    void publish(std::unique_ptr<T> next) {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        const T *previous = current.exchange(next.release(), std::memory_order_seq_cst);
+        synchronize();
+        delete previous;
+    }
+
+private:
+    // A reader may have sampled the epoch just before a flip and registered
+    // in the old slot afterwards, so both slots have to drain once after the
+    // pointer swap before the old value is unreachable.
+    void synchronize() {
+        for (int pass = 0; pass < 2; ++pass) {
+            uint64_t slot = epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+            while (readers[slot].count.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    struct alignas(64) ReaderCount {
+        std::atomic<uint32_t> count{0};
+    };
+
+    std::atomic<const T*> current;
+    alignas(64) std::atomic<uint64_t> epoch{0};
+    mutable ReaderCount readers[2];
+    std::mutex writerMutex;
+};
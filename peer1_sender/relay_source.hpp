@@ -0,0 +1,399 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <websocketpp/config/asio_no_tls_client.hpp>
+#include <websocketpp/client.hpp>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+inline LogCategory relayLog("relay");
+
+// Receives the stream of an upstream sender as an ordinary viewer, over the
+// same signaling protocol browsers use, and hands its RTP packets on frame
+// by frame without decoding. A sender fed by a RelaySource is a relay, and
+// relays can be chained into a tree.
+//
+// Packets are restamped with the relay's own SSRC and with sequence numbers
+// and timestamps that continue across upstream sessions, so downstream
+// viewers see one stream when the upstream connection is replaced.
+class RelaySource {
+public:
+    using FrameSink = std::function<void(const std::vector<RtpPacketRef>& frame)>;
+
+    struct Config {
+        std::string signalingUrl;
+        std::string channel;  // upstream channel; empty for its default
+        std::vector<std::string> iceServers;
+    };
+
+    struct Stats {
+        bool connected;            // upstream peer connection is up
+        uint64_t packets;          // RTP packets received
+        uint64_t sessions;         // upstream offers accepted
+        uint64_t keyframeRequests; // PLIs sent upstream
+    };
+
+    RelaySource(Config relayConfig, FrameSink frameSink)
+        : config(std::move(relayConfig)), sink(std::move(frameSink)) {
+        std::random_device random;
+        ssrc = random();
+        nextSequence = static_cast<uint16_t>(random());
+        nextTimestamp = random();
+    }
+
+    ~RelaySource() { stop(); }
+
+    void start() {
+        stopping = false;
+        client.init_asio();
+        client.clear_access_channels(websocketpp::log::alevel::all);
+        client.clear_error_channels(websocketpp::log::elevel::all);
+        // Keep run() alive between connections so reconnect timers fire
+        client.start_perpetual();
+        client.set_open_handler([this](websocketpp::connection_hdl hdl) { onOpen(hdl); });
+        client.set_close_handler([this](websocketpp::connection_hdl) { onLinkDown("Disconnected from"); });
+        client.set_fail_handler([this](websocketpp::connection_hdl) { onLinkDown("Failed to connect to"); });
+        client.set_message_handler([this](websocketpp::connection_hdl, Client::message_ptr msg) {
+            try {
+                onMessage(nlohmann::json::parse(msg->get_payload()));
+            } catch (const std::exception& e) {
+                log_error(relayLog, {}, "Error handling upstream message: ", e.what());
+            }
+        });
+        connect();
+        thread = std::thread([this]() {
+            try {
+                client.run();
+            } catch (const std::exception& e) {
+                log_error(relayLog, {}, "Upstream signaling thread error: ", e.what());
+            }
+        });
+    }
+
+    // Closes the upstream connection and waits for the signaling thread.
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        stopping = true;
+        closePeer();
+        // Cancel timers and close the link on the signaling thread itself
+        client.get_io_service().post([this]() {
+            if (retryTimer) {
+                retryTimer->cancel();
+            }
+            websocketpp::lib::error_code ec;
+            std::lock_guard<std::mutex> lock(wsMutex);
+            if (wsConnected) {
+                client.close(hdl, websocketpp::close::status::normal, "Relay stopping", ec);
+            }
+        });
+        client.stop_perpetual();
+        thread.join();
+    }
+
+    // Downstream PLI/FIR, already rate limited by the caller.
+    void requestKeyframe() {
+        std::shared_ptr<rtc::Track> current;
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            current = track;
+        }
+        if (current && current->requestKeyframe()) {
+            keyframeRequests.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Stats stats() const {
+        return {connected.load(std::memory_order_relaxed), packets.load(std::memory_order_relaxed),
+                sessions.load(std::memory_order_relaxed), keyframeRequests.load(std::memory_order_relaxed)};
+    }
+
+private:
+    using Client = websocketpp::client<websocketpp::config::asio_client>;
+
+    // Frames are cut after the marker bit; the cap guards against a lost one.
+    static constexpr size_t kMaxFramePackets = 1024;
+    static constexpr int32_t kClockRate = 90000;  // H.264 RTP clock
+    // Frame step assumed until the upstream has shown its own (30 fps).
+    static constexpr uint32_t kDefaultFrameTicks = 3000;
+
+    void connect() {
+        if (stopping) {
+            return;
+        }
+        websocketpp::lib::error_code ec;
+        auto con = client.get_connection(config.signalingUrl, ec);
+        if (ec) {
+            // A bad URL will not get better by retrying
+            log_error(relayLog, {{"url", config.signalingUrl}}, "Upstream signaling error: ", ec.message());
+            return;
+        }
+        client.connect(con);
+    }
+
+    // Signaling thread only.
+    void retryLater(std::function<void()> action) {
+        if (stopping) {
+            return;
+        }
+        std::chrono::milliseconds delay = retryDelay;
+        retryDelay = std::min(retryDelay * 2, std::chrono::milliseconds(30000));
+        retryTimer = client.set_timer(delay.count(), [this, action](const websocketpp::lib::error_code& ec) {
+            if (!ec && !stopping) {
+                action();
+            }
+        });
+    }
+
+    void send(const nlohmann::json& message) {
+        websocketpp::lib::error_code ec;
+        std::lock_guard<std::mutex> lock(wsMutex);
+        if (!wsConnected) {
+            return;
+        }
+        client.send(hdl, message.dump(), websocketpp::frame::opcode::text, ec);
+        if (ec) {
+            log_warn(relayLog, {}, "Error sending upstream signaling message: ", ec.message());
+        }
+    }
+
+    nlohmann::json withChannel(nlohmann::json message) const {
+        if (!config.channel.empty()) {
+            message["channel"] = config.channel;
+        }
+        return message;
+    }
+
+    void onOpen(websocketpp::connection_hdl connection) {
+        {
+            std::lock_guard<std::mutex> lock(wsMutex);
+            hdl = connection;
+            wsConnected = true;
+        }
+        retryDelay = std::chrono::milliseconds(500);
+        log_info(relayLog, {{"url", config.signalingUrl}}, "Connected to upstream signaling server");
+        // Registering as a viewer makes the upstream sender send an offer
+        send(withChannel({{"client_type", "viewer"}}));
+    }
+
+    void onLinkDown(const char *what) {
+        {
+            std::lock_guard<std::mutex> lock(wsMutex);
+            wsConnected = false;
+        }
+        if (stopping) {
+            return;
+        }
+        log_warn(relayLog, {{"url", config.signalingUrl}}, what, " upstream signaling server, retrying");
+        retryLater([this]() { connect(); });
+    }
+
+    // Signaling thread.
+    void onMessage(const nlohmann::json& j) {
+        if (j.contains("type") && j["type"] == "sender_status") {
+            // An upstream sender that (re)appears only offers to viewers that ask
+            if (j.contains("available") && j["available"].get<bool>() && !connected) {
+                send(withChannel({{"type", "create_new_offer"}}));
+            }
+            return;
+        }
+        if (j.contains("sdp") && j.contains("type") && j["type"] == "offer") {
+            acceptOffer(j["sdp"].get<std::string>(),
+                        j.contains("from") ? j["from"].get<std::string>() : std::string(),
+                        j.contains("session_id") ? j["session_id"].get<std::string>() : std::string());
+            return;
+        }
+        if (j.contains("candidate") || j.contains("candidates")) {
+            std::vector<std::string> candidates;
+            if (j.contains("candidates") && j["candidates"].is_array()) {
+                candidates = j["candidates"].get<std::vector<std::string>>();
+            } else {
+                candidates.push_back(j["candidate"].get<std::string>());
+            }
+            std::shared_ptr<rtc::PeerConnection> current;
+            {
+                std::lock_guard<std::mutex> lock(peerMutex);
+                current = pc;
+            }
+            if (!current) {
+                return;
+            }
+            for (const std::string& candidate : candidates) {
+                try {
+                    current->addRemoteCandidate(rtc::Candidate(candidate));
+                } catch (const std::exception& e) {
+                    log_warn(relayLog, {}, "Error adding upstream candidate: ", e.what());
+                }
+            }
+        }
+    }
+
+    // A new offer replaces the current upstream connection.
+    void acceptOffer(const std::string& sdp, const std::string& upstreamId, const std::string& sessionId) {
+        // Bumped first, so the old connection's callbacks see they are stale
+        uint64_t session = sessions.fetch_add(1, std::memory_order_relaxed) + 1;
+        closePeer();
+        log_info(relayLog, {{"upstream", upstreamId}, {"session", sessionId}}, "Accepting upstream offer");
+
+        rtc::Configuration rtcConfig;
+        for (const std::string& url : config.iceServers) {
+            rtcConfig.iceServers.emplace_back(url);
+        }
+        auto next = std::make_shared<rtc::PeerConnection>(rtcConfig);
+
+        next->onLocalDescription([this, upstreamId, sessionId](rtc::Description description) {
+            send({{"type", description.typeString()}, {"sdp", std::string(description)},
+                  {"target_id", upstreamId}, {"session_id", sessionId}});
+        });
+        next->onLocalCandidate([this, upstreamId, sessionId](rtc::Candidate candidate) {
+            send({{"candidate", std::string(candidate)}, {"sdpMid", candidate.mid()}, {"sdpMLineIndex", 0},
+                  {"target_id", upstreamId}, {"session_id", sessionId}});
+        });
+        next->onStateChange([this, session](rtc::PeerConnection::State state) {
+            if (session != sessions.load(std::memory_order_relaxed)) {
+                return;  // replaced meanwhile
+            }
+            connected = state == rtc::PeerConnection::State::Connected;
+            if (stopping) {
+                return;
+            }
+            if (state == rtc::PeerConnection::State::Failed || state == rtc::PeerConnection::State::Closed) {
+                log_warn(relayLog, {}, "Upstream peer connection lost, asking for a new offer");
+                client.get_io_service().post([this]() {
+                    retryLater([this]() { send(withChannel({{"type", "create_new_offer"}})); });
+                });
+            } else if (state == rtc::PeerConnection::State::Connected) {
+                client.get_io_service().post([this]() { retryDelay = std::chrono::milliseconds(500); });
+                log_info(relayLog, {}, "Upstream peer connection established");
+            }
+        });
+        next->onTrack([this, session](std::shared_ptr<rtc::Track> incoming) {
+            // Generates receiver reports and carries our PLIs upstream
+            incoming->setMediaHandler(std::make_shared<rtc::RtcpReceivingSession>());
+            incoming->onMessage([this, session](rtc::binary message) {
+                onPacket(session, message.data(), message.size());
+            }, nullptr);
+            std::lock_guard<std::mutex> lock(peerMutex);
+            track = incoming;
+        });
+
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            pc = next;
+        }
+        // With automatic negotiation the answer follows through onLocalDescription
+        next->setRemoteDescription(rtc::Description(sdp, "offer"));
+    }
+
+    void closePeer() {
+        std::shared_ptr<rtc::PeerConnection> closing;
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            closing = std::move(pc);
+            track.reset();
+        }
+        connected = false;
+        if (closing) {
+            closing->close();
+        }
+    }
+
+    // libdatachannel thread. Packets of a replaced session are dropped; the
+    // mutex covers the short overlap while the old one is closing.
+    void onPacket(uint64_t session, const std::byte *data, size_t size) {
+        // RTCP shares the port (RFC 5761); its packet types put 192..223 in byte 1
+        if (!rtp::isValid(data, size) || (rtp::byteAt(data, 1) >= 192 && rtp::byteAt(data, 1) <= 223)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(packetMutex);
+        if (session != sessions.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (session != currentSession) {
+            // Continue where the previous session left off, one frame later
+            currentSession = session;
+            sequenceOffset = static_cast<uint16_t>(nextSequence - rtp::sequenceNumber(data));
+            timestampOffset = nextTimestamp + frameTicks - rtp::timestamp(data);
+            frame.clear();
+        }
+        uint16_t sequence = static_cast<uint16_t>(rtp::sequenceNumber(data) + sequenceOffset);
+        uint32_t timestamp = rtp::timestamp(data) + timestampOffset;
+        RtpPacketRef packet = RtpPacket::copyOf(data, size, [&](std::byte *bytes, size_t length) {
+            rtp::setSsrc(bytes, ssrc);
+            rtp::setSequenceNumber(bytes, sequence);
+            rtp::setTimestamp(bytes, timestamp);
+            // The origin's FEC, if any, must follow the new numbering
+            rtp::restampFec(bytes, length, sequenceOffset, rtp::timestamp(data), timestamp);
+        });
+        if (!packet) {
+            return;
+        }
+        packets.fetch_add(1, std::memory_order_relaxed);
+        // Reordered packets must not move the continuation point backwards
+        if (static_cast<int16_t>(sequence - nextSequence) >= 0) {
+            nextSequence = static_cast<uint16_t>(sequence + 1);
+        }
+        int32_t step = static_cast<int32_t>(timestamp - nextTimestamp);
+        if (step > 0) {
+            // A step of a second or more is a gap in the stream, not its frame rate
+            if (step < kClockRate) {
+                frameTicks = static_cast<uint32_t>(step);
+            }
+            nextTimestamp = timestamp;
+        }
+        bool last = rtp::marker(packet->data());
+        frame.push_back(std::move(packet));
+        if (last || frame.size() >= kMaxFramePackets) {
+            sink(frame);
+            frame.clear();
+        }
+    }
+
+    const Config config;
+    const FrameSink sink;
+
+    Client client;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    // Signaling thread only
+    std::chrono::milliseconds retryDelay{500};
+    Client::timer_ptr retryTimer;
+
+    std::mutex wsMutex;
+    websocketpp::connection_hdl hdl;
+    bool wsConnected = false;
+
+    std::mutex peerMutex;
+    std::shared_ptr<rtc::PeerConnection> pc;
+    std::shared_ptr<rtc::Track> track;
+    std::atomic<bool> connected{false};
+
+    // Restamping and frame assembly, under packetMutex
+    std::mutex packetMutex;
+    uint64_t currentSession = 0;
+    uint32_t ssrc;
+    uint16_t nextSequence;
+    uint32_t nextTimestamp;
+    uint16_t sequenceOffset = 0;
+    uint32_t timestampOffset = 0;
+    uint32_t frameTicks = kDefaultFrameTicks;  // last step between two frames
+    std::vector<RtpPacketRef> frame;
+
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> sessions{0};
+    std::atomic<uint64_t> keyframeRequests{0};
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <rtc/rtc.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "bandwidth_estimator.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+// Recently sent RTP packets indexed by sequence number, shared by every
+// viewer: all viewers receive the same packets, so one copy answers NACKs
+// from any of them. Written by the streaming thread, read by RTCP handlers.
+class RetransmissionBuffer {
+public:
+    explicit RetransmissionBuffer(size_t capacity = 2048) {
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        slots.resize(rounded);
+        mask = rounded - 1;
+    }
+
+    void store(const RtpPacketRef& packet) {
+        uint16_t seq = rtp::sequenceNumber(packet->data());
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[seq & mask] = packet;
+    }
+
+    // Empty ref when the packet has already been overwritten.
+    RtpPacketRef find(uint32_t ssrc, uint16_t seq) {
+        RtpPacketRef packet;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            packet = slots[seq & mask];
+        }
+        if (packet && rtp::sequenceNumber(packet->data()) == seq && rtp::ssrc(packet->data()) == ssrc) {
+            return packet;
+        }
+        return {};
+    }
+
+private:
+    std::vector<RtpPacketRef> slots;
+    size_t mask = 0;
+    std::mutex mutex;
+};
+
+// Turns PLI/FIR from any number of viewers into at most one encoder
+// keyframe request per interval.
+class KeyframeRequester {
+public:
+    void configure(std::function<void()> action, std::chrono::milliseconds interval) {
+        std::lock_guard<std::mutex> lock(mutex);
+        forceKeyUnit = std::move(action);
+        minInterval = interval;
+    }
+
+    void request() {
+        requests.fetch_add(1, std::memory_order_relaxed);
+        std::function<void()> action;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            if (!forceKeyUnit) {
+                unanswered.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (now - lastForced < minInterval) {
+                return;
+            }
+            lastForced = now;
+            action = forceKeyUnit;
+        }
+        forced.fetch_add(1, std::memory_order_relaxed);
+        action();
+    }
+
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> forced{0};
+    std::atomic<uint64_t> unanswered{0};  // no encoder to ask, as with passthrough or a file cache
+
+private:
+    std::mutex mutex;
+    std::function<void()> forceKeyUnit;
+    std::chrono::milliseconds minInterval{500};
+    std::chrono::steady_clock::time_point lastForced{};
+};
+
+// Finds the packet a viewer knows as (ssrc, sequence), ready to resend.
+using RetransmissionLookup = std::function<RtpPacketRef(uint32_t ssrc, uint16_t sequence)>;
+
+// Per-viewer RTCP handler: answers generic NACKs (RFC 4585) through
+// `lookup`, forwards PLI/FIR to the keyframe requester, and
+// feeds receiver reports and REMB into the viewer's bandwidth estimate,
+// along with the media bytes it saw going out. Messages are left in place
+// for handlers further down the chain.
+class RtcpFeedbackHandler : public rtc::MediaHandler {
+public:
+    RtcpFeedbackHandler(RetransmissionLookup lookup, KeyframeRequester& keyframes, BitrateLimits limits = {})
+        : bandwidth(limits), lookup(std::move(lookup)), keyframes(keyframes) {}
+
+    void incoming(rtc::message_vector& messages, const rtc::message_callback& send) override {
+        for (const auto& message : messages) {
+            if (message && message->type == rtc::Message::Control) {
+                handleCompound(message->data(), message->size(), send);
+            }
+        }
+    }
+
+    // The viewer's send worker, one relaxed add per packet.
+    void outgoing(rtc::message_vector& messages, const rtc::message_callback&) override {
+        uint64_t bytes = 0;
+        for (const auto& message : messages) {
+            if (message && message->type != rtc::Message::Control) {
+                bytes += message->size();
+            }
+        }
+        bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    ViewerBandwidthEstimator bandwidth;
+
+private:
+    static uint32_t read32(const std::byte *data) {
+        return (uint32_t(rtp::byteAt(data, 0)) << 24) | (uint32_t(rtp::byteAt(data, 1)) << 16) |
+               (uint32_t(rtp::byteAt(data, 2)) << 8) | uint32_t(rtp::byteAt(data, 3));
+    }
+
+    void handleCompound(const std::byte *data, size_t size, const rtc::message_callback& send) {
+        size_t offset = 0;
+        while (offset + 4 <= size) {
+            const std::byte *packet = data + offset;
+            uint8_t format = rtp::byteAt(packet, 0) & 0x1F;
+            uint8_t type = rtp::byteAt(packet, 1);
+            size_t length = 4 * ((size_t(rtp::byteAt(packet, 2)) << 8 | rtp::byteAt(packet, 3)) + 1);
+            if ((rtp::byteAt(packet, 0) >> 6) != 2 || offset + length > size) {
+                return;
+            }
+            if (type == 200 || type == 201) {
+                // SR carries 20 bytes of sender info before its report blocks
+                handleReportBlocks(packet, length, type == 200 ? 28 : 8, format);
+            } else if (type == 205 && format == 1 && length >= 16) {
+                handleNack(packet, length, send);
+            } else if (type == 206 && (format == 1 || format == 4)) {
+                // PLI or FIR
+                keyframes.request();
+            } else if (type == 206 && format == 15 && length >= 20) {
+                handleRemb(packet);
+            }
+            offset += length;
+        }
+    }
+
+    // 24-byte blocks: SSRC, fraction lost, cumulative lost (24 bits),
+    // highest sequence, jitter, LSR, DLSR. We send a single stream, so every
+    // block is about it.
+    void handleReportBlocks(const std::byte *packet, size_t length, size_t offset, uint8_t count) {
+        for (uint8_t i = 0; i < count && offset + 24 <= length; ++i, offset += 24) {
+            bandwidth.onReceiverReport(rtp::byteAt(packet, offset + 4), read32(packet + offset + 12),
+                                       bytesSent.load(std::memory_order_relaxed));
+        }
+    }
+
+    // Application-layer feedback "REMB": 6-bit exponent, 18-bit mantissa.
+    void handleRemb(const std::byte *packet) {
+        if (rtp::byteAt(packet, 12) != 'R' || rtp::byteAt(packet, 13) != 'E' ||
+            rtp::byteAt(packet, 14) != 'M' || rtp::byteAt(packet, 15) != 'B') {
+            return;
+        }
+        uint8_t exponent = rtp::byteAt(packet, 17) >> 2;
+        uint64_t mantissa = (uint64_t(rtp::byteAt(packet, 17) & 0x03) << 16) |
+                            (uint64_t(rtp::byteAt(packet, 18)) << 8) | rtp::byteAt(packet, 19);
+        bandwidth.onRemb(exponent < 46 ? mantissa << exponent : UINT64_MAX);
+    }
+
+    // Header (4) + sender SSRC (4) + media SSRC (4), then PID/BLP pairs.
+    void handleNack(const std::byte *packet, size_t length, const rtc::message_callback& send) {
+        uint32_t mediaSsrc = read32(packet + 8);
+        for (size_t fci = 12; fci + 4 <= length; fci += 4) {
+            uint16_t pid = static_cast<uint16_t>((rtp::byteAt(packet, fci) << 8) | rtp::byteAt(packet, fci + 1));
+            uint16_t blp = static_cast<uint16_t>((rtp::byteAt(packet, fci + 2) << 8) | rtp::byteAt(packet, fci + 3));
+            resend(mediaSsrc, pid, send);
+            for (int bit = 0; bit < 16; ++bit) {
+                if (blp & (1 << bit)) {
+                    resend(mediaSsrc, static_cast<uint16_t>(pid + bit + 1), send);
+                }
+            }
+        }
+    }
+
+    void resend(uint32_t ssrc, uint16_t seq, const rtc::message_callback& send) {
+        if (RtpPacketRef packet = lookup(ssrc, seq)) {
+            send(rtc::make_message(packet->data(), packet->data() + packet->size()));
+        }
+    }
+
+    RetransmissionLookup lookup;
+    KeyframeRequester& keyframes;
+    std::atomic<uint64_t> bytesSent{0};
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Minimal read helpers for RTP packets carrying H.264 (RFC 3550 / RFC 6184),
+// optionally inside RED with ULPFEC (RFC 2198 / RFC 5109). They only look at
+// the bytes in place and never allocate.
+namespace rtp {
+
+constexpr size_t kHeaderSize = 12;
+
+// abs-capture-time header extension: the 64-bit NTP time a frame was
+// captured, here when it reached the sender. Sent on every packet of the
+// frame under kAbsCaptureTimeId, as an RFC 8285 one-byte header extension
+// padded to kAbsCaptureTimeSize bytes.
+constexpr const char *kAbsCaptureTimeUri = "http://www.webrtc.org/experiments/rtp-hdrext/abs-capture-time";
+constexpr uint8_t kAbsCaptureTimeId = 1;
+constexpr size_t kAbsCaptureTimeSize = 16;
+
+// Payload types as offered in the SDP. RED and ULPFEC only appear with FEC
+// enabled; then every packet is RED, holding either H.264 or an FEC packet.
+constexpr uint8_t kH264PayloadType = 96;
+constexpr uint8_t kRedPayloadType = 97;
+constexpr uint8_t kUlpfecPayloadType = 98;
+// ULPFEC header; the level 0 header after it is 4 bytes, or 8 with the long mask.
+constexpr size_t kFecHeaderSize = 10;
+
+inline uint8_t byteAt(const std::byte *data, size_t index) {
+    return std::to_integer<uint8_t>(data[index]);
+}
+
+inline bool isValid(const std::byte *data, size_t size) {
+    return size >= kHeaderSize && (byteAt(data, 0) >> 6) == 2;
+}
+
+inline uint8_t payloadType(const std::byte *data) { return byteAt(data, 1) & 0x7F; }
+inline bool marker(const std::byte *data) { return (byteAt(data, 1) & 0x80) != 0; }
+
+inline uint16_t sequenceNumber(const std::byte *data) {
+    return static_cast<uint16_t>((byteAt(data, 2) << 8) | byteAt(data, 3));
+}
+
+inline uint32_t timestamp(const std::byte *data) {
+    return (uint32_t(byteAt(data, 4)) << 24) | (uint32_t(byteAt(data, 5)) << 16) |
+           (uint32_t(byteAt(data, 6)) << 8) | uint32_t(byteAt(data, 7));
+}
+
+inline uint32_t ssrc(const std::byte *data) {
+    return (uint32_t(byteAt(data, 8)) << 24) | (uint32_t(byteAt(data, 9)) << 16) |
+           (uint32_t(byteAt(data, 10)) << 8) | uint32_t(byteAt(data, 11));
+}
+
+inline void setPayloadType(std::byte *data, uint8_t value) {
+    data[1] = std::byte((byteAt(data, 1) & 0x80) | (value & 0x7F));
+}
+
+inline void setSequenceNumber(std::byte *data, uint16_t value) {
+    data[2] = std::byte(value >> 8);
+    data[3] = std::byte(value & 0xFF);
+}
+
+inline void setTimestamp(std::byte *data, uint32_t value) {
+    data[4] = std::byte(value >> 24);
+    data[5] = std::byte((value >> 16) & 0xFF);
+    data[6] = std::byte((value >> 8) & 0xFF);
+    data[7] = std::byte(value & 0xFF);
+}
+
+inline void setSsrc(std::byte *data, uint32_t value) {
+    data[8] = std::byte(value >> 24);
+    data[9] = std::byte((value >> 16) & 0xFF);
+    data[10] = std::byte((value >> 8) & 0xFF);
+    data[11] = std::byte(value & 0xFF);
+}
+
+// NTP format: seconds since 1900 in the high 32 bits, fraction in the low.
+inline uint64_t toNtp(std::chrono::system_clock::time_point time) {
+    constexpr uint64_t kUnixToNtpSeconds = 2208988800ULL;
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+    uint64_t seconds = micros / 1000000 + kUnixToNtpSeconds;
+    uint64_t fraction = (uint64_t(micros % 1000000) << 32) / 1000000;
+    return (seconds << 32) | fraction;
+}
+
+inline std::chrono::system_clock::time_point fromNtp(uint64_t ntp) {
+    constexpr uint64_t kUnixToNtpSeconds = 2208988800ULL;
+    uint64_t micros = ((ntp >> 32) - kUnixToNtpSeconds) * 1000000 + (((ntp & 0xFFFFFFFF) * 1000000) >> 32);
+    return std::chrono::system_clock::time_point(std::chrono::microseconds(micros));
+}
+
+// Writes the extension block, header included, to `out` (kAbsCaptureTimeSize
+// bytes). The caller sets the X bit.
+inline void writeAbsCaptureTime(std::byte *out, uint64_t ntp) {
+    out[0] = std::byte(0xBE);
+    out[1] = std::byte(0xDE);
+    out[2] = std::byte(0);
+    out[3] = std::byte((kAbsCaptureTimeSize - 4) / 4);
+    out[4] = std::byte((kAbsCaptureTimeId << 4) | (8 - 1));
+    for (int i = 0; i < 8; ++i) {
+        out[5 + i] = std::byte((ntp >> (56 - 8 * i)) & 0xFF);
+    }
+    out[13] = out[14] = out[15] = std::byte(0);
+}
+
+// The abs-capture-time carried in a one-byte header extension, or 0.
+inline uint64_t absCaptureTime(const std::byte *data, size_t size) {
+    if (size < kHeaderSize || !(byteAt(data, 0) & 0x10)) {
+        return 0;
+    }
+    size_t offset = kHeaderSize + 4 * (byteAt(data, 0) & 0x0F);
+    if (offset + 4 > size || byteAt(data, offset) != 0xBE || byteAt(data, offset + 1) != 0xDE) {
+        return 0;
+    }
+    size_t end = offset + 4 + 4 * ((size_t(byteAt(data, offset + 2)) << 8) | byteAt(data, offset + 3));
+    if (end > size) {
+        return 0;
+    }
+    offset += 4;
+    while (offset < end) {
+        uint8_t id = byteAt(data, offset) >> 4;
+        size_t length = (byteAt(data, offset) & 0x0F) + 1;
+        if (id == 0) {  // padding
+            ++offset;
+            continue;
+        }
+        if (id == 15 || offset + 1 + length > end) {
+            return 0;
+        }
+        if (id == kAbsCaptureTimeId && length >= 8) {
+            uint64_t ntp = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                ntp = (ntp << 8) | byteAt(data, offset + 1 + i);
+            }
+            return ntp;
+        }
+        offset += 1 + length;
+    }
+    return 0;
+}
+
+// Offset of the payload past CSRCs and the header extension, or 0 when the
+// packet is malformed.
+inline size_t payloadOffset(const std::byte *data, size_t size) {
+    if (!isValid(data, size)) {
+        return 0;
+    }
+    size_t offset = kHeaderSize + 4 * (byteAt(data, 0) & 0x0F);
+    if (byteAt(data, 0) & 0x10) {
+        if (offset + 4 > size) {
+            return 0;
+        }
+        size_t words = (size_t(byteAt(data, offset + 2)) << 8) | byteAt(data, offset + 3);
+        offset += 4 + 4 * words;
+    }
+    return offset < size ? offset : 0;
+}
+
+// Payload type of the single block in a RED packet, or -1 when the packet
+// is not RED or also carries redundant blocks.
+inline int redBlockType(const std::byte *data, size_t size) {
+    size_t offset = payloadOffset(data, size);
+    if (offset == 0 || payloadType(data) != kRedPayloadType || (byteAt(data, offset) & 0x80)) {
+        return -1;
+    }
+    return byteAt(data, offset) & 0x7F;
+}
+
+inline bool isUlpfec(const std::byte *data, size_t size) {
+    return redBlockType(data, size) == kUlpfecPayloadType;
+}
+
+// For code that renumbers or retimes a stream: moves a RED-wrapped ULPFEC
+// packet's SN base by `sequenceDelta`, and its timestamp recovery from
+// `from` to `to`. Relies on every protected packet sharing the FEC packet's
+// timestamp, which FecEncoder guarantees.
+inline void restampFec(std::byte *data, size_t size, uint16_t sequenceDelta, uint32_t from, uint32_t to) {
+    if (!isUlpfec(data, size)) {
+        return;
+    }
+    size_t fec = payloadOffset(data, size) + 1;
+    bool longMask = byteAt(data, fec) & 0x40;
+    size_t maskEnd = fec + kFecHeaderSize + (longMask ? 8 : 4);
+    if (maskEnd > size) {
+        return;
+    }
+    uint16_t base = static_cast<uint16_t>(((byteAt(data, fec + 2) << 8) | byteAt(data, fec + 3)) + sequenceDelta);
+    data[fec + 2] = std::byte(base >> 8);
+    data[fec + 3] = std::byte(base & 0xFF);
+    // XOR of n equal timestamps is the timestamp when n is odd, else 0
+    int covered = 0;
+    for (size_t i = fec + kFecHeaderSize + 2; i < maskEnd; ++i) {
+        for (uint8_t bits = byteAt(data, i); bits; bits &= bits - 1) {
+            ++covered;
+        }
+    }
+    if (covered % 2 == 1) {
+        uint32_t change = from ^ to;
+        for (int i = 0; i < 4; ++i) {
+            data[fec + 4 + i] ^= std::byte((change >> (24 - 8 * i)) & 0xFF);
+        }
+    }
+}
+
+// Writes the media packet inside a RED packet to `out` (room for `size`
+// bytes): the same header with the inner payload type, and the RED header
+// dropped. Returns its size, or 0 for FEC and malformed packets.
+inline size_t unwrapRed(const std::byte *data, size_t size, std::byte *out) {
+    int inner = redBlockType(data, size);
+    if (inner < 0 || inner == kUlpfecPayloadType) {
+        return 0;
+    }
+    size_t offset = payloadOffset(data, size);
+    std::memcpy(out, data, offset);
+    std::memcpy(out + offset, data + offset + 1, size - offset - 1);
+    setPayloadType(out, static_cast<uint8_t>(inner));
+    return size - 1;
+}
+
+// True when the packet starts an H.264 random access point: an SPS (sent
+// ahead of every IDR with config-interval=-1), a STAP-A whose first unit is
+// an SPS or IDR slice, or the first fragment of an IDR slice. Looks inside
+// RED.
+inline bool isH264KeyframeStart(const std::byte *data, size_t size) {
+    size_t offset = payloadOffset(data, size);
+    if (offset == 0) {
+        return false;
+    }
+    if (payloadType(data) == kRedPayloadType) {
+        if (redBlockType(data, size) != kH264PayloadType || offset + 1 >= size) {
+            return false;
+        }
+        ++offset;
+    }
+    const std::byte *payload = data + offset;
+    size_t length = size - offset;
+
+    uint8_t nalType = byteAt(payload, 0) & 0x1F;
+    switch (nalType) {
+        case 5:
+        case 7:
+            return true;
+        case 24:  // STAP-A: 1 byte header, then 16-bit size + NAL unit
+            if (length < 4) {
+                return false;
+            }
+            nalType = byteAt(payload, 3) & 0x1F;
+            return nalType == 5 || nalType == 7;
+        case 28:  // FU-A
+            if (length < 2) {
+                return false;
+            }
+            return (byteAt(payload, 1) & 0x80) && (byteAt(payload, 1) & 0x1F) == 5;
+        default:
+            return false;
+    }
+}
+
+}  // namespace rtp
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+
+// Pre-packetized RTP clip stored on disk and played back from an mmap.
+//
+// File layout, host byte order:
+//   RtpCacheHeader
+//   packet bytes, back to back
+//   RtpCachePacket[packetCount]
+//   RtpCacheFrame[frameCount]
+// The header is written last, so a partially written file never validates.
+
+struct RtpCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clockRate;
+    uint64_t sourceSize;     // size and mtime of the file this was built from
+    int64_t sourceMtime;
+    uint32_t packetCount;
+    uint32_t frameCount;
+    uint64_t loopTicks;      // RTP ticks per loop, including the last frame
+    uint64_t packetTableOffset;
+    uint64_t frameTableOffset;
+};
+
+struct RtpCachePacket {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t frame;
+};
+
+struct RtpCacheFrame {
+    uint32_t firstPacket;
+    uint32_t packetCount;
+    int64_t timestampDelta;  // RTP ticks since the first frame, negative for one presented before it
+    uint32_t keyframe;
+    uint32_t reserved;
+};
+
+constexpr char kRtpCacheMagic[8] = {'R', 'T', 'P', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t kRtpCacheVersion = 1;
+
+// Streams packets from a packetizer into a new cache file. Frames are split
+// on RTP timestamp changes.
+class RtpFileCacheWriter {
+public:
+    RtpFileCacheWriter(const std::string& path, const std::string& sourcePath)
+        : path(path), tmpPath(path + ".tmp"), out(tmpPath, std::ios::binary | std::ios::trunc) {
+        if (!out) {
+            throw std::runtime_error("Cannot create RTP cache file: " + tmpPath);
+        }
+        std::memset(&header, 0, sizeof(header));
+        struct stat st;
+        if (stat(sourcePath.c_str(), &st) == 0) {
+            header.sourceSize = static_cast<uint64_t>(st.st_size);
+            header.sourceMtime = static_cast<int64_t>(st.st_mtime);
+        }
+        header.clockRate = 90000;
+        // Placeholder, rewritten by finish().
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        offset = sizeof(header);
+    }
+
+    ~RtpFileCacheWriter() {
+        if (!finished) {
+            out.close();
+            std::remove(tmpPath.c_str());
+        }
+    }
+
+    void append(const std::byte *data, size_t size) {
+        if (!rtp::isValid(data, size)) {
+            return;
+        }
+        uint32_t timestamp = rtp::timestamp(data);
+        if (frames.empty() || timestamp != lastTimestamp) {
+            if (frames.empty()) {
+                unwrapped = 0;
+            } else {
+                // Frames in decode order may step back in time
+                unwrapped += static_cast<int32_t>(timestamp - lastTimestamp);
+            }
+            lastTimestamp = timestamp;
+            frames.push_back({static_cast<uint32_t>(packets.size()), 0, unwrapped, 0, 0});
+        }
+        RtpCacheFrame& frame = frames.back();
+        frame.packetCount++;
+        if (rtp::isH264KeyframeStart(data, size)) {
+            frame.keyframe = 1;
+        }
+
+        packets.push_back({offset, static_cast<uint32_t>(size), static_cast<uint32_t>(frames.size() - 1)});
+        out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+        offset += size;
+    }
+
+    size_t packetCount() const { return packets.size(); }
+
+    void finish() {
+        if (packets.empty()) {
+            throw std::runtime_error("RTP cache is empty, nothing was packetized");
+        }
+
+        // One loop lasts up to the latest frame plus one average frame interval.
+        int64_t span = 0;
+        for (const RtpCacheFrame& frame : frames) {
+            span = std::max(span, frame.timestampDelta);
+        }
+        uint64_t frameInterval = frames.size() > 1 && span > 0 ? span / (frames.size() - 1) : 3000;
+        header.loopTicks = static_cast<uint64_t>(span) + frameInterval;
+
+        std::memcpy(header.magic, kRtpCacheMagic, sizeof(kRtpCacheMagic));
+        header.version = kRtpCacheVersion;
+        header.packetCount = static_cast<uint32_t>(packets.size());
+        header.frameCount = static_cast<uint32_t>(frames.size());
+        header.packetTableOffset = offset;
+        out.write(reinterpret_cast<const char*>(packets.data()),
+                  static_cast<std::streamsize>(packets.size() * sizeof(RtpCachePacket)));
+        offset += packets.size() * sizeof(RtpCachePacket);
+        header.frameTableOffset = offset;
+        out.write(reinterpret_cast<const char*>(frames.data()),
+                  static_cast<std::streamsize>(frames.size() * sizeof(RtpCacheFrame)));
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed writing RTP cache file: " + tmpPath);
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Failed to move RTP cache into place: " + path);
+        }
+        finished = true;
+    }
+
+private:
+    std::string path;
+    std::string tmpPath;
+    std::ofstream out;
+    RtpCacheHeader header;
+    std::vector<RtpCachePacket> packets;
+    std::vector<RtpCacheFrame> frames;
+    uint64_t offset = 0;
+    uint32_t lastTimestamp = 0;
+    int64_t unwrapped = 0;
+    bool finished = false;
+};
+
+// Read-only mmap of a cache file.
+class RtpFileCache {
+public:
+    RtpFileCache() {}
+    ~RtpFileCache() { close(); }
+
+    RtpFileCache(const RtpFileCache&) = delete;
+    RtpFileCache& operator=(const RtpFileCache&) = delete;
+
+    // True when `cachePath` is a valid cache built from the current
+    // contents (size and mtime) of `sourcePath`.
+    static bool isFresh(const std::string& cachePath, const std::string& sourcePath) {
+        struct stat st;
+        if (stat(sourcePath.c_str(), &st) != 0) {
+            return false;
+        }
+        std::ifstream in(cachePath, std::ios::binary);
+        RtpCacheHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+        return std::memcmp(header.magic, kRtpCacheMagic, sizeof(kRtpCacheMagic)) == 0 &&
+               header.version == kRtpCacheVersion &&
+               header.sourceSize == static_cast<uint64_t>(st.st_size) &&
+               header.sourceMtime == static_cast<int64_t>(st.st_mtime);
+    }
+
+    void open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open RTP cache file: " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RtpCacheHeader)) {
+            ::close(fd);
+            throw std::runtime_error("RTP cache file is truncated: " + path);
+        }
+        mappedSize = static_cast<size_t>(st.st_size);
+        void *mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            mappedSize = 0;
+            throw std::runtime_error("Cannot mmap RTP cache file: " + path);
+        }
+        base = static_cast<const std::byte*>(mapped);
+        madvise(mapped, mappedSize, MADV_WILLNEED);
+
+        header = reinterpret_cast<const RtpCacheHeader*>(base);
+        uint64_t packetTableEnd = header->packetTableOffset + uint64_t(header->packetCount) * sizeof(RtpCachePacket);
+        uint64_t frameTableEnd = header->frameTableOffset + uint64_t(header->frameCount) * sizeof(RtpCacheFrame);
+        if (std::memcmp(header->magic, kRtpCacheMagic, sizeof(kRtpCacheMagic)) != 0 ||
+            header->version != kRtpCacheVersion || header->clockRate == 0 || header->packetCount == 0 ||
+            header->frameCount == 0 || packetTableEnd > mappedSize || frameTableEnd > mappedSize) {
+            close();
+            throw std::runtime_error("Invalid RTP cache file: " + path);
+        }
+        packetTable = reinterpret_cast<const RtpCachePacket*>(base + header->packetTableOffset);
+        frameTable = reinterpret_cast<const RtpCacheFrame*>(base + header->frameTableOffset);
+        for (uint32_t i = 0; i < header->packetCount; ++i) {
+            if (packetTable[i].offset + packetTable[i].size > header->packetTableOffset) {
+                close();
+                throw std::runtime_error("Corrupt packet table in RTP cache file: " + path);
+            }
+        }
+        for (uint32_t i = 0; i < header->frameCount; ++i) {
+            if (uint64_t(frameTable[i].firstPacket) + frameTable[i].packetCount > header->packetCount) {
+                close();
+                throw std::runtime_error("Corrupt frame table in RTP cache file: " + path);
+            }
+        }
+    }
+
+    void close() {
+        if (base) {
+            munmap(const_cast<std::byte*>(base), mappedSize);
+        }
+        base = nullptr;
+        header = nullptr;
+        mappedSize = 0;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    const RtpCacheHeader& info() const { return *header; }
+    const RtpCacheFrame& frame(uint32_t index) const { return frameTable[index]; }
+    const RtpCachePacket& packet(uint32_t index) const { return packetTable[index]; }
+    const std::byte* packetData(uint32_t index) const { return base + packetTable[index].offset; }
+
+private:
+    const std::byte *base = nullptr;
+    size_t mappedSize = 0;
+    const RtpCacheHeader *header = nullptr;
+    const RtpCachePacket *packetTable = nullptr;
+    const RtpCacheFrame *frameTable = nullptr;
+};
+
+// Plays a cache in a loop on its own thread, paced by the frame timing
+// table, handing each frame's packets to the sink together. Sequence
+// numbers and timestamps continue across loops so viewers see one endless
+// stream.
+class RtpCachePlayer {
+public:
+    using FrameSink = std::function<void(const std::vector<RtpPacketRef>& frame)>;
+
+    RtpCachePlayer(const RtpFileCache& cache, FrameSink sink) : cache(cache), sink(std::move(sink)) {}
+    ~RtpCachePlayer() { stop(); }
+
+    void start() {
+        stop();
+        stopping = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    uint64_t loops() const { return loopCount.load(std::memory_order_relaxed); }
+
+private:
+    void run() {
+        const RtpCacheHeader& info = cache.info();
+        const std::byte *first = cache.packetData(0);
+        uint16_t sequence = rtp::sequenceNumber(first);
+        const uint32_t timestampBase = rtp::timestamp(first);
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<RtpPacketRef> packets;
+
+        for (uint64_t loop = 0;; ++loop) {
+            loopCount.store(loop, std::memory_order_relaxed);
+            for (uint32_t f = 0; f < info.frameCount; ++f) {
+                const RtpCacheFrame& frame = cache.frame(f);
+                int64_t ticks = static_cast<int64_t>(loop * info.loopTicks) + frame.timestampDelta;
+                auto due = start + std::chrono::microseconds(std::max<int64_t>(ticks, 0) * 1000000 / info.clockRate);
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (cv.wait_until(lock, due, [this]() { return stopping; })) {
+                        return;
+                    }
+                }
+
+                uint32_t timestamp = timestampBase + static_cast<uint32_t>(ticks);
+                packets.clear();
+                for (uint32_t p = frame.firstPacket; p < frame.firstPacket + frame.packetCount; ++p) {
+                    uint16_t seq = sequence++;
+                    RtpPacketRef packet = RtpPacket::copyOf(
+                        cache.packetData(p), cache.packet(p).size, [seq, timestamp](std::byte *bytes, size_t) {
+                            rtp::setSequenceNumber(bytes, seq);
+                            rtp::setTimestamp(bytes, timestamp);
+                        });
+                    if (packet) {
+                        packets.push_back(std::move(packet));
+                    }
+                }
+                if (!packets.empty()) {
+                    sink(packets);
+                }
+            }
+        }
+    }
+
+    const RtpFileCache& cache;
+    FrameSink sink;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::atomic<uint64_t> loopCount{0};
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "rtp.hpp"
+
+class RtpPacketRef;
+
+// Immutable RTP packet shared by every viewer's send.
+//
+// The bytes either stay inside the GstBuffer they came from (the buffer is
+// referenced and kept mapped for the lifetime of the packet) or are copied
+// once into a pooled slab. Packet objects are recycled through a free list,
+// and references are intrusive, so handing one packet to N viewers costs N
+// refcount increments and no heap allocation.
+class RtpPacket {
+public:
+    static constexpr size_t kSlabSize = 2048;
+
+    // Wrap a GstBuffer without copying when it is backed by a single memory
+    // block; multi-memory buffers (rtph264pay appends the payload to the
+    // header) are flattened into a pooled slab instead of being merged by
+    // gst_buffer_map, which would allocate.
+    static RtpPacketRef fromGstBuffer(GstBuffer *buffer);
+
+    // Always a pooled copy, with an abs-capture-time header extension
+    // inserted after the CSRCs. Packets that already carry an extension are
+    // copied as they are.
+    static RtpPacketRef fromGstBuffer(GstBuffer *buffer, uint64_t captureNtp);
+
+    // One pooled copy of raw bytes, used by sources that are not GStreamer.
+    static RtpPacketRef copyOf(const std::byte *data, size_t size);
+
+    // Same, but `edit(std::byte *bytes, size_t size)` may rewrite the copy
+    // (e.g. sequence number or timestamp) before it is shared.
+    template <typename Edit>
+    static RtpPacketRef copyOf(const std::byte *data, size_t size, Edit&& edit);
+
+    // A pooled packet of `size` bytes written by `fill(std::byte *bytes)`,
+    // for packets assembled rather than copied (RED, FEC).
+    template <typename Fill>
+    static RtpPacketRef create(size_t size, Fill&& fill);
+
+    const std::byte* data() const { return bytes; }
+    size_t size() const { return length; }
+    // When the packet entered the process: appsink arrival, cache read or
+    // receipt from an upstream sender.
+    std::chrono::steady_clock::time_point createdAt() const { return created; }
+
+private:
+    friend class RtpPacketRef;
+    friend class RtpPacketPool;
+
+    RtpPacket() = default;
+    RtpPacket(const RtpPacket&) = delete;
+    RtpPacket& operator=(const RtpPacket&) = delete;
+
+    void retain() const { refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() const;
+    void clear();
+
+    mutable std::atomic<uint32_t> refs{0};
+    GstBuffer *buffer = nullptr;
+    GstMapInfo map{};
+    const std::byte *bytes = nullptr;
+    size_t length = 0;
+    std::chrono::steady_clock::time_point created;
+    alignas(8) std::byte slab[kSlabSize];
+};
+
+// Process-wide free list of packet objects. Grows to the peak number of
+// packets in flight and never shrinks. Intentionally never destroyed so
+// packets still queued in static objects can be released during exit.
+class RtpPacketPool {
+public:
+    static RtpPacketPool& instance() {
+        static RtpPacketPool *pool = new RtpPacketPool();
+        return *pool;
+    }
+
+    RtpPacket* acquire() {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!freeList.empty()) {
+                RtpPacket *packet = freeList.back();
+                freeList.pop_back();
+                packet->refs.store(1, std::memory_order_relaxed);
+                packet->created = now;
+                return packet;
+            }
+            ++allocated;
+        }
+        RtpPacket *packet = new RtpPacket();
+        packet->refs.store(1, std::memory_order_relaxed);
+        packet->created = now;
+        return packet;
+    }
+
+    void recycle(RtpPacket *packet) {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeList.push_back(packet);
+    }
+
+    size_t allocatedCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocated;
+    }
+
+private:
+    RtpPacketPool() { freeList.reserve(1024); }
+
+    std::vector<RtpPacket*> freeList;
+    size_t allocated = 0;
+    std::mutex mutex;
+};
+
+// Intrusive reference to an RtpPacket.
+class RtpPacketRef {
+public:
+    RtpPacketRef() = default;
+    ~RtpPacketRef() { reset(); }
+
+    RtpPacketRef(const RtpPacketRef& other) : packet(other.packet) {
+        if (packet) {
+            packet->retain();
+        }
+    }
+
+    RtpPacketRef(RtpPacketRef&& other) noexcept : packet(std::exchange(other.packet, nullptr)) {}
+
+    RtpPacketRef& operator=(const RtpPacketRef& other) {
+        if (this != &other) {
+            RtpPacketRef(other).swap(*this);
+        }
+        return *this;
+    }
+
+    RtpPacketRef& operator=(RtpPacketRef&& other) noexcept {
+        RtpPacketRef(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void swap(RtpPacketRef& other) noexcept { std::swap(packet, other.packet); }
+
+    void reset() {
+        if (packet) {
+            std::exchange(packet, nullptr)->release();
+        }
+    }
+
+    const RtpPacket* get() const { return packet; }
+    const RtpPacket* operator->() const { return packet; }
+    const RtpPacket& operator*() const { return *packet; }
+    explicit operator bool() const { return packet != nullptr; }
+
+private:
+    friend class RtpPacket;
+
+    // Adopts the reference returned by RtpPacketPool::acquire().
+    explicit RtpPacketRef(RtpPacket *adopted) : packet(adopted) {}
+
+    RtpPacket *packet = nullptr;
+};
+
+inline void RtpPacket::release() const {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        RtpPacket *self = const_cast<RtpPacket*>(this);
+        self->clear();
+        RtpPacketPool::instance().recycle(self);
+    }
+}
+
+inline void RtpPacket::clear() {
+    if (buffer) {
+        gst_buffer_unmap(buffer, &map);
+        gst_buffer_unref(buffer);
+        buffer = nullptr;
+    }
+    bytes = nullptr;
+    length = 0;
+}
+
+inline RtpPacketRef RtpPacket::fromGstBuffer(GstBuffer *source) {
+    if (!source) {
+        return {};
+    }
+
+    if (gst_buffer_n_memory(source) != 1) {
+        gsize size = gst_buffer_get_size(source);
+        if (size > kSlabSize) {
+            return {};
+        }
+        RtpPacketRef ref(RtpPacketPool::instance().acquire());
+        RtpPacket *packet = ref.packet;
+        packet->length = gst_buffer_extract(source, 0, packet->slab, size);
+        packet->bytes = packet->slab;
+        return ref;
+    }
+
+    RtpPacketRef ref(RtpPacketPool::instance().acquire());
+    RtpPacket *packet = ref.packet;
+    if (!gst_buffer_map(source, &packet->map, GST_MAP_READ)) {
+        return {};
+    }
+    packet->buffer = gst_buffer_ref(source);
+    packet->bytes = reinterpret_cast<const std::byte*>(packet->map.data);
+    packet->length = packet->map.size;
+    return ref;
+}
+
+inline RtpPacketRef RtpPacket::fromGstBuffer(GstBuffer *source, uint64_t captureNtp) {
+    if (!source) {
+        return {};
+    }
+    gsize size = gst_buffer_get_size(source);
+    if (size + rtp::kAbsCaptureTimeSize > kSlabSize) {
+        return {};
+    }
+    // Extract past room for the extension, then move the header in front of it
+    RtpPacketRef ref(RtpPacketPool::instance().acquire());
+    RtpPacket *packet = ref.packet;
+    std::byte *extracted = packet->slab + rtp::kAbsCaptureTimeSize;
+    packet->length = gst_buffer_extract(source, 0, extracted, size);
+    packet->bytes = extracted;
+    if (!rtp::isValid(extracted, packet->length) || (rtp::byteAt(extracted, 0) & 0x10)) {
+        return ref;
+    }
+    size_t header = rtp::kHeaderSize + 4 * (rtp::byteAt(extracted, 0) & 0x0F);
+    if (header > packet->length) {
+        return ref;
+    }
+    std::memmove(packet->slab, extracted, header);
+    packet->slab[0] |= std::byte(0x10);
+    rtp::writeAbsCaptureTime(packet->slab + header, captureNtp);
+    packet->bytes = packet->slab;
+    packet->length += rtp::kAbsCaptureTimeSize;
+    return ref;
+}
+
+inline RtpPacketRef RtpPacket::copyOf(const std::byte *data, size_t size) {
+    if (!data || size > kSlabSize) {
+        return {};
+    }
+    RtpPacketRef ref(RtpPacketPool::instance().acquire());
+    RtpPacket *packet = ref.packet;
+    std::memcpy(packet->slab, data, size);
+    packet->bytes = packet->slab;
+    packet->length = size;
+    return ref;
+}
+
+template <typename Edit>
+inline RtpPacketRef RtpPacket::copyOf(const std::byte *data, size_t size, Edit&& edit) {
+    RtpPacketRef ref = copyOf(data, size);
+    if (ref) {
+        RtpPacket *packet = ref.packet;
+        edit(packet->slab, packet->length);
+    }
+    return ref;
+}
+
+template <typename Fill>
+inline RtpPacketRef RtpPacket::create(size_t size, Fill&& fill) {
+    if (size > kSlabSize) {
+        return {};
+    }
+    RtpPacketRef ref(RtpPacketPool::instance().acquire());
+    RtpPacket *packet = ref.packet;
+    fill(packet->slab);
+    packet->bytes = packet->slab;
+    packet->length = size;
+    return ref;
+}
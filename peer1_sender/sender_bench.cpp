@@ -0,0 +1,1754 @@
+// In-process load test of the sender's fan-out path over loopback. A
+// videotestsrc pipeline feeds a PeerConnectionManager the way main.cpp
+// feeds a channel; a stand-in for the signaling server connects it to N
+// headless libdatachannel viewers, which count, validate and time what
+// they receive. Each scenario prints one JSON line, so runs can be kept and
+// compared with --baseline.
+#include <rtc/rtc.hpp>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "fanout_engine.hpp"
+#include "fec_encoder.hpp"
+#include "latency_stats.hpp"
+#include "logger.hpp"
+#include "peer_connection_manager.hpp"
+#include "rtp.hpp"
+#include "rtp_packet.hpp"
+#include "strand_executor.hpp"
+
+using json = nlohmann::json;
+
+inline LogCategory benchLog("bench");
+
+// Heap allocations made by threads that opt in. The ingest thread does, so a
+// run shows whether the path from appsink to the viewer queues allocates
+// per packet per viewer or only per packet.
+static std::atomic<uint64_t> countedAllocations{0};
+static thread_local bool countAllocations = false;
+
+void *operator new(std::size_t size) {
+    if (countAllocations) {
+        countedAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void *memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete[](void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void *memory, std::size_t) noexcept { std::free(memory); }
+
+struct BenchOptions {
+    std::vector<size_t> viewerCounts{1, 10, 100, 1000};
+    std::chrono::seconds duration{10};
+    double joinRate = 100;  // joins per second
+    std::chrono::seconds joinTimeout{30};
+    guint width = 640;
+    guint height = 360;
+    guint fps = 30;
+    guint bitrateKbps = 1000;
+    std::string videoPath;  // an MP4 to stream instead of videotestsrc
+    bool passthrough = false;  // send videoPath's H.264 as it is
+    size_t poolSize = 8;
+    size_t signalingThreads = 4;
+    FanoutConfig fanout;
+    std::string outputPath;
+    std::string baselinePath;
+    double tolerance = 0.2;  // relative slack before a metric counts as a regression
+    LogLevel logLevel = LogLevel::Warn;
+    std::optional<unsigned> fecPercent;  // ULPFEC/RED on the sender
+    double lossRate = 0;   // simulated at each viewer once it has video
+    double lossBurst = 1;  // mean packets per loss burst
+    bool nack = false;     // viewers ask for what the loss model drops
+    uint32_t capKbps = 0;  // simulated bottleneck in front of each viewer
+    bool adaptiveBitrate = false;
+    uint32_t maxBitrateKbps = 2500;
+    size_t channels = 1;            // senders, each with its own pipeline and manager
+    bool enginePerChannel = false;  // a fan-out engine each, as one process per channel would have
+    std::chrono::seconds churn{0};  // soak instead of the scenarios
+    double churnRate = 10;          // replaced viewers per second while soaking
+};
+
+// A bottleneck link: a token bucket holding 100 ms at `kbps`, tail-dropping
+// what does not fit.
+class RateCap {
+public:
+    explicit RateCap(uint32_t kbps) : bytesPerSecond(kbps * 1000.0 / 8), tokens(bytesPerSecond / 10) {}
+
+    bool admit(size_t size, std::chrono::steady_clock::time_point now) {
+        if (filledAt.time_since_epoch().count() != 0) {
+            double seconds = std::chrono::duration<double>(now - filledAt).count();
+            tokens = std::min(bytesPerSecond / 10, tokens + seconds * bytesPerSecond);
+        }
+        filledAt = now;
+        if (size > tokens) {
+            return false;
+        }
+        tokens -= size;
+        return true;
+    }
+
+private:
+    const double bytesPerSecond;
+    double tokens;
+    std::chrono::steady_clock::time_point filledAt{};
+};
+
+// Simulated packet loss: a Gilbert-Elliott channel that loses every packet
+// in its bad state, with mean loss `rate` and mean burst `burst` packets.
+class LossModel {
+public:
+    LossModel(double rate, double burst, uint32_t seed)
+        : enterBad(rate < 1 ? rate / (burst * (1 - rate)) : 1), leaveBad(1 / burst), random(seed) {}
+
+    bool drop() {
+        double draw = std::uniform_real_distribution<double>(0, 1)(random);
+        bad = bad ? draw >= leaveBad : draw < enterBad;
+        return bad;
+    }
+
+private:
+    const double enterBad;
+    const double leaveBad;
+    std::mt19937 random;
+    bool bad = false;
+};
+
+// Scores ULPFEC against simulated loss, frame by frame. It sees every packet
+// before the loss model decides, rebuilds what it can from the packets that
+// were kept, and checks each rebuilt packet against the one that was lost.
+class FecScore {
+public:
+    struct Counters {
+        uint64_t frames;
+        uint64_t framesIntact;     // nothing lost
+        uint64_t framesRecovered;  // every lost packet rebuilt
+        uint64_t mediaPackets;
+        uint64_t mediaLost;
+        uint64_t mediaUnrecovered;
+        uint64_t mediaBytes;
+        uint64_t fecBytes;
+        uint64_t mismatches;       // rebuilt packets that differ from the original
+    };
+
+    void add(const std::byte *data, size_t size, bool dropped) {
+        uint32_t timestamp = rtp::timestamp(data);
+        if (inFrame && timestamp != frameTimestamp) {
+            finishFrame();
+        }
+        inFrame = true;
+        frameTimestamp = timestamp;
+        if (rtp::isUlpfec(data, size)) {
+            totals.fecBytes += size;
+            if (!dropped) {
+                fec.emplace_back(data, data + size);
+            }
+            return;
+        }
+        // FEC covers media as it is without RED
+        std::vector<std::byte> plain(data, data + size);
+        if (rtp::payloadType(data) == rtp::kRedPayloadType) {
+            plain.resize(rtp::unwrapRed(data, size, plain.data()));
+            if (plain.empty()) {
+                return;
+            }
+        }
+        ++totals.mediaPackets;
+        totals.mediaBytes += size;
+        if (dropped) {
+            ++totals.mediaLost;
+            lost[rtp::sequenceNumber(data)] = std::move(plain);
+        } else {
+            media[rtp::sequenceNumber(data)] = std::move(plain);
+        }
+    }
+
+    Counters counters() const { return totals; }
+
+private:
+    void finishFrame() {
+        ++totals.frames;
+        if (lost.empty()) {
+            ++totals.framesIntact;
+        } else {
+            for (bool progress = true; progress && !lost.empty();) {
+                progress = false;
+                for (const std::vector<std::byte>& packet : fec) {
+                    progress = recover(packet) || progress;
+                }
+            }
+            totals.mediaUnrecovered += lost.size();
+            totals.framesRecovered += lost.empty();
+        }
+        media.clear();
+        lost.clear();
+        fec.clear();
+    }
+
+    static uint32_t read(const std::byte *data, size_t bytes) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value = (value << 8) | rtp::byteAt(data, i);
+        }
+        return value;
+    }
+
+    // Rebuilds the one packet `packet` protects that is missing, if exactly
+    // one is (RFC 5109 section 8).
+    bool recover(const std::vector<std::byte>& packet) {
+        const std::byte *data = packet.data();
+        size_t size = packet.size();
+        size_t offset = rtp::payloadOffset(data, size) + 1;
+        if (offset + rtp::kFecHeaderSize + 4 > size) {
+            return false;
+        }
+        const std::byte *header = data + offset;
+        size_t levelHeader = (rtp::byteAt(header, 0) & 0x40) ? 8 : 4;
+        const std::byte *level = header + rtp::kFecHeaderSize;
+        size_t protectedLength = read(level, 2);
+        if (offset + rtp::kFecHeaderSize + levelHeader + protectedLength > size) {
+            return false;
+        }
+        uint16_t base = static_cast<uint16_t>(read(header + 2, 2));
+        std::vector<uint16_t> covered;
+        for (size_t bit = 0; bit < (levelHeader - 2) * 8; ++bit) {
+            if (rtp::byteAt(level, 2 + bit / 8) & (0x80 >> (bit % 8))) {
+                covered.push_back(static_cast<uint16_t>(base + bit));
+            }
+        }
+        size_t missingCount = 0;
+        uint16_t missing = 0;
+        for (uint16_t sequence : covered) {
+            if (!media.count(sequence)) {
+                missing = sequence;
+                ++missingCount;
+            }
+        }
+        if (missingCount != 1) {
+            return false;
+        }
+
+        uint8_t bits0 = rtp::byteAt(header, 0);
+        uint8_t bits1 = rtp::byteAt(header, 1);
+        uint32_t timestamp = read(header + 4, 4);
+        uint32_t length = read(header + 8, 2);
+        std::vector<std::byte> rebuilt(rtp::kHeaderSize + protectedLength);
+        std::memcpy(rebuilt.data() + rtp::kHeaderSize, level + levelHeader, protectedLength);
+        for (uint16_t sequence : covered) {
+            if (sequence == missing) {
+                continue;
+            }
+            const std::vector<std::byte>& other = media[sequence];
+            bits0 ^= rtp::byteAt(other.data(), 0);
+            bits1 ^= rtp::byteAt(other.data(), 1);
+            timestamp ^= rtp::timestamp(other.data());
+            length ^= other.size() - rtp::kHeaderSize;
+            for (size_t i = rtp::kHeaderSize; i < other.size() && i < rebuilt.size(); ++i) {
+                rebuilt[i] ^= other[i];
+            }
+        }
+        auto original = lost.find(missing);
+        if (rtp::kHeaderSize + length > rebuilt.size() || original == lost.end()) {
+            ++totals.mismatches;
+            return false;
+        }
+        rebuilt.resize(rtp::kHeaderSize + length);
+        rebuilt[0] = std::byte(0x80 | (bits0 & 0x3F));
+        rebuilt[1] = std::byte(bits1);
+        rtp::setSequenceNumber(rebuilt.data(), missing);
+        rtp::setTimestamp(rebuilt.data(), timestamp);
+        rtp::setSsrc(rebuilt.data(), rtp::ssrc(data));
+        if (rebuilt != original->second) {
+            ++totals.mismatches;
+        }
+        lost.erase(original);
+        media[missing] = std::move(rebuilt);
+        return true;
+    }
+
+    Counters totals{};
+    bool inFrame = false;
+    uint32_t frameTimestamp = 0;
+    std::map<uint16_t, std::vector<std::byte>> media;  // kept, without RED
+    std::map<uint16_t, std::vector<std::byte>> lost;   // dropped, to check recoveries against
+    std::vector<std::vector<std::byte>> fec;           // kept, as received
+};
+
+// Stand-in for the signaling server: hands messages between the sender
+// side and each viewer asynchronously and serially per viewer, as the
+// websocket server plus the sender's strand dispatcher would. Each message
+// is timed from post until its handler starts.
+class LoopbackSignaling {
+public:
+    void start(size_t threads) { executor.start(threads); }
+    void stop() { executor.stop(); }
+
+    // Queueing delays from here on go to a fresh set of statistics.
+    std::shared_ptr<LatencyStats> startScenario() {
+        std::lock_guard<std::mutex> lock(mutex);
+        delays = std::make_shared<LatencyStats>(65536);
+        return delays;
+    }
+
+    void post(const std::string& viewerId, std::function<void()> deliver) {
+        messages.fetch_add(1, std::memory_order_relaxed);
+        std::shared_ptr<LatencyStats> stats;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats = delays;
+        }
+        auto posted = std::chrono::steady_clock::now();
+        executor.post(viewerId, [stats, posted, deliver = std::move(deliver)]() {
+            if (stats) {
+                stats->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - posted));
+            }
+            deliver();
+        });
+    }
+
+    uint64_t messageCount() const { return messages.load(std::memory_order_relaxed); }
+
+private:
+    StrandExecutor executor;
+    std::atomic<uint64_t> messages{0};
+    std::mutex mutex;
+    std::shared_ptr<LatencyStats> delays;
+};
+
+// Join latencies and frame delays of one scenario, shared by its viewers.
+// Held by shared_ptr: late callbacks may outlive the scenario.
+struct ScenarioTimings {
+    explicit ScenarioTimings(size_t viewers) : offer(std::max<size_t>(viewers, 1)),
+                                               connected(std::max<size_t>(viewers, 1)),
+                                               firstFrame(std::max<size_t>(viewers, 1)) {}
+
+    LatencyStats offer;        // join request until the sender hands out its offer
+    LatencyStats connected;    // join request until the peer connection is up
+    LatencyStats firstFrame;   // join request until the first keyframe packet arrives
+    LatencyStats frameDelay{65536};  // abs-capture-time until a frame's last packet arrives
+    LatencyStats nackRepair{65536};  // simulated loss until the retransmission arrives
+    std::atomic<size_t> refused{0};  // joins the manager turned away
+};
+
+// A viewer's RTCP session with the simulated loss in front of it: `admit`
+// sees each RTP packet first, and the dropped ones are gone before receiver
+// reports are counted, as they would be on a lossy path. Sequence numbers
+// `admit` adds to its list are asked for again with one generic NACK. The
+// sender sends no SR to answer, so a receiver report goes out every second,
+// as a browser's would.
+class LossyReceivingSession : public rtc::RtcpReceivingSession {
+public:
+    using Admit = std::function<bool(const std::byte *data, size_t size, std::vector<uint16_t>& nacks)>;
+
+    explicit LossyReceivingSession(Admit admit) : admit(std::move(admit)) {}
+
+    void incoming(rtc::message_vector& messages, const rtc::message_callback& send) override {
+        std::vector<uint16_t> nacks;
+        uint32_t mediaSsrc = 0;
+        messages.erase(std::remove_if(messages.begin(), messages.end(), [&](const rtc::message_ptr& message) {
+            if (!message || message->type == rtc::Message::Control || !rtp::isValid(message->data(), message->size())) {
+                return false;
+            }
+            mediaSsrc = rtp::ssrc(message->data());
+            if (!admit(message->data(), message->size(), nacks)) {
+                return true;
+            }
+            count(rtp::sequenceNumber(message->data()));
+            return false;
+        }), messages.end());
+        RtcpReceivingSession::incoming(messages, send);
+        if (!nacks.empty()) {
+            send(nack(mediaSsrc, nacks));
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (received > 0 && now - reportedAt >= std::chrono::seconds(1)) {
+            reportedAt = now;
+            send(receiverReport(mediaSsrc));
+        }
+    }
+
+private:
+    void count(uint16_t sequence) {
+        if (received++ == 0) {
+            baseSequence = highestSequence = sequence;
+            return;
+        }
+        int16_t ahead = static_cast<int16_t>(sequence - static_cast<uint16_t>(highestSequence));
+        if (ahead > 0) {
+            highestSequence += ahead;
+        }
+    }
+
+    // RFC 3550 section 6.4.2, with the loss fraction over the interval since
+    // the previous report. No jitter, and no LSR/DLSR without an SR.
+    rtc::message_ptr receiverReport(uint32_t mediaSsrc) {
+        uint64_t expected = highestSequence - baseSequence + 1;
+        uint64_t expectedInterval = expected - expectedPrior;
+        uint64_t receivedInterval = received - receivedPrior;
+        expectedPrior = expected;
+        receivedPrior = received;
+        uint8_t fraction = 0;
+        if (expectedInterval > receivedInterval) {
+            fraction = static_cast<uint8_t>(std::min<uint64_t>(255, ((expectedInterval - receivedInterval) << 8) /
+                                                                         expectedInterval));
+        }
+        uint32_t cumulative = static_cast<uint32_t>(std::min<uint64_t>(
+            expected > received ? expected - received : 0, 0x7FFFFF));
+
+        std::vector<std::byte> packet(32);
+        auto put32 = [&](size_t offset, uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                packet[offset + i] = std::byte((value >> (24 - 8 * i)) & 0xFF);
+            }
+        };
+        packet[0] = std::byte(0x81);  // V=2, one report block
+        packet[1] = std::byte(201);
+        packet[3] = std::byte(7);
+        put32(4, 1);  // sender SSRC, unused
+        put32(8, mediaSsrc);
+        put32(12, (uint32_t(fraction) << 24) | cumulative);
+        put32(16, static_cast<uint32_t>(highestSequence));
+        return rtc::make_message(packet.begin(), packet.end(), rtc::Message::Control);
+    }
+
+    // RFC 4585 generic NACK: a PID/BLP pair per run of up to 17 sequences.
+    static rtc::message_ptr nack(uint32_t mediaSsrc, std::vector<uint16_t>& sequences) {
+        std::sort(sequences.begin(), sequences.end());
+        std::vector<std::byte> packet(12);
+        auto put16 = [&](uint16_t value) {
+            packet.push_back(std::byte(value >> 8));
+            packet.push_back(std::byte(value & 0xFF));
+        };
+        for (size_t i = 0; i < sequences.size();) {
+            uint16_t pid = sequences[i++];
+            uint16_t blp = 0;
+            while (i < sequences.size() && uint16_t(sequences[i] - pid) <= 16) {
+                if (sequences[i] != pid) {
+                    blp |= uint16_t(1 << (uint16_t(sequences[i] - pid) - 1));
+                }
+                ++i;
+            }
+            put16(pid);
+            put16(blp);
+        }
+        size_t words = packet.size() / 4 - 1;
+        packet[0] = std::byte(0x81);  // V=2, FMT=1
+        packet[1] = std::byte(205);
+        packet[2] = std::byte(words >> 8);
+        packet[3] = std::byte(words & 0xFF);
+        packet[7] = std::byte(1);  // sender SSRC, unused
+        for (int i = 0; i < 4; ++i) {
+            packet[8 + i] = std::byte((mediaSsrc >> (24 - 8 * i)) & 0xFF);
+        }
+        return rtc::make_message(packet.begin(), packet.end(), rtc::Message::Control);
+    }
+
+    const Admit admit;
+    // Transport thread only
+    uint64_t received = 0;
+    uint64_t baseSequence = 0;
+    uint64_t highestSequence = 0;  // extended with wrap-arounds
+    uint64_t expectedPrior = 0;
+    uint64_t receivedPrior = 0;
+    std::chrono::steady_clock::time_point reportedAt{};
+};
+
+// One receiving peer. Answers the sender's offer and checks every RTP
+// packet: version, payload type and SSRC, with loss from the extended
+// highest sequence number as in RFC 3550.
+class HeadlessViewer : public std::enable_shared_from_this<HeadlessViewer> {
+public:
+    using Reply = std::function<void(const std::string& message)>;
+
+    struct Counters {
+        uint64_t received;
+        uint64_t expected;
+        uint64_t bytes;
+        uint64_t invalid;
+        FecScore::Counters fec;
+        uint64_t nackRequests;   // sequences asked for, again included
+        uint64_t nackRepaired;   // dropped packets that arrived after all
+        uint64_t nackAbandoned;  // given up on after kNackTries or kNackTimeout
+    };
+
+    // With `loss`, packets are dropped once video has started, and every
+    // frame is scored against FEC; `cap` drops what exceeds its rate on top.
+    // With `nack`, dropped packets are asked for again; retransmissions go
+    // through the same loss.
+    HeadlessViewer(std::string viewerId, std::shared_ptr<ScenarioTimings> scenarioTimings,
+                   std::unique_ptr<LossModel> loss, bool nack = false, std::unique_ptr<RateCap> cap = nullptr)
+        : id(std::move(viewerId)), timings(std::move(scenarioTimings)), joinRequestedAt(std::chrono::steady_clock::now()),
+          lossModel(std::move(loss)), rateCap(std::move(cap)), nack(nack) {}
+
+    // Signaling strand.
+    void acceptOffer(const std::string& sdp, Reply sendAnswer, Reply sendCandidate) {
+        std::weak_ptr<HeadlessViewer> self = weak_from_this();
+        // Loopback only: host candidates, no STUN
+        pc = std::make_shared<rtc::PeerConnection>(rtc::Configuration());
+        pc->onLocalDescription([sendAnswer](rtc::Description description) {
+            sendAnswer(std::string(description));
+        });
+        pc->onLocalCandidate([sendCandidate](rtc::Candidate candidate) {
+            sendCandidate(std::string(candidate));
+        });
+        pc->onStateChange([self](rtc::PeerConnection::State state) {
+            auto viewer = self.lock();
+            if (!viewer || state != rtc::PeerConnection::State::Connected || viewer->connected.exchange(true)) {
+                return;
+            }
+            viewer->timings->connected.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - viewer->joinRequestedAt));
+        });
+        pc->onTrack([self](std::shared_ptr<rtc::Track> track) {
+            track->setMediaHandler(std::make_shared<LossyReceivingSession>(
+                [self](const std::byte *data, size_t size, std::vector<uint16_t>& nacks) {
+                    auto viewer = self.lock();
+                    return !viewer || viewer->admit(data, size, nacks);
+                }));
+            track->onMessage([self](rtc::binary message) {
+                if (auto viewer = self.lock()) {
+                    viewer->onPacket(message.data(), message.size());
+                }
+            }, nullptr);
+        });
+        pc->setRemoteDescription(rtc::Description(sdp, "offer"));
+        for (const std::string& candidate : pendingCandidates) {
+            addCandidate(candidate);
+        }
+        pendingCandidates.clear();
+    }
+
+    // Sender side, when its offer for this viewer is ready to send.
+    void offerSent() {
+        if (!offered.exchange(true)) {
+            timings->offer.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - joinRequestedAt));
+        }
+    }
+
+    // Signaling strand.
+    void addCandidate(const std::string& candidate) {
+        if (!pc) {
+            pendingCandidates.push_back(candidate);
+            return;
+        }
+        try {
+            pc->addRemoteCandidate(rtc::Candidate(candidate));
+        } catch (const std::exception& e) {
+            log_warn(benchLog, {{"viewer", id}}, "Error adding candidate: ", e.what());
+        }
+    }
+
+    // Signaling strand.
+    void close() {
+        if (pc) {
+            pc->close();
+        }
+    }
+
+    Counters counters() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {received, started ? highestSequence - baseSequence + 1 : 0, bytes,
+                invalid.load(std::memory_order_relaxed), score.counters(), nackRequests, nackRepaired,
+                nackAbandoned};
+    }
+
+    bool isConnected() const { return connected.load(std::memory_order_relaxed); }
+    bool hasVideo() const { return firstKeyframe.load(std::memory_order_relaxed); }
+
+    const std::string id;
+
+private:
+    static constexpr unsigned kNackTries = 3;
+    static constexpr std::chrono::seconds kNackTimeout{1};
+
+    struct Missing {
+        std::chrono::steady_clock::time_point lostAt;
+        unsigned tries;
+    };
+
+    // Transport thread, before the RTCP session. False drops the packet.
+    bool admit(const std::byte *data, size_t size, std::vector<uint16_t>& nacks) {
+        if (!lossModel || !firstKeyframe.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint16_t sequence = rtp::sequenceNumber(data);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = missing.begin(); it != missing.end();) {
+            if (now - it->second.lostAt > kNackTimeout) {
+                ++nackAbandoned;
+                it = missing.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        bool dropped = lossModel->drop();
+        if (rateCap && !rateCap->admit(size, now)) {
+            dropped = true;
+        }
+        auto retransmission = missing.find(sequence);
+        if (retransmission != missing.end()) {
+            if (!dropped) {
+                ++nackRepaired;
+                timings->nackRepair.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - retransmission->second.lostAt));
+                missing.erase(retransmission);
+            } else if (retransmission->second.tries < kNackTries) {
+                ++retransmission->second.tries;
+                ++nackRequests;
+                nacks.push_back(sequence);
+            }
+            return !dropped;
+        }
+        // Retransmissions would be scored as frames of their own
+        score.add(data, size, dropped);
+        if (dropped && nack) {
+            missing[sequence] = {now, 1};
+            ++nackRequests;
+            nacks.push_back(sequence);
+        }
+        return !dropped;
+    }
+
+    void onPacket(const std::byte *data, size_t size) {
+        // RTCP shares the port (RFC 5761)
+        if (size >= 2 && rtp::byteAt(data, 1) >= 192 && rtp::byteAt(data, 1) <= 223) {
+            return;
+        }
+        bool red = rtp::isValid(data, size) && rtp::payloadType(data) == rtp::kRedPayloadType;
+        if (!rtp::isValid(data, size) || rtp::payloadOffset(data, size) == 0 ||
+            (red ? rtp::redBlockType(data, size) < 0 : rtp::payloadType(data) != rtp::kH264PayloadType)) {
+            invalid.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint16_t sequence = rtp::sequenceNumber(data);
+        uint64_t frameCaptureNtp = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!started) {
+                started = true;
+                ssrc = rtp::ssrc(data);
+                baseSequence = highestSequence = sequence;
+            } else if (rtp::ssrc(data) != ssrc) {
+                invalid.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (received > 0) {
+                int16_t ahead = static_cast<int16_t>(sequence - static_cast<uint16_t>(highestSequence));
+                if (ahead > 0) {
+                    highestSequence += ahead;
+                }
+            }
+            ++received;
+            bytes += size;
+            // The sender stamps a frame's first packet; the delay is taken
+            // at its last
+            if (uint64_t stamp = rtp::absCaptureTime(data, size)) {
+                captureNtp = stamp;
+                captureTimestamp = rtp::timestamp(data);
+            }
+            if (rtp::marker(data) && captureNtp != 0 && captureTimestamp == rtp::timestamp(data)) {
+                frameCaptureNtp = captureNtp;
+                captureNtp = 0;
+            }
+        }
+        if (!firstKeyframe.load(std::memory_order_relaxed) && rtp::isH264KeyframeStart(data, size) &&
+            !firstKeyframe.exchange(true)) {
+            timings->firstFrame.record(std::chrono::duration_cast<std::chrono::microseconds>(now - joinRequestedAt));
+        }
+        if (frameCaptureNtp != 0) {
+            auto delay = std::chrono::system_clock::now() - rtp::fromNtp(frameCaptureNtp);
+            timings->frameDelay.record(std::chrono::duration_cast<std::chrono::microseconds>(delay));
+        }
+    }
+
+    const std::shared_ptr<ScenarioTimings> timings;
+    const std::chrono::steady_clock::time_point joinRequestedAt;
+    std::shared_ptr<rtc::PeerConnection> pc;  // signaling strand only
+    std::vector<std::string> pendingCandidates;
+    std::atomic<bool> offered{false};
+    std::atomic<bool> connected{false};
+    std::atomic<bool> firstKeyframe{false};
+    std::atomic<uint64_t> invalid{0};
+
+    mutable std::mutex mutex;
+    bool started = false;
+    uint32_t ssrc = 0;
+    uint64_t baseSequence = 0;
+    uint64_t highestSequence = 0;  // extended with wrap-arounds
+    uint64_t received = 0;
+    uint64_t bytes = 0;
+    uint64_t captureNtp = 0;  // of the frame being received
+    uint32_t captureTimestamp = 0;
+    const std::unique_ptr<LossModel> lossModel;
+    const std::unique_ptr<RateCap> rateCap;
+    const bool nack;
+    FecScore score;
+    std::map<uint16_t, Missing> missing;  // dropped and asked for
+    uint64_t nackRequests = 0;
+    uint64_t nackRepaired = 0;
+    uint64_t nackAbandoned = 0;
+};
+
+// The sending half: a live videotestsrc encode feeding one
+// PeerConnectionManager, with the same fan-out engine, pool and capture-time
+// stamping as one of peer1's channels. Channels may share `engine`; without
+// one the sender starts and stops its own.
+class BenchSender {
+public:
+    using Deliver = std::function<void(const std::string& message)>;
+
+    ~BenchSender() { stop(); }
+
+    void start(const BenchOptions& options, size_t poolSize, std::shared_ptr<FanoutEngine> engine = nullptr) {
+        ownsFanout = !engine;
+        fanout = engine ? std::move(engine) : std::make_shared<FanoutEngine>();
+        if (ownsFanout) {
+            fanout->start(options.fanout);
+        }
+        peers.setIceServers({});
+        peers.offerCaptureTime(true);
+        peers.offerFec(options.fecPercent.has_value());
+        if (options.fecPercent) {
+            fec = std::make_unique<FecEncoder>();
+            fec->setProtection(*options.fecPercent);
+        }
+        if (options.adaptiveBitrate) {
+            BitrateLimits limits;
+            limits.startKbps = options.bitrateKbps;
+            limits.maxKbps = std::max(options.maxBitrateKbps, options.bitrateKbps);
+            peers.setBitrateLimits(limits);
+            controller = std::make_unique<BitrateController>(limits, 0);
+        }
+        peers.useFanout(fanout);
+        peers.startLifecycle(LifecycleConfig());
+        peers.startPool(poolSize);
+
+        GError *error = nullptr;
+        std::string description = pipeline_description(options);
+        pipeline = gst_parse_launch(description.c_str(), &error);
+        if (!pipeline) {
+            std::string message = error ? error->message : "Unknown error";
+            g_clear_error(&error);
+            throw std::runtime_error("Failed to create benchmark pipeline: " + message);
+        }
+
+        // Passthrough has no encoder to ask
+        encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+        if (encoder) {
+            std::shared_ptr<GstPad> pad(gst_element_get_static_pad(encoder, "src"), gst_object_unref);
+            peers.setKeyframeRequestHandler([pad]() {
+                gst_pad_send_event(pad.get(), gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+            }, std::chrono::milliseconds(500));
+        }
+        if (controller && encoder) {
+            abrTimer.start(std::chrono::seconds(1), [this]() { updateBitrate(); });
+        }
+
+        // A file is paced by the appsink clock, videotestsrc paces itself
+        GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "appsink");
+        g_object_set(appsink, "emit-signals", FALSE, "sync", options.videoPath.empty() ? FALSE : TRUE,
+                     "drop", FALSE, "max-buffers", 64, "buffer-list", TRUE, NULL);
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            gst_object_unref(appsink);
+            throw std::runtime_error("Failed to start benchmark pipeline");
+        }
+        reader = std::thread([this, appsink]() { readFrames(appsink); });
+    }
+
+    void stop() {
+        if (!pipeline) {
+            return;
+        }
+        stopping.store(true);
+        abrTimer.stop();
+        peers.setKeyframeRequestHandler(nullptr, std::chrono::milliseconds(500));
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        reader.join();
+        if (encoder) {
+            gst_object_unref(encoder);
+            encoder = nullptr;
+        }
+        gst_object_unref(pipeline);
+        pipeline = nullptr;
+        peers.stopLifecycle();
+        peers.stopPool();
+        peers.closeAll();
+        if (ownsFanout) {
+            fanout->stop();
+        }
+    }
+
+    // Signaling strand. Returns false when the manager refuses the viewer.
+    bool offer(const std::string& viewerId, Deliver deliverOffer, Deliver deliverCandidate) {
+        auto peerInfo = peers.createPeerConnection(viewerId, viewerId);
+        if (!peerInfo) {
+            return false;
+        }
+        peerInfo->pc->onLocalDescription([deliverOffer](rtc::Description description) {
+            deliverOffer(std::string(description));
+        });
+        peerInfo->pc->onLocalCandidate([deliverCandidate](rtc::Candidate candidate) {
+            deliverCandidate(std::string(candidate));
+        });
+        std::weak_ptr<PeerConnectionManager::PeerInfo> weakInfo = peerInfo;
+        peerInfo->pc->onStateChange([this, weakInfo](rtc::PeerConnection::State state) {
+            if (auto shared = weakInfo.lock()) {
+                peers.updatePeerState(shared, state);
+            }
+        });
+        if (peerInfo->prewarmed) {
+            if (auto description = peerInfo->pc->localDescription()) {
+                deliverOffer(std::string(*description));
+                return true;
+            }
+        }
+        peerInfo->pc->setLocalDescription();
+        return true;
+    }
+
+    // Signaling strand.
+    void acceptAnswer(const std::string& viewerId, const std::string& sdp) {
+        if (auto peerInfo = peers.getPeerInfo(viewerId)) {
+            peerInfo->pc->setRemoteDescription(rtc::Description(sdp, "answer"));
+        }
+    }
+
+    // Signaling strand.
+    void addCandidate(const std::string& viewerId, const std::string& candidate) {
+        if (auto peerInfo = peers.getPeerInfo(viewerId)) {
+            try {
+                peerInfo->pc->addRemoteCandidate(rtc::Candidate(candidate));
+            } catch (const std::exception& e) {
+                log_warn(benchLog, {{"viewer", viewerId}}, "Error adding candidate: ", e.what());
+            }
+        }
+    }
+
+    // Signaling strand.
+    void leave(const std::string& viewerId) {
+        peers.removePeerConnection(viewerId);
+    }
+
+    PeerConnectionManager peers;
+    std::shared_ptr<FanoutEngine> fanout;
+    bool ownsFanout = true;
+    std::atomic<uint64_t> ingestPackets{0};
+    std::atomic<uint64_t> ingestBytes{0};
+    // Time in sendFrameToAll: the registry read and the queue pushes
+    std::atomic<uint64_t> dispatchNanos{0};
+    std::atomic<uint64_t> dispatchPackets{0};
+    // Encoder target summed once a second, for its mean over a window
+    std::atomic<uint64_t> bitrateUpdates{0};
+    std::atomic<uint64_t> bitrateKbpsSum{0};
+
+    std::optional<BitrateController::Metrics> bitrateMetrics() {
+        std::lock_guard<std::mutex> lock(controllerMutex);
+        if (!controller) {
+            return std::nullopt;
+        }
+        return controller->metrics();
+    }
+
+private:
+    // As peer1's --abr: the weakest viewer's estimate drives x264enc, less
+    // the FEC share.
+    void updateBitrate() {
+        std::vector<uint32_t> estimates;
+        for (const ViewerBandwidthStats& viewer : peers.getBandwidthStats()) {
+            estimates.push_back(viewer.estimateKbps);
+        }
+        std::lock_guard<std::mutex> lock(controllerMutex);
+        if (controller->update(std::move(estimates))) {
+            unsigned protection = fec ? fec->getProtection() : 0;
+            g_object_set(encoder, "bitrate", static_cast<guint>(controller->target() * 100 / (100 + protection)),
+                         NULL);
+        }
+        bitrateUpdates.fetch_add(1, std::memory_order_relaxed);
+        bitrateKbpsSum.fetch_add(controller->target(), std::memory_order_relaxed);
+    }
+
+    // Frames cut at the marker bit and stamped with capture time, as in
+    // main.cpp's appsink readers.
+    void readFrames(GstElement *appsink) {
+        constexpr size_t kMaxFramePackets = 1024;
+        std::vector<RtpPacketRef> frame;
+        frame.reserve(kMaxFramePackets);
+        countAllocations = true;
+        auto append = [&](GstBuffer *buffer) {
+            RtpPacketRef packet = frame.empty()
+                                      ? RtpPacket::fromGstBuffer(buffer, rtp::toNtp(std::chrono::system_clock::now()))
+                                      : RtpPacket::fromGstBuffer(buffer);
+            if (!packet) {
+                return;
+            }
+            bool last = rtp::isValid(packet->data(), packet->size()) && rtp::marker(packet->data());
+            ingestPackets.fetch_add(1, std::memory_order_relaxed);
+            ingestBytes.fetch_add(packet->size(), std::memory_order_relaxed);
+            frame.push_back(std::move(packet));
+            if (last || frame.size() >= kMaxFramePackets) {
+                const std::vector<RtpPacketRef>& sent = fec ? fec->protect(frame) : frame;
+                auto dispatchStart = std::chrono::steady_clock::now();
+                peers.sendFrameToAll(sent);
+                dispatchNanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - dispatchStart).count(), std::memory_order_relaxed);
+                dispatchPackets.fetch_add(sent.size(), std::memory_order_relaxed);
+                frame.clear();
+            }
+        };
+        while (true) {
+            GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+            if (!sample) {
+                // A file loops until the bench stops the pipeline
+                if (stopping.load() || !gst_app_sink_is_eos(GST_APP_SINK(appsink)) ||
+                    !gst_element_seek_simple(pipeline, GST_FORMAT_TIME,
+                                             GstSeekFlags(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT), 0)) {
+                    break;
+                }
+                continue;
+            }
+            if (GstBufferList *list = gst_sample_get_buffer_list(sample)) {
+                for (guint i = 0; i < gst_buffer_list_length(list); ++i) {
+                    append(gst_buffer_list_get(list, i));
+                }
+            } else if (GstBuffer *buffer = gst_sample_get_buffer(sample)) {
+                append(buffer);
+            }
+            gst_sample_unref(sample);
+        }
+        gst_object_unref(appsink);
+    }
+
+    // videotestsrc through x264enc by default. With a file, the same two
+    // pipelines as peer1's --pipeline=passthrough and --pipeline=transcode.
+    static std::string pipeline_description(const BenchOptions& options) {
+        const std::string encode =
+            "x264enc name=encoder tune=zerolatency speed-preset=ultrafast key-int-max=" +
+            std::to_string(options.fps * 2) + " bitrate=" + std::to_string(options.bitrateKbps) + " ! "
+            "video/x-h264,profile=baseline,stream-format=byte-stream ! ";
+        const std::string payload = "rtph264pay pt=96 config-interval=-1 ! appsink name=appsink";
+        if (options.videoPath.empty()) {
+            return "videotestsrc is-live=true pattern=ball ! "
+                   "video/x-raw,width=" + std::to_string(options.width) + ",height=" +
+                   std::to_string(options.height) + ",framerate=" + std::to_string(options.fps) +
+                   "/1 ! videoconvert ! " + encode + payload;
+        }
+        const std::string source = "filesrc location=" + options.videoPath + " ! qtdemux ! ";
+        if (options.passthrough) {
+            return source + "h264parse ! video/x-h264,stream-format=byte-stream,alignment=au ! " + payload;
+        }
+        return source + "avdec_h264 ! videoconvert ! queue ! " + encode + payload;
+    }
+
+    GstElement *pipeline = nullptr;
+    GstElement *encoder = nullptr;
+    std::mutex controllerMutex;
+    std::unique_ptr<BitrateController> controller;
+    PeerReaper abrTimer;  // reused as a plain one-second timer
+    std::atomic<bool> stopping{false};
+    std::thread reader;
+    std::unique_ptr<FecEncoder> fec;  // reader thread
+};
+
+static double process_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double resident_mb() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+
+static size_t open_descriptors() {
+    size_t count = 0;
+    if (DIR *dir = opendir("/proc/self/fd")) {
+        while (readdir(dir)) {
+            ++count;
+        }
+        closedir(dir);
+    }
+    return count > 3 ? count - 3 : 0;  // ".", ".." and the directory's own
+}
+
+// Every viewer is two peer connections in this process, each with its own
+// sockets; the default limit of 1024 descriptors runs out around 300 viewers.
+static void raise_descriptor_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static json latency_json(const LatencyStats::Summary& summary) {
+    return {{"count", summary.count}, {"p50", summary.p50Ms}, {"p99", summary.p99Ms}, {"max", summary.maxMs}};
+}
+
+using Channels = std::vector<std::unique_ptr<BenchSender>>;
+
+// Viewer i watches channel i modulo the channel count.
+static BenchSender& channel_for(const Channels& channels, size_t viewer) {
+    return *channels[viewer % channels.size()];
+}
+
+static size_t registered_peers(const Channels& channels) {
+    size_t count = 0;
+    for (const auto& sender : channels) {
+        count += sender->peers.getConnectionCount();
+    }
+    return count;
+}
+
+static PeerConnectionManager::PoolStats pool_stats(const Channels& channels) {
+    PeerConnectionManager::PoolStats total{};
+    for (const auto& sender : channels) {
+        PeerConnectionManager::PoolStats stats = sender->peers.getPoolStats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+    }
+    return total;
+}
+
+static PeerConnectionManager::LifecycleStats lifecycle_stats(const Channels& channels) {
+    PeerConnectionManager::LifecycleStats total{};
+    for (const auto& sender : channels) {
+        PeerConnectionManager::LifecycleStats stats = sender->peers.getLifecycleStats();
+        total.live += stats.live;
+        total.negotiating += stats.negotiating;
+        total.zombies += stats.zombies;
+        total.evicted += stats.evicted;
+        total.timedOut += stats.timedOut;
+        total.rejected += stats.rejected;
+    }
+    return total;
+}
+
+// Sender-side totals the scenario diffs over its measurement window.
+struct SenderSnapshot {
+    std::chrono::steady_clock::time_point time;
+    double cpuSeconds;
+    uint64_t ingestPackets;
+    uint64_t ingestBytes;
+    uint64_t ingestAllocations;
+    uint64_t dispatchNanos;
+    uint64_t dispatchPackets;
+    uint64_t bitrateUpdates;
+    uint64_t bitrateKbpsSum;
+    uint64_t sent;
+    uint64_t dropped;
+    double sendSeconds;
+
+    // Summed over the channels.
+    static SenderSnapshot take(const Channels& channels) {
+        SenderSnapshot snapshot{std::chrono::steady_clock::now(), process_cpu_seconds(), 0, 0,
+                                countedAllocations.load(std::memory_order_relaxed), 0, 0, 0, 0, 0, 0, 0};
+        for (const auto& sender : channels) {
+            snapshot.ingestPackets += sender->ingestPackets.load(std::memory_order_relaxed);
+            snapshot.ingestBytes += sender->ingestBytes.load(std::memory_order_relaxed);
+            snapshot.dispatchNanos += sender->dispatchNanos.load(std::memory_order_relaxed);
+            snapshot.dispatchPackets += sender->dispatchPackets.load(std::memory_order_relaxed);
+            snapshot.bitrateUpdates += sender->bitrateUpdates.load(std::memory_order_relaxed);
+            snapshot.bitrateKbpsSum += sender->bitrateKbpsSum.load(std::memory_order_relaxed);
+            for (const ViewerQueueStats& stats : sender->peers.getQueueStats()) {
+                snapshot.sent += stats.sent;
+                snapshot.dropped += stats.dropped;
+                snapshot.sendSeconds += stats.sendSeconds;
+            }
+        }
+        return snapshot;
+    }
+};
+
+// Creates a viewer and asks the sender for an offer for it, as a browser's
+// viewer_joined would. `seed` picks its loss pattern.
+static std::shared_ptr<HeadlessViewer> join_viewer(BenchSender& sender, LoopbackSignaling& signaling,
+                                                   const std::string& viewerId,
+                                                   const std::shared_ptr<ScenarioTimings>& timings,
+                                                   const BenchOptions& options, uint32_t seed) {
+    std::unique_ptr<LossModel> loss;
+    if (options.lossRate > 0 || options.fecPercent || options.capKbps > 0) {
+        loss = std::make_unique<LossModel>(options.lossRate, options.lossBurst, seed);
+    }
+    auto viewer = std::make_shared<HeadlessViewer>(
+        viewerId, timings, std::move(loss), options.nack,
+        options.capKbps > 0 ? std::make_unique<RateCap>(options.capKbps) : nullptr);
+    std::string id = viewer->id;
+    BenchSender *from = &sender;
+    LoopbackSignaling *bus = &signaling;
+    auto sendAnswer = [bus, from, id](const std::string& sdp) {
+        bus->post(id, [from, id, sdp]() { from->acceptAnswer(id, sdp); });
+    };
+    auto sendViewerCandidate = [bus, from, id](const std::string& candidate) {
+        bus->post(id, [from, id, candidate]() { from->addCandidate(id, candidate); });
+    };
+    auto deliverOffer = [bus, viewer, sendAnswer, sendViewerCandidate](const std::string& sdp) {
+        viewer->offerSent();
+        bus->post(viewer->id, [viewer, sdp, sendAnswer, sendViewerCandidate]() {
+            viewer->acceptOffer(sdp, sendAnswer, sendViewerCandidate);
+        });
+    };
+    auto deliverCandidate = [bus, viewer](const std::string& candidate) {
+        bus->post(viewer->id, [viewer, candidate]() { viewer->addCandidate(candidate); });
+    };
+    signaling.post(id, [from, id, deliverOffer, deliverCandidate, timings]() {
+        if (!from->offer(id, deliverOffer, deliverCandidate)) {
+            timings->refused.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    return viewer;
+}
+
+// "viewers_100", or "viewers_100_channels_4" with several channels, so a
+// baseline only matches runs of the same shape.
+static std::string scenario_name(const char *kind, size_t viewerCount, const BenchOptions& options) {
+    std::string name = kind + std::to_string(viewerCount);
+    if (options.channels > 1) {
+        name += "_channels_" + std::to_string(options.channels);
+        if (options.enginePerChannel) {
+            name += "_split";
+        }
+    }
+    return name;
+}
+
+// Leaves, then gives the closes a moment before the next scenario.
+static void leave_all(const Channels& channels, LoopbackSignaling& signaling,
+                      const std::vector<std::shared_ptr<HeadlessViewer>>& viewers) {
+    for (size_t i = 0; i < viewers.size(); ++i) {
+        std::shared_ptr<HeadlessViewer> viewer = viewers[i];
+        std::string id = viewer->id;
+        BenchSender *from = &channel_for(channels, i);
+        signaling.post(id, [from, viewer, id]() {
+            from->leave(id);
+            viewer->close();
+        });
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (registered_peers(channels) > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
+// Joins `viewerCount` viewers at options.joinRate, waits for their video,
+// measures for options.duration, then removes them.
+static json run_scenario(const Channels& channels, LoopbackSignaling& signaling, size_t viewerCount,
+                         const BenchOptions& options) {
+    std::cerr << "Scenario: " << viewerCount << " viewers" << std::endl;
+    auto timings = std::make_shared<ScenarioTimings>(viewerCount);
+    std::vector<std::shared_ptr<HeadlessViewer>> viewers;
+    uint64_t messagesBefore = signaling.messageCount();
+    std::shared_ptr<LatencyStats> signalingDelays = signaling.startScenario();
+    static uint64_t nextRun = 0;
+    std::string prefix = "bench" + std::to_string(nextRun++) + "-";
+
+    PeerConnectionManager::PoolStats poolBefore = pool_stats(channels);
+    auto joinStart = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < viewerCount; ++i) {
+        viewers.push_back(join_viewer(channel_for(channels, i), signaling, prefix + std::to_string(i), timings, options,
+                                      static_cast<uint32_t>(i)));
+        auto due = joinStart + std::chrono::microseconds(static_cast<int64_t>((i + 1) * 1e6 / options.joinRate));
+        std::this_thread::sleep_until(due);
+    }
+
+    // Wait for video on every viewer, or give up after the timeout
+    auto deadline = std::chrono::steady_clock::now() + options.joinTimeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        size_t watching = std::count_if(viewers.begin(), viewers.end(),
+                                        [](const auto& viewer) { return viewer->hasVideo(); });
+        if (watching + timings->refused.load() >= viewerCount) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    PeerConnectionManager::PoolStats poolAfter = pool_stats(channels);
+    double joinSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - joinStart).count();
+    uint64_t joinMessages = signaling.messageCount() - messagesBefore;
+
+    std::vector<HeadlessViewer::Counters> before;
+    for (const auto& viewer : viewers) {
+        before.push_back(viewer->counters());
+    }
+    SenderSnapshot start = SenderSnapshot::take(channels);
+    std::this_thread::sleep_for(options.duration);
+    SenderSnapshot end = SenderSnapshot::take(channels);
+
+    size_t connected = 0;
+    size_t watching = 0;
+    uint64_t received = 0;
+    uint64_t expected = 0;
+    uint64_t bytes = 0;
+    uint64_t invalid = 0;
+    FecScore::Counters fec{};
+    uint64_t nackRequests = 0;
+    uint64_t nackRepaired = 0;
+    uint64_t nackAbandoned = 0;
+    for (size_t i = 0; i < viewers.size(); ++i) {
+        HeadlessViewer::Counters after = viewers[i]->counters();
+        nackRequests += after.nackRequests - before[i].nackRequests;
+        nackRepaired += after.nackRepaired - before[i].nackRepaired;
+        nackAbandoned += after.nackAbandoned - before[i].nackAbandoned;
+        fec.frames += after.fec.frames - before[i].fec.frames;
+        fec.framesIntact += after.fec.framesIntact - before[i].fec.framesIntact;
+        fec.framesRecovered += after.fec.framesRecovered - before[i].fec.framesRecovered;
+        fec.mediaPackets += after.fec.mediaPackets - before[i].fec.mediaPackets;
+        fec.mediaLost += after.fec.mediaLost - before[i].fec.mediaLost;
+        fec.mediaUnrecovered += after.fec.mediaUnrecovered - before[i].fec.mediaUnrecovered;
+        fec.mediaBytes += after.fec.mediaBytes - before[i].fec.mediaBytes;
+        fec.fecBytes += after.fec.fecBytes - before[i].fec.fecBytes;
+        fec.mismatches += after.fec.mismatches - before[i].fec.mismatches;
+        connected += viewers[i]->isConnected();
+        watching += viewers[i]->hasVideo();
+        received += after.received - before[i].received;
+        expected += after.expected - before[i].expected;
+        bytes += after.bytes - before[i].bytes;
+        invalid += after.invalid;
+    }
+
+    double seconds = std::chrono::duration<double>(end.time - start.time).count();
+    double cpuPercent = 100 * (end.cpuSeconds - start.cpuSeconds) / seconds;
+    double ingestRate = (end.ingestPackets - start.ingestPackets) / seconds;
+    // Each viewer gets one channel's stream
+    double channelIngestRate = ingestRate / channels.size();
+    size_t fanoutWorkers = 0;
+    for (size_t i = 0; i < channels.size(); ++i) {
+        if (i == 0 || channels[i]->ownsFanout) {
+            fanoutWorkers += channels[i]->fanout->getConfig().workerCount;
+        }
+    }
+    uint64_t sent = end.sent - start.sent;
+    uint64_t ingested = end.ingestPackets - start.ingestPackets;
+    json result = {
+        {"scenario", scenario_name("viewers_", viewerCount, options)},
+        {"pipeline", options.videoPath.empty() ? "testsrc" : options.passthrough ? "passthrough" : "transcode"},
+        {"viewers", viewerCount},
+        {"channels", channels.size()},
+        {"fanout", options.enginePerChannel ? "per_channel" : "shared"},
+        {"connected", connected},
+        {"receiving_video", watching},
+        {"refused", timings->refused.load()},
+        {"duration_s", seconds},
+        {"cpus", std::thread::hardware_concurrency()},
+        {"fanout_workers", fanoutWorkers},
+        {"join_offer_ms", latency_json(timings->offer.summary())},
+        {"join_pool_hits", poolAfter.hits - poolBefore.hits},
+        {"join_pool_misses", poolAfter.misses - poolBefore.misses},
+        {"join_connected_ms", latency_json(timings->connected.summary())},
+        {"join_first_frame_ms", latency_json(timings->firstFrame.summary())},
+        {"frame_delay_ms", latency_json(timings->frameDelay.summary())},
+        {"ingest_packets_per_s", ingestRate},
+        {"ingest_kbps", (end.ingestBytes - start.ingestBytes) * 8 / seconds / 1000},
+        // Should not grow with the viewer count
+        {"ingest_allocations_per_packet",
+         ingested > 0 ? double(end.ingestAllocations - start.ingestAllocations) / ingested : 0.0},
+        {"packet_pool_size", RtpPacketPool::instance().allocatedCount()},
+        {"registered_peers", registered_peers(channels)},
+        {"dispatch_ns_per_packet", end.dispatchPackets > start.dispatchPackets
+             ? double(end.dispatchNanos - start.dispatchNanos) / (end.dispatchPackets - start.dispatchPackets) : 0.0},
+        {"delivered_packets_per_s", received / seconds},
+        {"delivered_mbps", bytes * 8 / seconds / 1e6},
+        // Packets received over packets ingested times viewers with video
+        {"delivery_ratio", watching > 0 && ingestRate > 0 ? received / seconds / (channelIngestRate * watching) : 0.0},
+        {"loss_ratio", expected > 0 ? double(expected - std::min(expected, received)) / expected : 0.0},
+        {"invalid_packets", invalid},
+        {"queue_drops", end.dropped - start.dropped},
+        {"cpu_percent", cpuPercent},
+        {"cpu_percent_per_viewer", viewerCount > 0 ? cpuPercent / viewerCount : 0.0},
+        // Viewers one fully busy core would carry at this load
+        {"viewers_per_core", cpuPercent > 0 ? watching * 100 / cpuPercent : 0.0},
+        {"send_us_per_packet", sent > 0 ? (end.sendSeconds - start.sendSeconds) * 1e6 / sent : 0.0},
+        {"signaling_messages", signaling.messageCount() - messagesBefore},
+        // Offers, answers and candidates while the viewers were joining
+        {"join_phase_s", joinSeconds},
+        {"signaling_messages_per_s", joinSeconds > 0 ? joinMessages / joinSeconds : 0.0},
+        {"signaling_queue_ms", latency_json(signalingDelays->summary())},
+    };
+    if (options.lossRate > 0 || options.fecPercent) {
+        // Recovered frames against what the FEC cost, over the window
+        auto ratio = [](uint64_t part, uint64_t whole) { return whole > 0 ? double(part) / whole : 0.0; };
+        uint64_t framesLost = fec.frames - fec.framesIntact - fec.framesRecovered;
+        result["fec_percent"] = options.fecPercent.value_or(0);
+        result["simulated_loss"] = options.lossRate;
+        result["simulated_burst"] = options.lossBurst;
+        result["frames"] = fec.frames;
+        result["frames_intact"] = fec.framesIntact;
+        result["frames_recovered"] = fec.framesRecovered;
+        result["frames_lost"] = framesLost;
+        result["frame_loss_ratio"] = ratio(framesLost, fec.frames);
+        result["media_loss_before_fec"] = ratio(fec.mediaLost, fec.mediaPackets);
+        result["media_loss_after_fec"] = ratio(fec.mediaUnrecovered, fec.mediaPackets);
+        result["fec_overhead"] = ratio(fec.fecBytes, fec.mediaBytes);
+        result["fec_mismatches"] = fec.mismatches;
+    }
+    if (channels.front()->bitrateMetrics()) {
+        // Encoder figures are means over the channels, counts are totals
+        std::vector<uint32_t> estimates;
+        BitrateController::Metrics abr{};
+        uint64_t targetKbpsSum = 0;
+        for (const auto& sender : channels) {
+            for (const ViewerBandwidthStats& viewer : sender->peers.getBandwidthStats()) {
+                estimates.push_back(viewer.estimateKbps);
+            }
+            if (auto metrics = sender->bitrateMetrics()) {
+                targetKbpsSum += metrics->targetKbps;
+                abr.increases += metrics->increases;
+                abr.decreases += metrics->decreases;
+            }
+        }
+        std::sort(estimates.begin(), estimates.end());
+        uint64_t updates = end.bitrateUpdates - start.bitrateUpdates;
+        result["cap_kbps"] = options.capKbps;
+        result["encoder_kbps"] = targetKbpsSum / channels.size();
+        result["encoder_kbps_mean"] = updates > 0 ? double(end.bitrateKbpsSum - start.bitrateKbpsSum) / updates : 0.0;
+        result["estimate_kbps_min"] = estimates.empty() ? 0 : estimates.front();
+        result["estimate_kbps_p50"] = estimates.empty() ? 0 : estimates[estimates.size() / 2];
+        result["bitrate_increases"] = abr.increases;
+        result["bitrate_decreases"] = abr.decreases;
+    }
+    if (options.nack && options.lossRate > 0) {
+        // loss_ratio above is what is still missing after retransmission
+        result["nack_requests"] = nackRequests;
+        result["nack_repaired"] = nackRepaired;
+        result["nack_abandoned"] = nackAbandoned;
+        result["nack_repair_ratio"] = nackRepaired + nackAbandoned > 0
+                                          ? double(nackRepaired) / (nackRepaired + nackAbandoned) : 0.0;
+        result["nack_repair_ms"] = latency_json(timings->nackRepair.summary());
+    }
+
+    leave_all(channels, signaling, viewers);
+    return result;
+}
+
+// Keeps `viewerCount` viewers watching for options.churn while, at
+// options.churnRate, one of them drops its connection without a leave (a
+// closed tab) and a new one joins. The sender's lifecycle has to evict the
+// dropped ones; RSS and descriptors are sampled once everyone settles at the
+// start and again after the churn, and should come out flat.
+static json run_churn(const Channels& channels, LoopbackSignaling& signaling, size_t viewerCount,
+                      const BenchOptions& options) {
+    std::cerr << "Churn: " << viewerCount << " viewers for " << options.churn.count() << " s" << std::endl;
+    auto timings = std::make_shared<ScenarioTimings>(viewerCount);
+    std::vector<std::shared_ptr<HeadlessViewer>> viewers;
+    static uint64_t nextRun = 0;
+    std::string prefix = "churn" + std::to_string(nextRun++) + "-";
+    uint64_t joined = 0;
+    auto joinStart = std::chrono::steady_clock::now();
+    for (; joined < viewerCount; ++joined) {
+        viewers.push_back(join_viewer(channel_for(channels, joined), signaling, prefix + std::to_string(joined),
+                                      timings, options,
+                                      static_cast<uint32_t>(joined)));
+        auto due = joinStart + std::chrono::microseconds(static_cast<int64_t>((joined + 1) * 1e6 / options.joinRate));
+        std::this_thread::sleep_until(due);
+    }
+
+    // Past the disconnect grace, the peers still registered are the live ones
+    const auto settle = LifecycleConfig().disconnectGrace + std::chrono::seconds(5);
+    auto waitToSettle = [&]() {
+        auto deadline = std::chrono::steady_clock::now() + settle + options.joinTimeout;
+        std::this_thread::sleep_for(settle);
+        while (std::chrono::steady_clock::now() < deadline) {
+            size_t watching = std::count_if(viewers.begin(), viewers.end(),
+                                            [](const auto& viewer) { return viewer->hasVideo(); });
+            if (watching + timings->refused.load() >= viewers.size() &&
+                registered_peers(channels) <= viewers.size()) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    };
+    waitToSettle();
+    double rssStart = resident_mb();
+    size_t fdsStart = open_descriptors();
+    double rssMax = rssStart;
+    size_t fdsMax = fdsStart;
+    PeerConnectionManager::LifecycleStats lifecycleStart = lifecycle_stats(channels);
+
+    std::mt19937 random(1);
+    uint64_t dropped = 0;
+    auto churnStart = std::chrono::steady_clock::now();
+    auto nextSample = churnStart + std::chrono::seconds(1);
+    for (uint64_t i = 0; !viewers.empty() && std::chrono::steady_clock::now() < churnStart + options.churn; ++i) {
+        size_t index = std::uniform_int_distribution<size_t>(0, viewers.size() - 1)(random);
+        std::shared_ptr<HeadlessViewer> gone = std::move(viewers[index]);
+        signaling.post(gone->id, [gone]() { gone->close(); });
+        ++dropped;
+        viewers[index] = join_viewer(channel_for(channels, index), signaling, prefix + std::to_string(joined),
+                                     timings, options,
+                                     static_cast<uint32_t>(joined));
+        ++joined;
+
+        if (std::chrono::steady_clock::now() >= nextSample) {
+            rssMax = std::max(rssMax, resident_mb());
+            fdsMax = std::max(fdsMax, open_descriptors());
+            nextSample += std::chrono::seconds(1);
+        }
+        auto due = churnStart + std::chrono::microseconds(static_cast<int64_t>((i + 1) * 1e6 / options.churnRate));
+        std::this_thread::sleep_until(due);
+    }
+    double churnSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - churnStart).count();
+
+    waitToSettle();
+    double rssEnd = resident_mb();
+    size_t fdsEnd = open_descriptors();
+    PeerConnectionManager::LifecycleStats lifecycleEnd = lifecycle_stats(channels);
+    size_t watching = std::count_if(viewers.begin(), viewers.end(),
+                                    [](const auto& viewer) { return viewer->hasVideo(); });
+    json result = {
+        {"scenario", scenario_name("churn_", viewerCount, options)},
+        {"viewers", viewerCount},
+        {"channels", channels.size()},
+        {"churn_s", churnSeconds},
+        {"joined", joined},
+        {"dropped", dropped},
+        {"receiving_video", watching},
+        {"refused", timings->refused.load()},
+        {"registered_peers", registered_peers(channels)},
+        {"evicted", lifecycleEnd.evicted - lifecycleStart.evicted},
+        {"timed_out", lifecycleEnd.timedOut - lifecycleStart.timedOut},
+        {"zombies", lifecycleEnd.zombies},
+        {"join_first_frame_ms", latency_json(timings->firstFrame.summary())},
+        {"packet_pool_size", RtpPacketPool::instance().allocatedCount()},
+        {"rss_mb_start", rssStart},
+        {"rss_mb_end", rssEnd},
+        {"rss_mb_max", std::max(rssMax, rssEnd)},
+        {"rss_growth_mb", rssEnd - rssStart},
+        {"fds_start", fdsStart},
+        {"fds_end", fdsEnd},
+        {"fds_max", std::max(fdsMax, fdsEnd)},
+        {"fd_growth", static_cast<double>(fdsEnd) - static_cast<double>(fdsStart)},
+    };
+    leave_all(channels, signaling, viewers);
+    return result;
+}
+
+// Metrics where a higher value is worse, and where a lower one is. Small
+// absolute changes are ignored so near-zero values do not flap.
+static std::vector<std::string> compare_to_baseline(const json& result, const json& baseline, double tolerance) {
+    struct Check {
+        const char *name;
+        std::function<double(const json&)> value;
+        bool higherIsWorse;
+        double slack;
+    };
+    auto field = [](const char *key) { return [key](const json& j) { return j.at(key).get<double>(); }; };
+    auto p99 = [](const char *key) { return [key](const json& j) { return j.at(key).at("p99").get<double>(); }; };
+    const std::vector<Check> checks = {
+        {"delivery_ratio", field("delivery_ratio"), false, 0.01},
+        {"loss_ratio", field("loss_ratio"), true, 0.005},
+        {"cpu_percent_per_viewer", field("cpu_percent_per_viewer"), true, 0.05},
+        {"send_us_per_packet", field("send_us_per_packet"), true, 1},
+        {"ingest_allocations_per_packet", field("ingest_allocations_per_packet"), true, 0.1},
+        {"dispatch_ns_per_packet", field("dispatch_ns_per_packet"), true, 100},
+        {"join_offer_ms.p99", p99("join_offer_ms"), true, 20},
+        {"join_first_frame_ms.p99", p99("join_first_frame_ms"), true, 50},
+        {"frame_loss_ratio", field("frame_loss_ratio"), true, 0.005},
+        {"frame_delay_ms.p99", p99("frame_delay_ms"), true, 5},
+        {"rss_growth_mb", field("rss_growth_mb"), true, 16},
+        {"fd_growth", field("fd_growth"), true, 4},
+    };
+    std::vector<std::string> regressions;
+    for (const Check& check : checks) {
+        double now = 0;
+        double before = 0;
+        try {
+            now = check.value(result);
+            before = check.value(baseline);
+        } catch (const std::exception&) {
+            continue;  // older baseline without this metric
+        }
+        double limit = check.higherIsWorse ? before * (1 + tolerance) + check.slack
+                                           : before * (1 - tolerance) - check.slack;
+        if (check.higherIsWorse ? now > limit : now < limit) {
+            regressions.push_back(std::string(check.name) + " " + std::to_string(before) + " -> " +
+                                  std::to_string(now));
+        }
+    }
+    return regressions;
+}
+
+// The last result per scenario in a JSON-lines file.
+static std::map<std::string, json> load_baseline(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Cannot open baseline: " + path);
+    }
+    std::map<std::string, json> results;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        json result = json::parse(line);
+        results[result.at("scenario").get<std::string>()] = result;
+    }
+    return results;
+}
+
+static void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "Prints one JSON line per scenario on stdout; progress and warnings go to stderr." << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --viewers=N,...            viewer counts to run (default: 1,10,100,1000)" << std::endl;
+    std::cerr << "  --duration=S               measurement time per scenario (default: 10)" << std::endl;
+    std::cerr << "  --join-rate=N              viewers joining per second (default: 100)" << std::endl;
+    std::cerr << "  --join-timeout=S           time allowed for every viewer to get video (default: 30)" << std::endl;
+    std::cerr << "  --resolution=WxH           videotestsrc size (default: 640x360)" << std::endl;
+    std::cerr << "  --fps=N                    frames per second (default: 30)" << std::endl;
+    std::cerr << "  --bitrate=KBPS             x264enc bitrate (default: 1000)" << std::endl;
+    std::cerr << "  --video=FILE               stream an MP4 in a loop instead of videotestsrc" << std::endl;
+    std::cerr << "  --pipeline=transcode|passthrough  how --video is sent, as in peer1 (default: transcode)" << std::endl;
+    std::cerr << "  --fanout-workers=N         send worker threads (default: CPU count)" << std::endl;
+    std::cerr << "  --queue-capacity=N         per-viewer send queue, in packets, 1-65536 (default: 4096)" << std::endl;
+    std::cerr << "  --pc-pool=N                pre-created sender connections over all channels (default: 8)" << std::endl;
+    std::cerr << "  --signaling-threads=N      threads of the signaling stand-in (default: 4)" << std::endl;
+    std::cerr << "  --output=FILE              also append the JSON lines to FILE" << std::endl;
+    std::cerr << "  --baseline=FILE            compare with an earlier output; exit 2 on regressions" << std::endl;
+    std::cerr << "  --tolerance=R              relative change allowed against the baseline (default: 0.2)" << std::endl;
+    std::cerr << "  --fec=PERCENT              send ULPFEC/RED with PERCENT FEC packets per 100 media packets" << std::endl;
+    std::cerr << "  --loss=RATE[:BURST]        drop packets at each viewer once it has video, in bursts of BURST" << std::endl;
+    std::cerr << "                             packets on average, and score FEC recovery (default: 0)" << std::endl;
+    std::cerr << "  --nack                     viewers NACK what --loss drops, and retransmissions are scored" << std::endl;
+    std::cerr << "  --cap=KBPS                 a bottleneck of KBPS in front of each viewer; implies --abr" << std::endl;
+    std::cerr << "  --abr                      drive x264enc from the weakest viewer's estimate, as peer1's --abr=min" << std::endl;
+    std::cerr << "  --max-bitrate=KBPS         ceiling of the estimates with --abr (default: 2500)" << std::endl;
+    std::cerr << "  --channels=N               N senders, each with its own pipeline and viewers (default: 1)" << std::endl;
+    std::cerr << "  --fanout-per-channel       give each channel its own fan-out engine, as separate processes have" << std::endl;
+    std::cerr << "  --pin-workers              pin fan-out worker i to the i-th allowed CPU" << std::endl;
+    std::cerr << "  --churn=S                  instead of the scenarios, soak each viewer count for S seconds while" << std::endl;
+    std::cerr << "                             viewers drop and rejoin, and report RSS and descriptor growth" << std::endl;
+    std::cerr << "  --churn-rate=N             viewers dropped and replaced per second with --churn (default: 10)" << std::endl;
+    std::cerr << "  --log-level=debug|info|warn|error  (default: warn)" << std::endl;
+}
+
+static BenchOptions parse_options(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            throw std::runtime_error("Unexpected argument: " + arg);
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "viewers") {
+            options.viewerCounts.clear();
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t end = value.find(',', start);
+                options.viewerCounts.push_back(std::stoul(value.substr(start, end == std::string::npos ? end : end - start)));
+                if (end == std::string::npos) {
+                    break;
+                }
+                start = end + 1;
+            }
+        } else if (name == "duration") {
+            options.duration = std::chrono::seconds(std::stoul(value));
+        } else if (name == "join-rate") {
+            options.joinRate = std::stod(value);
+            if (options.joinRate <= 0) {
+                throw std::runtime_error("--join-rate must be positive");
+            }
+        } else if (name == "join-timeout") {
+            options.joinTimeout = std::chrono::seconds(std::stoul(value));
+        } else if (name == "resolution") {
+            size_t x = value.find('x');
+            if (x == std::string::npos) {
+                throw std::runtime_error("Invalid --resolution, expected WxH: " + value);
+            }
+            options.width = std::stoul(value.substr(0, x));
+            options.height = std::stoul(value.substr(x + 1));
+        } else if (name == "fps") {
+            options.fps = std::max(1ul, std::stoul(value));
+        } else if (name == "bitrate") {
+            options.bitrateKbps = std::stoul(value);
+        } else if (name == "video") {
+            options.videoPath = value;
+        } else if (name == "pipeline") {
+            if (value != "transcode" && value != "passthrough") {
+                throw std::runtime_error("Invalid --pipeline value: " + value);
+            }
+            options.passthrough = value == "passthrough";
+        } else if (name == "fanout-workers") {
+            options.fanout.workerCount = std::stoul(value);
+        } else if (name == "queue-capacity") {
+            options.fanout.queueCapacity = std::stoul(value);
+            if (options.fanout.queueCapacity < 1 || options.fanout.queueCapacity > ViewerQueue::kMaxCapacity) {
+                throw std::runtime_error("--queue-capacity must be between 1 and " +
+                                         std::to_string(ViewerQueue::kMaxCapacity) + ": " + value);
+            }
+        } else if (name == "pc-pool") {
+            options.poolSize = std::stoul(value);
+        } else if (name == "signaling-threads") {
+            options.signalingThreads = std::stoul(value);
+        } else if (name == "output") {
+            options.outputPath = value;
+        } else if (name == "baseline") {
+            options.baselinePath = value;
+        } else if (name == "fec") {
+            options.fecPercent = std::min(100ul, std::stoul(value));
+        } else if (name == "loss") {
+            size_t colon = value.find(':');
+            options.lossRate = std::stod(value.substr(0, colon));
+            if (colon != std::string::npos) {
+                options.lossBurst = std::stod(value.substr(colon + 1));
+            }
+            if (options.lossRate < 0 || options.lossRate >= 1 || options.lossBurst < 1) {
+                throw std::runtime_error("Invalid --loss, expected RATE in [0, 1) and BURST >= 1: " + value);
+            }
+        } else if (name == "nack") {
+            options.nack = true;
+        } else if (name == "cap") {
+            options.capKbps = std::stoul(value);
+            options.adaptiveBitrate = options.adaptiveBitrate || options.capKbps > 0;
+        } else if (name == "abr") {
+            options.adaptiveBitrate = true;
+        } else if (name == "max-bitrate") {
+            options.maxBitrateKbps = std::stoul(value);
+        } else if (name == "channels") {
+            options.channels = std::max(1ul, std::stoul(value));
+        } else if (name == "fanout-per-channel") {
+            options.enginePerChannel = true;
+        } else if (name == "pin-workers") {
+            options.fanout.pinWorkers = true;
+        } else if (name == "churn") {
+            options.churn = std::chrono::seconds(std::stoul(value));
+        } else if (name == "churn-rate") {
+            options.churnRate = std::stod(value);
+            if (options.churnRate <= 0) {
+                throw std::runtime_error("--churn-rate must be positive");
+            }
+        } else if (name == "tolerance") {
+            options.tolerance = std::stod(value);
+        } else if (name == "log-level") {
+            if (value == "debug") {
+                options.logLevel = LogLevel::Debug;
+            } else if (value == "info") {
+                options.logLevel = LogLevel::Info;
+            } else if (value == "warn") {
+                options.logLevel = LogLevel::Warn;
+            } else if (value == "error") {
+                options.logLevel = LogLevel::Error;
+            } else {
+                throw std::runtime_error("Invalid --log-level value: " + value);
+            }
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+    BenchOptions options;
+    std::map<std::string, json> baseline;
+    try {
+        options = parse_options(argc, argv);
+        if (!options.baselinePath.empty()) {
+            baseline = load_baseline(options.baselinePath);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    // Info logs would go to stdout with the results
+    Logger::instance().setLevel(options.logLevel);
+    raise_descriptor_limit();
+
+    int status = 0;
+    try {
+        LoopbackSignaling signaling;
+        signaling.start(options.signalingThreads);
+        // One engine for every channel, as peer1 --channels runs them
+        std::shared_ptr<FanoutEngine> engine;
+        if (!options.enginePerChannel) {
+            engine = std::make_shared<FanoutEngine>();
+            engine->start(options.fanout);
+        }
+        Channels channels;
+        for (size_t i = 0; i < options.channels; ++i) {
+            channels.push_back(std::make_unique<BenchSender>());
+            // --pc-pool split evenly, as peer1 splits it before any joins
+            size_t poolSize = options.poolSize / options.channels + (i < options.poolSize % options.channels);
+            channels.back()->start(options, poolSize, engine);
+        }
+        // Let the encoder settle and the pool fill before the first join
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+
+        std::ofstream output;
+        if (!options.outputPath.empty()) {
+            output.open(options.outputPath, std::ios::app);
+        }
+        for (size_t viewerCount : options.viewerCounts) {
+            json result = options.churn.count() > 0 ? run_churn(channels, signaling, viewerCount, options)
+                                                    : run_scenario(channels, signaling, viewerCount, options);
+            result["timestamp"] = static_cast<int64_t>(std::time(nullptr));
+            std::cout << result.dump() << std::endl;
+            if (output) {
+                output << result.dump() << std::endl;
+            }
+            auto it = baseline.find(result["scenario"].get<std::string>());
+            if (it == baseline.end()) {
+                continue;
+            }
+            for (const std::string& regression : compare_to_baseline(result, it->second, options.tolerance)) {
+                std::cerr << "Regression in " << it->first << ": " << regression << std::endl;
+                status = 2;
+            }
+        }
+
+        signaling.stop();
+        for (const auto& sender : channels) {
+            sender->stop();
+        }
+        if (engine) {
+            engine->stop();
+        }
+    } catch (const std::exception& e) {
+        log_error(benchLog, {}, "Fatal error: ", e.what());
+        status = 1;
+    }
+    Logger::instance().stop();
+    return status;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "logger.hpp"
+
+inline LogCategory executorLog("executor");
+
+// Runs tasks on a fixed thread pool, serially per key: tasks for one key
+// never overlap and run in the order posted, while different keys run in
+// parallel. Keys take turns one task at a time, so a viewer with a long
+// backlog does not starve the others.
+class StrandExecutor {
+public:
+    using Task = std::function<void()>;
+
+    StrandExecutor() {}
+    ~StrandExecutor() { stop(); }
+
+    void start(size_t threadCount) {
+        stop();
+        stopping = false;
+        for (size_t i = 0; i < std::max<size_t>(1, threadCount); ++i) {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+
+    // Pending tasks are dropped.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            strands.clear();
+            ready.clear();
+        }
+        cv.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    void post(const std::string& key, Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Strand& strand = strands[key];
+            strand.tasks.push_back(std::move(task));
+            if (strand.scheduled) {
+                return;
+            }
+            strand.scheduled = true;
+            ready.push_back(key);
+        }
+        cv.notify_one();
+    }
+
+    size_t pendingTasks() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t pending = 0;
+        for (const auto& [_, strand] : strands) {
+            pending += strand.tasks.size();
+        }
+        return pending;
+    }
+
+private:
+    // A strand stays `scheduled` from the moment it enters `ready` until it
+    // runs out of tasks, including while one of its tasks is running.
+    struct Strand {
+        std::deque<Task> tasks;
+        bool scheduled = false;
+    };
+
+    void run() {
+        while (true) {
+            std::string key;
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stopping || !ready.empty(); });
+                if (stopping) {
+                    return;
+                }
+                key = std::move(ready.front());
+                ready.pop_front();
+                Strand& strand = strands[key];
+                task = std::move(strand.tasks.front());
+                strand.tasks.pop_front();
+            }
+
+            try {
+                task();
+            } catch (const std::exception& e) {
+                log_error(executorLog, {{"key", key}}, "Error in task: ", e.what());
+            }
+
+            bool more = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = strands.find(key);
+                if (it == strands.end()) {
+                    continue;  // stopped meanwhile
+                }
+                if (it->second.tasks.empty()) {
+                    strands.erase(it);
+                } else {
+                    ready.push_back(key);
+                    more = true;
+                }
+            }
+            if (more) {
+                cv.notify_one();
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Strand> strands;
+    std::deque<std::string> ready;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
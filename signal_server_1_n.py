@@ -1,4 +1,5 @@
 import asyncio
+import sys
 import websockets
 import json
 import uuid
@@ -49,12 +50,19 @@ async def signaling_handler(websocket, path):
         connected_clients[client_id] = {
             "websocket": websocket,
             "type": client_type,
-            "ip": client_ip
+            "ip": client_ip,
+            # Channel the viewer wants to watch; None leaves the choice to the sender
+            "channel": data.get("channel"),
+            # Seconds behind live to start at and how fast to catch up, for a DVR
+            "delay": data.get("delay"),
+            "catchup": data.get("catchup")
         }
 
         log(f"{client_type.upper()} {client_id} registered from {client_ip}")
 
         if client_type == "sender":
+            if data.get("channels"):
+                log(f"Sender serves channels: {', '.join(data['channels'])}")
             if SENDER_CLIENT:
                 log("Replacing existing sender", "WARN")
             SENDER_CLIENT = client_id
@@ -101,10 +109,15 @@ async def process_signaling_message(client_id: str, data: dict):
     elif "candidate" in data:
         await handle_ice_candidate(client_id, client_type, data)
 
+    elif data.get("type") == "rejected" and client_type == "sender" and data.get("target_id"):
+        await forward_to_client(data["target_id"], data, client_id, data.get("session_id"), "REJECTED")
+
     elif data.get("type") == "create_new_offer" and client_type == "viewer":
+        remember_viewer_options(client_id, data)
         await request_offer_from_sender(client_id)
 
     elif data.get("type") == "viewer_joined" and client_type == "viewer":
+        remember_viewer_options(client_id, data)
         await notify_sender_of_new_viewer(client_id)
 
 async def handle_sdp(client_id: str, client_type: str, data: dict):
@@ -166,14 +179,29 @@ async def forward_to_client(target_id: str, data: dict, sender_id: str, session_
 
 # ====== Sender/Viewer Communication ======
 
+# What a viewer asked for that the sender needs when creating its offer
+VIEWER_OPTIONS = ("channel", "delay", "catchup")
+
+def remember_viewer_options(viewer_id: str, data: dict):
+    for key in VIEWER_OPTIONS:
+        if key in data:
+            connected_clients[viewer_id][key] = data[key]
+
+def with_viewer_options(message: dict, viewer_id: str) -> dict:
+    viewer = connected_clients.get(viewer_id, {})
+    for key in VIEWER_OPTIONS:
+        if viewer.get(key):
+            message[key] = viewer[key]
+    return message
+
 async def notify_sender_of_new_viewer(viewer_id: str):
     if SENDER_CLIENT and SENDER_CLIENT in connected_clients:
         try:
-            await connected_clients[SENDER_CLIENT]["websocket"].send(json.dumps({
+            await connected_clients[SENDER_CLIENT]["websocket"].send(json.dumps(with_viewer_options({
                 "type": "viewer_joined",
                 "viewer_id": viewer_id,
                 "session_id": generate_session_id()
-            }))
+            }, viewer_id)))
             log(f"Notified sender of new viewer {viewer_id}")
         except Exception as e:
             log(f"Failed to notify sender: {e}", "ERROR")
@@ -181,11 +209,11 @@ async def notify_sender_of_new_viewer(viewer_id: str):
 async def request_offer_from_sender(viewer_id: str):
     if SENDER_CLIENT and SENDER_CLIENT in connected_clients:
         try:
-            await connected_clients[SENDER_CLIENT]["websocket"].send(json.dumps({
+            await connected_clients[SENDER_CLIENT]["websocket"].send(json.dumps(with_viewer_options({
                 "type": "create_new_offer",
                 "viewer_id": viewer_id,
                 "session_id": generate_session_id()
-            }))
+            }, viewer_id)))
             log(f"{viewer_id} requested new offer from sender")
         except Exception as e:
             log(f"Request offer error: {e}", "ERROR")
@@ -229,7 +257,8 @@ async def cleanup_client(client_id: str, client_type: str):
 
 async def main():
     host = "0.0.0.0"
-    port = 8765
+    # One server per tier when relays run on the same machine
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8765
     log(f"Starting signaling server on ws://{host}:{port}")
     async with websockets.serve(signaling_handler, host, port):
         await asyncio.Future()